@@ -1,19 +1,81 @@
 #pragma once
 #include "zeroerr.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <deque>
+#include <functional>
+#include <istream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <string>
 #include <type_traits>
+#include <thread>
 #include <typeindex>
+#include <unordered_map>
+#include <vector>
 
 #define COMPONENT(T, name) \
   ecs::ComponentRef<T> name() { return ecs::ComponentRef<T>(this); }
 
+#define COMPONENT_DOUBLE_BUFFERED(T, name) \
+  ecs::DoubleBufferedRef<T> name() { return ecs::DoubleBufferedRef<T>(this); }
+
+#define SHARED_COMPONENT(T, name) \
+  ecs::SharedComponentRef<T> name() { return ecs::SharedComponentRef<T>(this); }
+
+#define TAG(Name) \
+  struct Name : ecs::Tag \
+  {                      \
+  };
+
 #define OPTIONAL_COMPONENT(T, name) \
   ecs::OptionalComponentRef<T> name() { return ecs::OptionalComponentRef<T>(this); }
 
+// 按线程分片的数据结构（耗时直方图、事件通道等）的分片数量，超过这个数量的线程会共享分片
+#ifndef ECS_MAX_THREADS
+#define ECS_MAX_THREADS 16
+#endif
+
+// 变更追踪按块记录版本号，每块包含 2^ECS_CHUNK_SHIFT 行
+#ifndef ECS_CHUNK_SHIFT
+#define ECS_CHUNK_SHIFT 8
+#endif
+
+// CommandQueue 中每条请求可以携带的闭包大小上限（字节）
+#ifndef ECS_COMMAND_PAYLOAD
+#define ECS_COMMAND_PAYLOAD 48
+#endif
+
+// 快照文件是否通过 mmap 映射，没有 mmap 的平台把整个文件读入内存
+#ifndef ECS_HAS_MMAP
+#if defined(__unix__) || defined(__APPLE__)
+#define ECS_HAS_MMAP 1
+#else
+#define ECS_HAS_MMAP 0
+#endif
+#endif
+
+#if ECS_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
 #define ENTITY(T, BASE)                                       \
   using super = BASE;                                         \
   ecs::IComponentManager &getComponentManager() const override \
@@ -27,11 +89,309 @@ namespace ecs
 
   class IComponentManager;
   template <typename T>
+  class CommonComponentBuffer;
+  template <typename T>
   class ComponentBuffer;
   template <typename T>
   class RegistryComponentBuffer;
   template <typename T>
   class BufferIterator;
+  template <typename T>
+  class TagBuffer;
+  template <typename T>
+  class TagRef;
+  template <typename T>
+  class SharedBuffer;
+  template <typename T>
+  class Column;
+
+  constexpr uint32_t kChunkShift = ECS_CHUNK_SHIFT;
+  constexpr uint32_t kChunkSize = 1u << kChunkShift;
+  constexpr uint32_t kChunkMask = kChunkSize - 1;
+
+  // v 不能为 0
+  inline uint32_t Clz64(uint64_t v)
+  {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(v);
+#else
+    uint32_t n = 0;
+    for (uint64_t bit = uint64_t(1) << 63; (v & bit) == 0; bit >>= 1)
+      ++n;
+    return n;
+#endif
+  }
+
+  // v 不能为 0
+  inline uint32_t Ctz64(uint64_t v)
+  {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(v);
+#else
+    uint32_t n = 0;
+    for (uint64_t bit = 1; (v & bit) == 0; bit <<= 1)
+      ++n;
+    return n;
+#endif
+  }
+
+  /**
+   * @brief Span 是一段连续内存的只读视图
+   */
+  template <typename T>
+  class Span
+  {
+  public:
+    Span() = default;
+    Span(T *data, size_t size) : ptr(data), len(size) {}
+
+    T *begin() const { return ptr; }
+    T *end() const { return ptr + len; }
+    T *data() const { return ptr; }
+    T &operator[](size_t i) const { return ptr[i]; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+
+  private:
+    T *ptr = nullptr;
+    size_t len = 0;
+  };
+
+  /**
+   * @brief 记录被修改过的行，每行在被取走之前只记录一次
+   */
+  class RowWatch
+  {
+  public:
+    void mark(uint32_t row)
+    {
+      if ((row >> 6) >= seen.size())
+        seen.resize((row >> 6) + 1, 0);
+      uint64_t bit = uint64_t(1) << (row & 63);
+      if (seen[row >> 6] & bit)
+        return;
+      seen[row >> 6] |= bit;
+      rows.push_back(row);
+    }
+
+    /// 对每个记录下来的行调用 f(row)，然后清空
+    template <typename F>
+    void drain(F &&f)
+    {
+      for (size_t i = 0; i < rows.size(); ++i)
+      {
+        seen[rows[i] >> 6] &= ~(uint64_t(1) << (rows[i] & 63));
+        f(rows[i]);
+      }
+      rows.clear();
+    }
+
+    bool empty() const { return rows.empty(); }
+
+  private:
+    std::vector<uint64_t> seen;
+    std::vector<uint32_t> rows;
+  };
+
+  // Entity::flags 的最高位表示实体已经被释放，它的编号会被之后创建的实体复用
+  constexpr uint32_t kEntityReleased = 0x80000000u;
+
+  /**
+   * @brief 组件的生命周期事件，用于注册观察者
+   */
+  enum class Lifecycle
+  {
+    Construct,
+    Update,
+    Destroy,
+  };
+
+  // 注册观察者时返回的句柄，用于之后注销
+  using ObserverId = uint32_t;
+
+  /**
+   * @brief 全局的世界版本号，所有的修改都会用当前版本号标记
+   */
+  inline std::atomic<uint32_t> &WorldVersionCounter()
+  {
+    static std::atomic<uint32_t> version{1};
+    return version;
+  }
+
+  inline uint32_t WorldVersion()
+  {
+    return WorldVersionCounter().load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief 推进世界版本号，返回推进之前的版本
+   *
+   * 调用之后发生的修改都会被标记为更大的版本号，所以可以把返回值保存下来，
+   * 下次用 Changed<T> / Added<T> 查询"从那之后"的变化
+   */
+  inline uint32_t AdvanceWorldVersion()
+  {
+    return WorldVersionCounter().fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Next<T> 用在 View 中，表示访问双缓冲组件 T 的后台缓冲（下一帧的数据）
+   */
+  template <typename T>
+  struct Next
+  {
+  };
+
+  /**
+   * @brief Changed<T> 用在 View 中，只遍历组件 T 在给定版本之后被修改过的行，以只读方式访问
+   */
+  template <typename T>
+  struct Changed
+  {
+  };
+
+  /**
+   * @brief Added<T> 用在 View 中，只遍历组件 T 在给定版本之后新增的行，以只读方式访问
+   */
+  template <typename T>
+  struct Added
+  {
+  };
+
+  /**
+   * @brief 所有用 TAG(Name) 声明的标签的基类，标签不占用组件存储，只在每个类中占一个比特
+   */
+  struct Tag
+  {
+  };
+
+  /**
+   * @brief With<T> / Without<T> 用在 View 中，只遍历带有 / 不带有标签 T 的实体
+   */
+  template <typename T>
+  struct With
+  {
+  };
+
+  template <typename T>
+  struct Without
+  {
+  };
+
+  /**
+   * @brief Shared<T> 用在 View 中，以只读方式访问用 SHARED_COMPONENT 声明的共享组件
+   */
+  template <typename T>
+  struct Shared
+  {
+  };
+
+  /**
+   * @brief ComponentTraits 描述 View 参数和实际存储之间的关系
+   *
+   * component 是 ComponentBuffer 中存储的类型，value 是 View 中暴露给用户的类型，
+   * storage() 返回需要遍历的那个容器，writes 表示遍历时是否把行标记为已修改，
+   * skip() 用来实现过滤，返回从当前行开始需要跳过的行数，0 表示当前行满足条件
+   */
+  template <typename T>
+  struct ComponentTraits
+  {
+    using component = std::remove_const_t<T>;
+    using value = T;
+    using buffer_type = ComponentBuffer<component>;
+    static_assert(!std::is_base_of_v<Tag, component>,
+                  "tags have no storage, use ecs::With<T> / ecs::Without<T> in a View");
+    static constexpr bool writes = !std::is_const_v<T>;
+    static constexpr bool filtered = false;
+    static buffer_type *buffer(IComponentManager *cm);
+    static Column<component> &storage(buffer_type *cb)
+    {
+      return cb->container;
+    }
+    static value *at(buffer_type *cb, uint32_t row)
+    {
+      return &ComponentTraits<T>::storage(cb)[row];
+    }
+    static void prepare(buffer_type *) {}
+    static uint32_t skip(buffer_type *, uint32_t, uint32_t) { return 0; }
+  };
+
+  template <typename T>
+  struct ComponentTraits<Next<T>> : ComponentTraits<T>
+  {
+    static Column<T> &storage(ComponentBuffer<T> *cb)
+    {
+      return *cb->back;
+    }
+    static T *at(ComponentBuffer<T> *cb, uint32_t row) { return &(*cb->back)[row]; }
+    static void prepare(ComponentBuffer<T> *cb) { cb->enableDoubleBuffer(); }
+  };
+
+  template <typename T>
+  struct ComponentTraits<Changed<T>> : ComponentTraits<const T>
+  {
+    static constexpr bool filtered = true;
+    static uint32_t skip(ComponentBuffer<T> *cb, uint32_t row, uint32_t since)
+    {
+      return cb->skipUnchanged(cb->chunk_changed, cb->row_changed.get(), row, since);
+    }
+  };
+
+  template <typename T>
+  struct ComponentTraits<Added<T>> : ComponentTraits<const T>
+  {
+    static constexpr bool filtered = true;
+    static uint32_t skip(ComponentBuffer<T> *cb, uint32_t row, uint32_t since)
+    {
+      return cb->skipUnchanged(cb->chunk_added, cb->row_added.get(), row, since);
+    }
+  };
+
+  // 标签过滤器遍历的是 TagBuffer，按 64 位的字一次跳过一批不满足条件的实体
+  template <typename T, bool Want>
+  struct TagTraits
+  {
+    using component = T;
+    using value = const T;
+    using buffer_type = TagBuffer<T>;
+    static constexpr bool writes = false;
+    static constexpr bool filtered = true;
+    static buffer_type *buffer(IComponentManager *cm);
+    static value *at(buffer_type *, uint32_t)
+    {
+      static const T dummy{};
+      return &dummy;
+    }
+    static void prepare(buffer_type *) {}
+    static uint32_t skip(buffer_type *cb, uint32_t row, uint32_t)
+    {
+      return cb->run(row, !Want);
+    }
+  };
+
+  template <typename T>
+  struct ComponentTraits<With<T>> : TagTraits<T, true>
+  {
+  };
+
+  template <typename T>
+  struct ComponentTraits<Without<T>> : TagTraits<T, false>
+  {
+  };
+
+  template <typename T>
+  struct ComponentTraits<Shared<T>>
+  {
+    using component = T;
+    using value = const T;
+    using buffer_type = SharedBuffer<T>;
+    static constexpr bool writes = false;
+    static constexpr bool filtered = false;
+    static buffer_type *buffer(IComponentManager *cm);
+    static value *at(buffer_type *cb, uint32_t row) { return &cb->get(row); }
+    static void prepare(buffer_type *) {}
+    static uint32_t skip(buffer_type *, uint32_t, uint32_t) { return 0; }
+  };
 
   /**
    * @brief Entity 是一个抽象类，用于表示一个实体，实体是一个具有一定属性的对象
@@ -45,619 +405,7228 @@ namespace ecs
     virtual void release() = 0;
     virtual IComponentManager &getComponentManager() const = 0;
 
+    /**
+     * @brief 访问用 TAG(Name) 声明的标签
+     */
+    template <typename T>
+    TagRef<T> tag() const { return TagRef<T>(this); }
+
+    /// 实体在所属类的组件缓冲中的行号，类的行没有被重新排列过时等于 id
+    uint32_t row() const;
+
     uint32_t id;
     uint32_t flags;
   };
 
+  // ------------------------------------------------------------------------
+
+  enum class FieldType
+  {
+    Bool,
+    Int8,
+    UInt8,
+    Int16,
+    UInt16,
+    Int32,
+    UInt32,
+    Int64,
+    UInt64,
+    Float,
+    Double,
+    Pointer,
+    Other, // 其它类型只记录大小，按原始字节读写
+  };
+
+  template <typename V>
+  constexpr FieldType FieldTypeOf()
+  {
+    if constexpr (std::is_same_v<V, bool>)
+      return FieldType::Bool;
+    else if constexpr (std::is_integral_v<V>)
+    {
+      constexpr bool s = std::is_signed_v<V>;
+      if constexpr (sizeof(V) == 1)
+        return s ? FieldType::Int8 : FieldType::UInt8;
+      else if constexpr (sizeof(V) == 2)
+        return s ? FieldType::Int16 : FieldType::UInt16;
+      else if constexpr (sizeof(V) == 4)
+        return s ? FieldType::Int32 : FieldType::UInt32;
+      else
+        return s ? FieldType::Int64 : FieldType::UInt64;
+    }
+    else if constexpr (std::is_same_v<V, float>)
+      return FieldType::Float;
+    else if constexpr (std::is_same_v<V, double>)
+      return FieldType::Double;
+    else if constexpr (std::is_pointer_v<V>)
+      return FieldType::Pointer;
+    else
+      return FieldType::Other;
+  }
 
   /**
-   * @brief IComponentBuffer 是一个抽象类，用于表示一个存储 Component 数据的容器
-   * 这里 IComponentBuffer 使用了类型擦除技术，其具体的子类实现了对应类型的 ComponentBuffer，即：
-   * IComponentBuffer -> ComponentBuffer<T>
-   *  而 ComponentBuffer<T> 是一个容器模板类，用来存储 T 类型的 Component 数据
+   * @brief 组件中一个字段的名字、偏移、类型和大小
    */
-  class IComponentBuffer
+  struct FieldInfo
+  {
+    std::string name;
+    uint32_t offset;
+    uint32_t size;
+    FieldType type;
+
+    /// 按类型访问 object 中的这个字段，类型不匹配时返回 nullptr
+    template <typename V>
+    V *as(void *object) const
+    {
+      if (FieldTypeOf<V>() != type || sizeof(V) != size || object == nullptr)
+        return nullptr;
+      return reinterpret_cast<V *>(static_cast<char *>(object) + offset);
+    }
+
+    void *address(void *object) const { return static_cast<char *>(object) + offset; }
+  };
+
+  /**
+   * @brief 一个组件类型的反射信息，字段按注册的顺序排列
+   */
+  struct TypeInfo
+  {
+    std::string name;
+    uint32_t size;
+    std::vector<FieldInfo> fields;
+
+    /// 按名字查找字段，结果应该缓存起来，不要在每次访问时查找
+    const FieldInfo *field(const std::string &field_name) const
+    {
+      for (const FieldInfo &f : fields)
+        if (f.name == field_name)
+          return &f;
+      return nullptr;
+    }
+  };
+
+  /**
+   * @brief 全局的反射注册表，每个组件类型注册一次，例如
+   *
+   *     ecs::Reflect<Node::Position>("Position").field("x", &Node::Position::x).field("y", &Node::Position::y);
+   */
+  class Reflection
   {
   public:
-    virtual ~IComponentBuffer() = default;
-    virtual uint32_t add() = 0;
-    virtual void ensure_space(uint32_t) = 0;
-    virtual uint32_t size() const = 0;
-    virtual const std::type_info &getType() const = 0;
+    static Reflection &inst()
+    {
+      static Reflection registry;
+      return registry;
+    }
+
+    const TypeInfo *find(const std::type_info &type) const
+    {
+      auto it = by_type.find(std::type_index(type));
+      return it != by_type.end() ? it->second.get() : nullptr;
+    }
+
+    const TypeInfo *find(const std::string &name) const
+    {
+      for (auto &[type, info] : by_type)
+        if (info->name == name)
+          return info.get();
+      return nullptr;
+    }
+
+    // 重复注册同一个类型时清空原来的字段；TypeInfo 的地址保持不变，缓存的指针仍然有效
+    TypeInfo &add(const std::type_info &type, std::string name, uint32_t size)
+    {
+      auto &info = by_type[std::type_index(type)];
+      if (!info)
+        info = std::make_unique<TypeInfo>();
+      info->name = std::move(name);
+      info->size = size;
+      info->fields.clear();
+      return *info;
+    }
+
+  private:
+    std::unordered_map<std::type_index, std::unique_ptr<TypeInfo>> by_type;
+  };
+
+  /**
+   * @brief 注册组件类型 T 的反射信息时使用的构造器
+   */
+  template <typename T>
+  class Reflect
+  {
+  public:
+    explicit Reflect(std::string name)
+        : info(Reflection::inst().add(typeid(T), std::move(name), sizeof(T))) {}
+
+    template <typename V>
+    Reflect &field(std::string name, V T::*member)
+    {
+      // 不构造对象，只在一块对齐的内存上计算成员的偏移
+      alignas(T) static unsigned char storage[sizeof(T)];
+      const T *object = reinterpret_cast<const T *>(storage);
+      uint32_t offset = static_cast<uint32_t>(
+          reinterpret_cast<const unsigned char *>(&(object->*member)) - storage);
+      info.fields.push_back(FieldInfo{std::move(name), offset, sizeof(V), FieldTypeOf<V>()});
+      return *this;
+    }
+
+  private:
+    TypeInfo &info;
+  };
+
+  // ------------------------------------------------------------------------
+
+  /**
+   * @brief 组件的自定义序列化，不能平凡拷贝的组件特化它之后才会写入快照
+   *
+   * template <> struct Serializer<Name>
+   * {
+   *   static void save(std::ostream &out, const Name &value);
+   *   static void load(std::istream &in, Name &value);
+   * };
+   */
+  template <typename T>
+  struct Serializer
+  {
+  };
+
+  template <typename T, typename = void>
+  struct HasSerializer : std::false_type
+  {
+  };
+  template <typename T>
+  struct HasSerializer<T, std::void_t<decltype(&Serializer<T>::save), decltype(&Serializer<T>::load)>>
+      : std::true_type
+  {
+  };
+
+  /**
+   * @brief 标记不写入快照和增量快照的组件，读入之后恢复为默认值
+   *
+   * 用于 SceneTree、Relation 等索引保存在组件中的槽位，它们只在建立索引的进程中有意义
+   */
+  template <typename T>
+  struct Transient : std::false_type
+  {
+  };
+
+  /**
+   * @brief 标记每个实体独有的组件，预制体不复制它们，例如 Guid
+   *
+   * Transient 组件同样不会被预制体复制
+   */
+  template <typename T>
+  struct Unique : std::false_type
+  {
+  };
+
+  /// 可以写入快照的组件：平凡拷贝的类型直接按字节读写，其他类型需要 Serializer
+  template <typename T>
+  constexpr bool IsSerializable()
+  {
+    return !Transient<T>::value && (std::is_trivially_copyable_v<T> || HasSerializer<T>::value);
+  }
+
+  /// 按内存块直接读写快照的组件
+  template <typename T>
+  constexpr bool IsBlockSerializable()
+  {
+    return !Transient<T>::value && std::is_trivially_copyable_v<T>;
+  }
+
+  /**
+   * @brief 标记可以回滚的组件，只有特化为 true 的组件才会被 RollbackBuffer 记录
+   *
+   * template <> struct ecs::Rollback<Name> : std::true_type {};
+   */
+  template <typename T>
+  struct Rollback : std::false_type
+  {
+  };
+
+  template <typename T, typename = void>
+  struct HasEqual : std::false_type
+  {
+  };
+  template <typename T>
+  struct HasEqual<T, std::void_t<decltype(std::declval<const T &>() == std::declval<const T &>())>>
+      : std::true_type
+  {
+  };
+
+  /// 可以比较的组件：有 operator== 时使用它，否则平凡拷贝的类型按字节比较
+  template <typename T>
+  constexpr bool IsComparable()
+  {
+    return HasEqual<T>::value || std::is_trivially_copyable_v<T>;
+  }
+
+  template <typename T>
+  bool SameValue(const T &a, const T &b)
+  {
+    if constexpr (HasEqual<T>::value)
+      return a == b;
+    else
+      return std::memcmp(&a, &b, sizeof(T)) == 0;
+  }
+
+  inline void WriteBytes(std::ostream &out, const void *data, size_t size)
+  {
+    out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+  }
+
+  inline bool ReadBytes(std::istream &in, void *data, size_t size)
+  {
+    return static_cast<bool>(in.read(static_cast<char *>(data), static_cast<std::streamsize>(size)));
+  }
+
+  template <typename T>
+  void WritePod(std::ostream &out, const T &value) { WriteBytes(out, &value, sizeof(T)); }
+
+  template <typename T>
+  bool ReadPod(std::istream &in, T &value) { return ReadBytes(in, &value, sizeof(T)); }
+
+  template <typename T>
+  void WriteVector(std::ostream &out, const std::vector<T> &values)
+  {
+    WritePod(out, static_cast<uint32_t>(values.size()));
+    WriteBytes(out, values.data(), values.size() * sizeof(T));
+  }
+
+  template <typename T>
+  bool ReadVector(std::istream &in, std::vector<T> &values)
+  {
+    uint32_t n = 0;
+    if (!ReadPod(in, n))
+      return false;
+    values.resize(n);
+    return ReadBytes(in, values.data(), n * sizeof(T));
+  }
+
+  // 快照中平凡拷贝的列的数据按这个字节数对齐
+  constexpr uint32_t kBlockAlign = 64;
+
+  /// FNV-1a，用于快照的布局哈希
+  inline uint64_t HashBytes(uint64_t h, const void *data, size_t size)
+  {
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i)
+      h = (h ^ bytes[i]) * 1099511628211ull;
+    return h;
+  }
+
+  inline uint64_t HashString(uint64_t h, const std::string &text)
+  {
+    return HashBytes(h, text.data(), text.size() + 1);
+  }
+
+  enum class MapMode
+  {
+    Shared,  // 只读的共享映射，多个进程共用同一份物理页面，写入前按块复制到自己的内存
+    Private, // 写时复制的私有映射，修改只对当前进程可见，不会写回文件
+  };
+
+  /**
+   * @brief 映射到内存中的快照文件，页面在第一次访问时才由系统读入
+   */
+  class MappedFile
+  {
+  public:
+    static std::shared_ptr<MappedFile> open(const std::string &path, MapMode mode)
+    {
+#if ECS_HAS_MMAP
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+        return nullptr;
+      struct stat st;
+      if (::fstat(fd, &st) != 0 || st.st_size <= 0)
+      {
+        ::close(fd);
+        return nullptr;
+      }
+      size_t size = static_cast<size_t>(st.st_size);
+      void *data = mode == MapMode::Shared
+                       ? ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0)
+                       : ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (data == MAP_FAILED)
+        return nullptr;
+      return std::shared_ptr<MappedFile>(new MappedFile(static_cast<char *>(data), size, mode));
+#else
+      std::ifstream in(path, std::ios::binary | std::ios::ate);
+      if (!in)
+        return nullptr;
+      size_t size = static_cast<size_t>(in.tellg());
+      char *data = new char[size];
+      in.seekg(0);
+      if (!in.read(data, static_cast<std::streamsize>(size)))
+      {
+        delete[] data;
+        return nullptr;
+      }
+      return std::shared_ptr<MappedFile>(new MappedFile(data, size, mode));
+#endif
+    }
+
+    ~MappedFile()
+    {
+#if ECS_HAS_MMAP
+      ::munmap(bytes, length);
+#else
+      delete[] bytes;
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    char *data() const { return bytes; }
+    size_t size() const { return length; }
+    MapMode mode() const { return map_mode; }
+
+  private:
+    MappedFile(char *bytes, size_t length, MapMode mode)
+        : bytes(bytes), length(length), map_mode(mode) {}
+
+    char *bytes;
+    size_t length;
+    MapMode map_mode;
+  };
+
+  /**
+   * @brief 按块存放的列，每块 kChunkSize 行，与变更追踪的块对齐
+   *
+   * 块分配之后地址不再改变，元素的地址和 std::deque 一样是稳定的。块可以是自己分配的，
+   * 也可以直接指向映射进来的快照文件（只用于平凡拷贝的类型），这时 mapping 保证文件在使用期间不会被解除映射。
+   */
+  template <typename T>
+  class Column
+  {
+  public:
+    template <typename V>
+    class Iterator
+    {
+      using Owner = std::conditional_t<std::is_const_v<V>, const Column, Column>;
+
+    public:
+      using iterator_category = std::random_access_iterator_tag;
+      using value_type = std::remove_const_t<V>;
+      using difference_type = std::ptrdiff_t;
+      using pointer = V *;
+      using reference = V &;
+
+      Iterator() = default;
+      Iterator(Owner *column, size_t index) : column(column), index(index) {}
+
+      V &operator*() const { return (*column)[index]; }
+      V *operator->() const { return &(*column)[index]; }
+      Iterator &operator++()
+      {
+        ++index;
+        return *this;
+      }
+      Iterator operator++(int)
+      {
+        Iterator old = *this;
+        ++index;
+        return old;
+      }
+      Iterator &operator+=(difference_type n)
+      {
+        index += n;
+        return *this;
+      }
+      Iterator operator+(difference_type n) const { return Iterator(column, index + n); }
+      difference_type operator-(const Iterator &other) const
+      {
+        return static_cast<difference_type>(index) - static_cast<difference_type>(other.index);
+      }
+      bool operator==(const Iterator &other) const { return index == other.index; }
+      bool operator!=(const Iterator &other) const { return index != other.index; }
+
+    private:
+      Owner *column = nullptr;
+      size_t index = 0;
+    };
+
+    using iterator = Iterator<T>;
+    using const_iterator = Iterator<const T>;
+
+    Column() = default;
+    Column(const Column &other) { *this = other; }
+    Column(Column &&other) noexcept { swap(other); }
+    ~Column() { clear(); }
+
+    Column &operator=(const Column &other)
+    {
+      if (this != &other)
+      {
+        clear();
+        reserve(other.count);
+        for (const T &value : other)
+          emplace_back(value);
+      }
+      return *this;
+    }
+
+    Column &operator=(Column &&other) noexcept
+    {
+      if (this != &other)
+      {
+        clear();
+        swap(other);
+      }
+      return *this;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    /// 是否有块指向映射的文件
+    bool mapped() const { return mapping != nullptr; }
+    /// 是否有块指向只读的共享映射，写入之前要先用 own 复制
+    bool readonly() const { return mapping != nullptr && mapping->mode() == MapMode::Shared; }
+
+    T &operator[](size_t i) { return chunks[i >> kChunkShift][i & kChunkMask]; }
+    const T &operator[](size_t i) const { return chunks[i >> kChunkShift][i & kChunkMask]; }
+
+    T &at(size_t i)
+    {
+      if (i >= count)
+        throw std::out_of_range("ecs::Column::at");
+      return (*this)[i];
+    }
+    const T &at(size_t i) const
+    {
+      if (i >= count)
+        throw std::out_of_range("ecs::Column::at");
+      return (*this)[i];
+    }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, count); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, count); }
+
+    template <typename... Args>
+    T &emplace_back(Args &&...args)
+    {
+      reserve(count + 1);
+      T *slot = &(*this)[count];
+      new (slot) T(std::forward<Args>(args)...);
+      count++;
+      return *slot;
+    }
+    void push_back(const T &value) { emplace_back(value); }
+    void push_back(T &&value) { emplace_back(std::move(value)); }
+
+    /// 新增的元素值初始化，缩小时析构多出来的元素并释放不再需要的块
+    void resize(size_t n)
+    {
+      reserve(n);
+      for (; count < n; ++count)
+        new (&(*this)[count]) T();
+      for (; count > n; --count)
+        (*this)[count - 1].~T();
+      size_t needed = (n + kChunkMask) >> kChunkShift;
+      bool dropped = false;
+      while (chunks.size() > needed)
+      {
+        if (owned.back())
+          deallocate(chunks.back());
+        chunks.pop_back();
+        owned.pop_back();
+        dropped = true;
+      }
+      if (dropped && mapping && std::find(owned.begin(), owned.end(), false) == owned.end())
+        mapping.reset();
+    }
+
+    void reserve(size_t n)
+    {
+      while ((chunks.size() << kChunkShift) < n)
+      {
+        chunks.push_back(allocate());
+        owned.push_back(true);
+      }
+    }
+
+    void clear() { resize(0); }
+
+    void swap(Column &other) noexcept
+    {
+      chunks.swap(other.chunks);
+      owned.swap(other.owned);
+      std::swap(count, other.count);
+      mapping.swap(other.mapping);
+    }
+
+    /**
+     * @brief 用映射文件中从 first 开始的 n 行替换整列：完整的块直接指向文件，
+     * 最后不满一块的部分复制到自己分配的块中，之后增长不会越过文件的末尾
+     */
+    void map(std::shared_ptr<MappedFile> file, T *first, size_t n)
+    {
+      static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable columns can be mapped");
+      clear();
+      size_t full = n >> kChunkShift;
+      for (size_t c = 0; c < full; ++c)
+      {
+        chunks.push_back(first + (c << kChunkShift));
+        owned.push_back(false);
+      }
+      if (full > 0)
+        mapping = std::move(file);
+      count = full << kChunkShift;
+      if (n > count)
+      {
+        chunks.push_back(allocate());
+        owned.push_back(true);
+        std::memcpy(chunks.back(), first + count, (n - count) * sizeof(T));
+        count = n;
+      }
+    }
+
+    /**
+     * @brief 把 [first, first + n) 所在的、指向映射文件的块复制到自己分配的内存中，之后可以在原地写入
+     */
+    void own(size_t first, size_t n)
+    {
+      if constexpr (std::is_trivially_copyable_v<T>)
+      {
+        if (!mapping || n == 0)
+          return;
+        size_t last = std::min((first + n - 1) >> kChunkShift, chunks.size() - 1);
+        for (size_t c = first >> kChunkShift; c <= last; ++c)
+          if (!owned[c])
+          {
+            T *copy = allocate();
+            std::memcpy(copy, chunks[c], sizeof(T) * kChunkSize);
+            chunks[c] = copy;
+            owned[c] = true;
+          }
+        if (std::find(owned.begin(), owned.end(), false) == owned.end())
+          mapping.reset();
+      }
+    }
+
+    /**
+     * @brief 依次把每块交给 f(T *first, size_t count)
+     */
+    template <typename F>
+    void forEachChunk(F &&f)
+    {
+      for (size_t c = 0; (c << kChunkShift) < count; ++c)
+        f(chunks[c], std::min<size_t>(kChunkSize, count - (c << kChunkShift)));
+    }
+    template <typename F>
+    void forEachChunk(F &&f) const
+    {
+      for (size_t c = 0; (c << kChunkShift) < count; ++c)
+        f(static_cast<const T *>(chunks[c]), std::min<size_t>(kChunkSize, count - (c << kChunkShift)));
+    }
+
+  private:
+    static T *allocate()
+    {
+      return static_cast<T *>(::operator new(sizeof(T) * kChunkSize, std::align_val_t(alignof(T))));
+    }
+    static void deallocate(T *chunk)
+    {
+      ::operator delete(chunk, std::align_val_t(alignof(T)));
+    }
+
+    std::vector<T *> chunks;
+    std::vector<bool> owned;
+    size_t count = 0;
+    std::shared_ptr<MappedFile> mapping;
+  };
+
+  /**
+   * @brief 按版本顺序记录哪些块发生了变化，查询某个版本之后变化过的块时只访问日志的尾部
+   *
+   * 同一块在同一版本只记录一次；日志超过块数的两倍时按每块最后的版本重新整理，
+   * 所以内存占用与块数成正比，查询的代价与变化的数量成正比
+   */
+  class ChunkLog
+  {
+  public:
+    /// chunk 的版本刚刚从其它值变成 version，stamps 是每块最后一次变化的版本
+    void record(uint32_t chunk, uint32_t version, const std::vector<uint32_t> &stamps)
+    {
+      entries.emplace_back(version, chunk);
+      if (entries.size() > 2 * stamps.size() + kChunkSize)
+        compact(stamps);
+    }
+
+    /// 丢弃历史，按 stamps 重新建立日志
+    void compact(const std::vector<uint32_t> &stamps)
+    {
+      entries.clear();
+      for (uint32_t chunk = 0; chunk < stamps.size(); ++chunk)
+        entries.emplace_back(stamps[chunk], chunk);
+      std::sort(entries.begin(), entries.end());
+    }
+
+    /**
+     * @brief 对 since 之后变化过的每一块调用一次 f(chunk)，按最后一次变化的先后顺序
+     */
+    template <typename F>
+    void since(uint32_t version, const std::vector<uint32_t> &stamps, F &&f) const
+    {
+      auto it = std::upper_bound(entries.begin(), entries.end(), std::make_pair(version, UINT32_MAX));
+      for (; it != entries.end(); ++it)
+        if (it->second < stamps.size() && stamps[it->second] == it->first)
+          f(it->second);
+    }
+
+  private:
+    std::vector<std::pair<uint32_t, uint32_t>> entries; // (版本, 块)
+  };
+
+  /**
+   * @brief 对 since 之后变化过的每一块调用 f(rows)，rows 是块中 n 以内变化过的行，按升序排列；
+   * 没有逐行版本号（row_stamps 为空）时是块中所有的行
+   */
+  template <typename F>
+  void ForEachChangedChunk(const ChunkLog &log, const std::vector<uint32_t> &stamps,
+                           const std::vector<uint32_t> *row_stamps, uint32_t n, uint32_t since, F &&f)
+  {
+    std::vector<uint32_t> rows;
+    log.since(since, stamps, [&](uint32_t chunk)
+              {
+      rows.clear();
+      uint32_t first = chunk << kChunkShift;
+      uint32_t last = std::min(n, first + kChunkSize);
+      for (uint32_t row = first; row < last; ++row)
+        if (row_stamps == nullptr || row >= row_stamps->size() || (*row_stamps)[row] > since)
+          rows.push_back(row);
+      if (!rows.empty())
+        f(static_cast<const std::vector<uint32_t> &>(rows)); });
+  }
+
+  // 增量快照中块记录列表的结束标记
+  constexpr uint32_t kDeltaEnd = UINT32_MAX;
+
+  /**
+   * @brief 写出一块中的行：第一行、行数、是否连续，不连续时再写出每一行
+   */
+  inline void WriteDeltaRows(std::ostream &out, const std::vector<uint32_t> &rows)
+  {
+    uint8_t contiguous = rows.back() - rows.front() + 1 == rows.size();
+    WritePod(out, rows.front());
+    WritePod(out, static_cast<uint32_t>(rows.size()));
+    WritePod(out, contiguous);
+    if (!contiguous)
+      WriteBytes(out, rows.data(), rows.size() * sizeof(uint32_t));
+  }
+
+  /**
+   * @brief 读入一块中的行，遇到结束标记或者读取失败时返回 false，调用方之后检查流的状态
+   */
+  inline bool ReadDeltaRows(std::istream &in, std::vector<uint32_t> &rows)
+  {
+    uint32_t first = 0, count = 0;
+    uint8_t contiguous = 0;
+    if (!ReadPod(in, first) || first == kDeltaEnd)
+      return false;
+    if (!ReadPod(in, count) || !ReadPod(in, contiguous))
+      return false;
+    rows.resize(count);
+    if (contiguous)
+    {
+      for (uint32_t i = 0; i < count; ++i)
+        rows[i] = first + i;
+      return true;
+    }
+    return ReadBytes(in, rows.data(), count * sizeof(uint32_t));
+  }
+
+  class RollbackColumn;
+
+  // 回滚记录中的一块：column 的第 chunk 块在这一帧被修改之前的内容
+  struct RollbackChunk
+  {
+    RollbackColumn *column;
+    uint32_t chunk;
+    void *data;
+  };
+
+  /**
+   * @brief 一个可以回滚的组件缓冲的帧记录，由 RollbackBuffer 驱动
+   *
+   * 写时复制：提交之后每一块第一次被写入之前，把它的内容复制到池中的块里，
+   * 下一次提交时这些块就是这一帧修改过的块的旧内容，不需要保存整列的副本
+   */
+  class RollbackColumn
+  {
+  public:
+    virtual ~RollbackColumn() = default;
+    /// 把上一次提交之后修改过的块的旧内容移到 frame
+    virtual void capture(std::vector<RollbackChunk> &frame) = 0;
+    /// 丢弃上一次提交之后的修改
+    virtual void revert() = 0;
+    /// 把 data 写回第 chunk 块，并标记这些行被修改过
+    virtual void restore(uint32_t chunk, const void *data) = 0;
+    /// 放弃上一次提交之后保存的旧内容，不写回
+    virtual void discard() = 0;
+    /// 缓冲是上一次提交之后才创建的，那时它的每一行都是默认值
+    virtual void created() = 0;
+    /// 把 capture 取出的块还给池
+    virtual void recycle(void *data) = 0;
+  };
+
+  /**
+   * @brief IComponentBuffer 是一个抽象类，用于表示一个存储 Component 数据的容器
+   * 这里 IComponentBuffer 使用了类型擦除技术，其具体的子类实现了对应类型的 ComponentBuffer，即：
+   * IComponentBuffer -> ComponentBuffer<T>
+   *  而 ComponentBuffer<T> 是一个容器模板类，用来存储 T 类型的 Component 数据
+   */
+  class IComponentBuffer
+  {
+  public:
+    virtual ~IComponentBuffer() = default;
+    virtual uint32_t add() = 0;
+    virtual void ensure_space(uint32_t) = 0;
+    virtual uint32_t size() const = 0;
+    virtual const std::type_info &getType() const = 0;
+
+    // 把一行恢复成默认值，并当作新增的行，用于复用已经释放的实体编号
+    virtual void resetRow(uint32_t row) = 0;
+    // 交换两行 / 按 order 重新排列所有的行，新的第 r 行是原来的第 order[r] 行
+    virtual void swapRows(uint32_t a, uint32_t b) = 0;
+    virtual void permute(const std::vector<uint32_t> &order) = 0;
+    virtual void notifyConstruct(uint32_t, uint32_t) {}
+    virtual void notifyDestroy(uint32_t, uint32_t) {}
+
+    /**
+     * @brief 第 row 行组件的原始地址，配合 reflection() 中的字段偏移做类型擦除的读写
+     *
+     * 标签没有存储，返回 nullptr；共享组件返回被引用的共享值。通过这个地址写入之前需要调用 touch(row)
+     */
+    virtual void *raw(uint32_t row) = 0;
+
+    /// 即将写入 [first, first + count) 这段行，见 guarded
+    virtual void beforeWrite(uint32_t, uint32_t) {}
+
+    /**
+     * @brief 预制体：copyRow 复制一行的值，值与新实体的默认状态相同或者不能复制时返回空；
+     * fillRows 把这个值写入 [first, first + count) 这段行，并标记为修改过；不通知 Group，
+     * 调用者填完所有的缓冲之后再通知，否则 Group 交换行之后后面的缓冲会写到别的实体上
+     */
+    virtual std::shared_ptr<void> copyRow(uint32_t row) = 0;
+    virtual void fillRows(const void *value, uint32_t first, uint32_t count) = 0;
+
+    /**
+     * @brief 快照：layout() 描述存储布局，参与快照头部的哈希；save / load 读写所有的行
+     *
+     * load 只替换数据，不派发观察者事件，读入的行都算作在当前版本新增和修改；
+     * file 不为空时流是在这个映射文件上读取的，平凡拷贝的列可以直接引用文件中的数据
+     */
+    virtual uint64_t layout() = 0;
+    virtual void save(std::ostream &out) const = 0;
+    virtual bool load(std::istream &in, const std::shared_ptr<MappedFile> &file) = 0;
+
+    /**
+     * @brief 增量快照：saveDelta 只写出 since 之后修改过的块，打开了逐行追踪时只写出修改过的行；
+     * applyDelta 把这些行批量写回，并标记为在当前版本修改过
+     */
+    virtual void saveDelta(std::ostream &out, uint32_t since) const = 0;
+    virtual bool applyDelta(std::istream &in) = 0;
+
+    /// 组件标记为 Rollback 时返回这个缓冲的帧记录，否则返回空
+    virtual std::unique_ptr<RollbackColumn> makeRollback() { return nullptr; }
+
+    template <typename F>
+    void forEachChangedChunk(uint32_t since, F &&f) const
+    {
+      ForEachChangedChunk(changed_log, chunk_changed, row_changed.get(), size(), since, std::forward<F>(f));
+    }
+
+    /// 组件类型的反射信息，第一次调用时从 Reflection 中查找并缓存，没有注册时返回 nullptr
+    const TypeInfo *reflection()
+    {
+      if (reflected == nullptr)
+        reflected = Reflection::inst().find(getType());
+      return reflected;
+    }
+
+    IComponentManager *manager = nullptr;
+    IComponentBuffer *parent = nullptr;
+    IComponentBuffer *children = nullptr, *next = nullptr;
+
+    // 这个缓冲或者它的父类缓冲上注册了观察者，没有观察者时不需要派发任何事件
+    bool observed = false;
+    // 写入之前要先调用 beforeWrite：有块直接指向 MapMode::Shared 映射的只读页面，需要先复制出来，
+    // 或者正在被 RollbackBuffer 记录，需要先保存块的旧内容
+    bool guarded = false;
+
+    // 变更追踪：每块最后一次被修改、新增行时的世界版本号
+    std::vector<uint32_t> chunk_changed, chunk_added;
+    // 可选的逐行版本号，打开之后 Changed / Added 可以精确到行
+    std::unique_ptr<std::vector<uint32_t>> row_changed, row_added;
+    // chunk_changed 的变化日志，增量快照用它找到修改过的块
+    ChunkLog changed_log;
+    // 二级索引等在这里监视被修改的行
+    std::vector<RowWatch *> watches;
+    const TypeInfo *reflected = nullptr;
+
+    /**
+     * @brief 标记某一行在当前版本被修改过，需要在写入之前调用，见 guarded
+     */
+    void touch(uint32_t row)
+    {
+      if (guarded)
+        beforeWrite(row, 1);
+      uint32_t version = WorldVersion();
+      uint32_t chunk = row >> kChunkShift;
+      if (chunk < chunk_changed.size() && chunk_changed[chunk] != version)
+        stampChunk(chunk, version);
+      if (row_changed && row < row_changed->size())
+        (*row_changed)[row] = version;
+      for (RowWatch *watch : watches)
+        watch->mark(row);
+    }
+
+    /**
+     * @brief 打开逐行的变更追踪，子类的缓冲也会一起打开
+     */
+    void trackRows()
+    {
+      if (!row_changed)
+      {
+        row_changed = std::make_unique<std::vector<uint32_t>>(size());
+        row_added = std::make_unique<std::vector<uint32_t>>(size());
+        for (uint32_t row = 0; row < size(); ++row)
+        {
+          (*row_changed)[row] = chunk_changed[row >> kChunkShift];
+          (*row_added)[row] = chunk_added[row >> kChunkShift];
+        }
+      }
+      for (IComponentBuffer *child = children; child != nullptr; child = child->next)
+        child->trackRows();
+    }
+
+    /**
+     * @brief 返回从 row 开始有多少行在 since 之后没有变化，整块没有变化时直接跳过整块
+     */
+    uint32_t skipUnchanged(const std::vector<uint32_t> &chunks,
+                           const std::vector<uint32_t> *rows,
+                           uint32_t row, uint32_t since) const
+    {
+      uint32_t chunk = row >> kChunkShift;
+      if (chunk >= chunks.size() || chunks[chunk] <= since)
+        return kChunkSize - (row & kChunkMask);
+      if (rows != nullptr && (*rows)[row] <= since)
+        return 1;
+      return 0;
+    }
+
+  protected:
+    // 把这个缓冲挂到父类对应缓冲的 children 链表上
+    void link(IComponentManager *cm, IComponentBuffer *pcb);
+
+    // 行被移动之后更新变更追踪：移动过的行都算作在当前版本被修改，新增版本号跟着数据走
+    void rowsSwapped(uint32_t a, uint32_t b)
+    {
+      if (row_changed)
+      {
+        std::swap((*row_changed)[a], (*row_changed)[b]);
+        std::swap((*row_added)[a], (*row_added)[b]);
+      }
+      uint32_t added = std::max(chunk_added[a >> kChunkShift], chunk_added[b >> kChunkShift]);
+      chunk_added[a >> kChunkShift] = added;
+      chunk_added[b >> kChunkShift] = added;
+      touch(a);
+      touch(b);
+    }
+
+    void rowsPermuted(const std::vector<uint32_t> &order)
+    {
+      if (row_changed)
+      {
+        std::vector<uint32_t> changed(*row_changed), added(*row_added);
+        for (uint32_t r = 0; r < order.size(); ++r)
+        {
+          (*row_changed)[r] = changed[order[r]];
+          (*row_added)[r] = added[order[r]];
+        }
+      }
+      std::vector<uint32_t> added(chunk_added);
+      for (uint32_t r = 0; r < order.size(); ++r)
+      {
+        if (order[r] == r)
+          continue;
+        uint32_t &stamp = chunk_added[r >> kChunkShift];
+        stamp = std::max(stamp, added[order[r] >> kChunkShift]);
+        touch(r);
+      }
+    }
+
+    void stampChunk(uint32_t chunk, uint32_t version)
+    {
+      chunk_changed[chunk] = version;
+      changed_log.record(chunk, version, chunk_changed);
+    }
+
+    void stampAdded(uint32_t row)
+    {
+      uint32_t version = WorldVersion();
+      if (chunk_changed[row >> kChunkShift] != version)
+        stampChunk(row >> kChunkShift, version);
+      chunk_added[row >> kChunkShift] = version;
+      if (row_changed)
+      {
+        (*row_changed)[row] = version;
+        (*row_added)[row] = version;
+      }
+      for (RowWatch *watch : watches)
+        watch->mark(row);
+    }
+
+    // 快照读入之后，前 n 行全部标记为在当前版本新增
+    void reloaded(uint32_t n)
+    {
+      uint32_t version = WorldVersion();
+      uint32_t chunks = (n + kChunkMask) >> kChunkShift;
+      chunk_changed.assign(chunks, version);
+      chunk_added.assign(chunks, version);
+      changed_log.compact(chunk_changed);
+      if (row_changed)
+      {
+        row_changed->assign(n, version);
+        row_added->assign(n, version);
+      }
+      for (RowWatch *watch : watches)
+        for (uint32_t row = 0; row < n; ++row)
+          watch->mark(row);
+    }
+
+    // 布局哈希的公共部分：组件类型名、大小、对齐以及注册过的反射字段
+    template <typename T>
+    uint64_t layoutOf(const char *kind)
+    {
+      uint64_t h = HashString(14695981039346656037ull, kind);
+      h = HashString(h, typeid(T).name());
+      uint32_t shape[] = {sizeof(T), alignof(T), std::is_trivially_copyable_v<T>, HasSerializer<T>::value, Transient<T>::value};
+      h = HashBytes(h, shape, sizeof(shape));
+      if (const TypeInfo *info = reflection())
+        for (const FieldInfo &field : info->fields)
+        {
+          h = HashString(h, field.name);
+          uint32_t where[] = {field.offset, field.size, static_cast<uint32_t>(field.type)};
+          h = HashBytes(h, where, sizeof(where));
+        }
+      return h;
+    }
+
+    // 容器从 old_size 增长到 new_size 之后，把新行标记为在当前版本新增
+    void grown(uint32_t old_size, uint32_t new_size)
+    {
+      if (new_size <= old_size)
+        return;
+      uint32_t version = WorldVersion();
+      uint32_t chunks = (new_size + kChunkMask) >> kChunkShift;
+      size_t old_chunks = chunk_changed.size();
+      chunk_changed.resize(chunks, version);
+      chunk_added.resize(chunks, version);
+      for (uint32_t c = old_size >> kChunkShift; c < chunks; ++c)
+      {
+        if (c >= old_chunks || chunk_changed[c] != version)
+          stampChunk(c, version);
+        chunk_added[c] = version;
+      }
+      if (row_changed)
+      {
+        row_changed->resize(new_size, version);
+        row_added->resize(new_size, version);
+      }
+    }
+  };
+
+  class IEntityIterator
+  {
+  public:
+    virtual ~IEntityIterator() = default;
+    virtual IEntityIterator &operator++(int) = 0;
+    virtual bool operator==(const IEntityIterator &other) = 0;
+    virtual bool operator!=(const IEntityIterator &other) = 0;
+    virtual Entity *operator->() = 0;
+    virtual Entity &operator*() = 0;
+    virtual void advance(uint32_t n) = 0;
+  };
+  typedef std::unique_ptr<IEntityIterator> IEntityIteratorPtr;
+
+  /**
+   * @brief IRegistryComponentBuffer 是一个额外的抽象接口类，用来表示 Registry 的额外接口
+   */
+  class IRegistryComponentBuffer
+  {
+  public:
+    virtual Entity *getEntity(uint32_t id) = 0;
+    virtual IEntityIteratorPtr beginEntity() = 0;
+    virtual IEntityIteratorPtr endEntity() = 0;
+
+    // 一段地址连续的实体，第 i 个实体位于 first 之后 i * stride 字节处
+    typedef void (*RunVisitor)(Entity *first, uint32_t count, uint32_t stride, void *ctx);
+
+    /**
+     * @brief 按编号顺序把这个类的所有实体分成若干段连续内存交给 visit，已释放的实体也包含在内
+     */
+    virtual void forEachRun(RunVisitor visit, void *ctx) = 0;
+
+    // 已经释放、等待复用的实体编号
+    std::vector<uint32_t> free_ids;
+  };
+
+  /**
+   * @brief IGroup 是 Group、Index 等跟踪实体状态的对象的抽象接口，
+   * 实体被创建、释放或者标签变化时由 IComponentManager 通知
+   */
+  class IGroup
+  {
+  public:
+    virtual ~IGroup() = default;
+    virtual void refresh(IComponentManager &cm, uint32_t row) = 0;
+
+    /// 快照读入之后 cm 的所有行都可能变化，默认逐行调用 refresh
+    virtual void reload(IComponentManager &cm);
+  };
+
+  /**
+   * @brief 快照读入之后依次调用的钩子
+   *
+   * SceneTree、Relation、GuidIndex 等在组件之外维护的单例索引在构造时注册，读入之后清空或者重建自己
+   */
+  inline std::vector<std::function<void()>> &SnapshotLoadHooks()
+  {
+    static std::vector<std::function<void()>> hooks;
+    return hooks;
+  }
+
+  // ------------------------------------------------------------------------
+
+
+  /**
+   * @brief IComponentManager 是一个管理所有 Component 的ComponentManager的抽象接口
+   * 
+   * IComponentManager 使用了类型擦除技术，其具体的子类实现了对应类型的 ComponentManager，即：
+   * IComponentManager -> ComponentManager<T>
+   *  而 ComponentManager<T> 是一个单例模板类，用于记录所有 T 类型的 Entity 都有哪些 Component
+   */
+  class IComponentManager
+  {
+  public:
+    IComponentManager *parent = nullptr;
+
+    IComponentBuffer *registy = nullptr;
+    std::map<std::type_index, IComponentBuffer *> components;
+
+    // 实体编号和组件行号之间的映射，为空时两者相同；SortedGroup 等重新排列行之后才会建立
+    std::vector<uint32_t> row_of, id_of;
+    // id_of 每块最后一次变化的版本和变化日志，增量快照只写出这些块的映射
+    std::vector<uint32_t> moved;
+    ChunkLog moved_log;
+
+    // 在这个类上声明的 Group，子类的实体也会通知父类上的 Group
+    std::vector<IGroup *> groups;
+
+    virtual const std::type_info &getType() const = 0;
+
+    /// 程序中已经创建的所有 ComponentManager，按创建顺序排列
+    static std::vector<IComponentManager *> &instances()
+    {
+      static std::vector<IComponentManager *> all;
+      return all;
+    }
+
+    /**
+     * @brief 所有组件缓冲按键的类型名排序，快照用它得到与创建顺序无关的固定顺序
+     */
+    std::vector<IComponentBuffer *> sortedComponents() const
+    {
+      std::vector<std::pair<std::string, IComponentBuffer *>> named;
+      for (auto &[key, cb] : components)
+        named.emplace_back(key.name(), cb);
+      std::sort(named.begin(), named.end(), [](const auto &a, const auto &b)
+                { return a.first < b.first; });
+      std::vector<IComponentBuffer *> sorted;
+      for (auto &[name, cb] : named)
+        sorted.push_back(cb);
+      return sorted;
+    }
+
+    /**
+     * @brief 快照读入之后通知这个类以及父类上的 Group 重新计算这个类的成员
+     */
+    void reloaded()
+    {
+      moved.assign((id_of.size() + kChunkMask) >> kChunkShift, WorldVersion());
+      moved_log.compact(moved);
+      reloadGroups();
+    }
+
+    /**
+     * @brief 行号映射被整体修改之后，让这个类以及父类上的 Group 重新计算这个类的成员
+     */
+    void reloadGroups()
+    {
+      for (IComponentManager *cm = this; cm != nullptr; cm = cm->parent)
+        for (IGroup *group : cm->groups)
+          group->reload(*this);
+    }
+
+    /**
+     * @brief 某一行的标签、释放状态等发生变化，通知这个类以及父类上的 Group 更新成员关系
+     */
+    void rowChanged(uint32_t row)
+    {
+      for (IComponentManager *cm = this; cm != nullptr; cm = cm->parent)
+        for (IGroup *group : cm->groups)
+          group->refresh(*this, row);
+    }
+
+    /**
+     * @brief 按反射注册的名字查找这个类的组件缓冲，用于工具和脚本，查找结果应该缓存
+     */
+    IComponentBuffer *findComponent(const std::string &name)
+    {
+      for (auto &[key, cb] : components)
+      {
+        const TypeInfo *info = cb->reflection();
+        // 共享组件以 Shared<T> 为键，这里只返回普通组件的缓冲
+        if (info != nullptr && info->name == name && key == std::type_index(cb->getType()))
+          return cb;
+      }
+      return nullptr;
+    }
+
+    uint32_t rowOf(uint32_t id) const { return id < row_of.size() ? row_of[id] : id; }
+    uint32_t idOf(uint32_t row) const { return row < id_of.size() ? id_of[row] : row; }
+
+    /**
+     * @brief 交换所有组件缓冲中的两行，实体对象本身不会移动
+     */
+    void swapRows(uint32_t a, uint32_t b)
+    {
+      mapRows();
+      for (auto &[key, cb] : components)
+        cb->swapRows(a, b);
+      std::swap(id_of[a], id_of[b]);
+      row_of[id_of[a]] = a;
+      row_of[id_of[b]] = b;
+      rowMoved(a);
+      rowMoved(b);
+    }
+
+    /**
+     * @brief 按 order 重新排列所有组件缓冲的行，新的第 r 行是原来的第 order[r] 行
+     */
+    void permuteRows(const std::vector<uint32_t> &order)
+    {
+      mapRows();
+      for (auto &[key, cb] : components)
+        cb->permute(order);
+      std::vector<uint32_t> ids(id_of);
+      for (uint32_t r = 0; r < order.size(); ++r)
+      {
+        id_of[r] = ids[order[r]];
+        row_of[id_of[r]] = r;
+        if (order[r] != r)
+          rowMoved(r);
+      }
+    }
+
+    // 第一次移动行之前建立恒等映射，并保证所有缓冲的大小和实体数量一致
+    void mapRows()
+    {
+      uint32_t n = registy != nullptr ? registy->size() : 0;
+      for (auto &[key, cb] : components)
+        cb->ensure_space(n);
+      for (uint32_t id = static_cast<uint32_t>(row_of.size()); id < n; ++id)
+      {
+        row_of.push_back(id);
+        id_of.push_back(id);
+        rowMoved(id);
+      }
+    }
+
+    // 记录 id_of[row] 在当前版本变化过
+    void rowMoved(uint32_t row)
+    {
+      uint32_t version = WorldVersion();
+      uint32_t chunk = row >> kChunkShift;
+      if (chunk >= moved.size())
+        moved.resize(chunk + 1, 0);
+      if (moved[chunk] != version)
+      {
+        moved[chunk] = version;
+        moved_log.record(chunk, version, moved);
+      }
+    }
+
+    template <typename T>
+    ComponentBuffer<T> *getComponentBuffer()
+    {
+      auto it = components.find(std::type_index(typeid(T)));
+      if (it == components.end())
+      {
+        return nullptr;
+      }
+      return dynamic_cast<ComponentBuffer<T> *>(it->second);
+    }
+
+    template <typename T>
+    RegistryComponentBuffer<T> *getRegistryComponentBuffer()
+    {
+      if (registy == nullptr)
+        return nullptr;
+      return dynamic_cast<RegistryComponentBuffer<T> *>(registy);
+    }
+
+    template <typename T>
+    ComponentBuffer<T> *getOrCreateComponentBuffer()
+    {
+      auto it = components.find(std::type_index(typeid(T)));
+      if (it == components.end())
+      {
+        auto *cb = new ComponentBuffer<T>(
+            this, parent ? parent->getComponentBuffer<T>() : nullptr);
+        components[std::type_index(typeid(T))] = cb;
+        return cb;
+      }
+      return dynamic_cast<ComponentBuffer<T> *>(it->second);
+    }
+
+    template <typename T>
+    TagBuffer<T> *getOrCreateTagBuffer()
+    {
+      return getOrCreateBuffer<TagBuffer<T>, T>();
+    }
+
+    // 以 Shared<T> 为键，同一个类可以同时有普通的 T 组件和共享的 T 组件
+    template <typename T>
+    SharedBuffer<T> *getOrCreateSharedBuffer()
+    {
+      return getOrCreateBuffer<SharedBuffer<T>, Shared<T>>();
+    }
+
+    /**
+     * @brief 取得或者创建以 T 为键、类型为 CB 的缓冲，并挂到父类对应的缓冲下面
+     */
+    template <typename CB, typename T>
+    CB *getOrCreateBuffer()
+    {
+      auto it = components.find(std::type_index(typeid(T)));
+      if (it == components.end())
+      {
+        IComponentBuffer *pcb = nullptr;
+        if (parent != nullptr)
+        {
+          auto pit = parent->components.find(std::type_index(typeid(T)));
+          if (pit != parent->components.end())
+            pcb = pit->second;
+        }
+        auto *cb = new CB(this, pcb);
+        components[std::type_index(typeid(T))] = cb;
+        return cb;
+      }
+      return static_cast<CB *>(it->second);
+    }
+
+    /**
+     * @brief 为这个类（以及它的所有子类）的组件 T 注册生命周期观察者
+     *
+     * 观察者的参数是 (ComponentBuffer<T> &buffer, uint32_t first, uint32_t count)，
+     * 每次派发对应 buffer 中一段连续的行，而不是每个实体调用一次。
+     * 返回的 ObserverId 用于 unobserve，观察者捕获的对象销毁之前必须注销
+     */
+    template <typename T, typename F>
+    ObserverId observe(Lifecycle event, F &&f)
+    {
+      return getOrCreateComponentBuffer<T>()->observe(event, std::forward<F>(f));
+    }
+
+    template <typename T, typename F>
+    ObserverId onConstruct(F &&f) { return observe<T>(Lifecycle::Construct, std::forward<F>(f)); }
+    template <typename T, typename F>
+    ObserverId onUpdate(F &&f) { return observe<T>(Lifecycle::Update, std::forward<F>(f)); }
+    template <typename T, typename F>
+    ObserverId onDestroy(F &&f) { return observe<T>(Lifecycle::Destroy, std::forward<F>(f)); }
+
+    template <typename T>
+    bool unobserve(ObserverId id)
+    {
+      auto *cb = getComponentBuffer<T>();
+      return cb != nullptr && cb->unobserve(id);
+    }
+
+    template <typename T>
+    RegistryComponentBuffer<T> *getOrCreateRegistryComponentBuffer()
+    {
+      if (registy == nullptr)
+      {
+        registy = new RegistryComponentBuffer<T>(
+            this, parent ? parent->getRegistryComponentBuffer<typename T::super>()
+                         : nullptr);
+      }
+      return dynamic_cast<RegistryComponentBuffer<T> *>(registy);
+    }
+  };
+
+  inline uint32_t Entity::row() const
+  {
+    return getComponentManager().rowOf(id);
+  }
+
+  inline void IGroup::reload(IComponentManager &cm)
+  {
+    uint32_t n = cm.registy != nullptr ? cm.registy->size() : 0;
+    for (uint32_t row = 0; row < n; ++row)
+      refresh(cm, row);
+  }
+
+  inline void IComponentBuffer::link(IComponentManager *cm, IComponentBuffer *pcb)
+  {
+    manager = cm;
+
+    if (cm->parent != nullptr)
+    {
+      if (pcb == nullptr)
+        return;
+      if (pcb->children == nullptr)
+      {
+        pcb->children = this;
+      }
+      else
+      {
+        IComponentBuffer *old_head = pcb->children;
+        pcb->children = this;
+        this->next = old_head;
+      }
+      parent = pcb;
+    }
+  }
+
+  /**
+   * 用户编写的每个类在系统中都会自动创建一个 ComponentManager 来管理其下的所有
+   * Component 同时，还会创建一个 Registy 来保存所有创建的类实例
+   */
+  template <typename B>
+  class ComponentManager : public IComponentManager
+  {
+  public:
+    static ComponentManager &inst()
+    {
+      static ComponentManager instance;
+      return instance;
+    }
+
+    const std::type_info &getType() const override { return typeid(B); }
+
+    ComponentManager()
+    {
+      instances().push_back(this);
+      if constexpr (!std::is_same_v<typename B::super, Entity>)
+      {
+        parent = &ComponentManager<typename B::super>::inst();
+      }
+    }
+  };
+
+  template <typename T>
+  class RollbackColumnOf : public RollbackColumn
+  {
+    static_assert(std::is_copy_assignable_v<T>, "rollback components must be copy assignable");
+
+  public:
+    explicit RollbackColumnOf(CommonComponentBuffer<T> *buffer) : buffer(buffer), live(buffer->container)
+    {
+      buffer->rollbacks.push_back(this);
+      buffer->updateGuard();
+    }
+
+    ~RollbackColumnOf() override
+    {
+      discard();
+      auto &rollbacks = buffer->rollbacks;
+      rollbacks.erase(std::find(rollbacks.begin(), rollbacks.end(), this));
+      buffer->updateGuard();
+    }
+
+    /// 即将写入 [first, first + count)，保存这段行所在的、上一次提交之后还没有保存过的块
+    void save(uint32_t first, uint32_t count)
+    {
+      uint32_t last = std::min(first + count, static_cast<uint32_t>(live.size()));
+      for (uint32_t chunk = first >> kChunkShift; (chunk << kChunkShift) < last; ++chunk)
+        if (chunk >= saved.size() || saved[chunk] == nullptr)
+          keep(chunk, &live[chunk << kChunkShift], rows(chunk));
+    }
+
+    void capture(std::vector<RollbackChunk> &frame) override
+    {
+      for (uint32_t chunk : dirty)
+      {
+        frame.push_back(RollbackChunk{this, chunk, saved[chunk]});
+        saved[chunk] = nullptr;
+      }
+      dirty.clear();
+    }
+
+    void revert() override
+    {
+      for (uint32_t chunk : dirty)
+      {
+        uint32_t first = chunk << kChunkShift;
+        live.own(first, rows(chunk));
+        std::copy_n(saved[chunk], rows(chunk), &live[first]);
+      }
+      discard();
+    }
+
+    void restore(uint32_t chunk, const void *data) override
+    {
+      uint32_t first = chunk << kChunkShift;
+      uint32_t n = rows(chunk);
+      live.own(first, n);
+      std::copy_n(static_cast<const T *>(data), n, &live[first]);
+      for (uint32_t row = first; row < first + n; ++row)
+        buffer->touch(row);
+    }
+
+    void discard() override
+    {
+      for (uint32_t chunk : dirty)
+      {
+        recycle(saved[chunk]);
+        saved[chunk] = nullptr;
+      }
+      dirty.clear();
+    }
+
+    void created() override
+    {
+      discard();
+      for (uint32_t first = 0; first < live.size(); first += kChunkSize)
+        keep(first >> kChunkShift, nullptr, 0);
+    }
+
+    void recycle(void *data) override { free.push_back(static_cast<T *>(data)); }
+
+  private:
+    uint32_t rows(uint32_t chunk) const
+    {
+      return std::min<uint32_t>(kChunkSize, static_cast<uint32_t>(live.size()) - (chunk << kChunkShift));
+    }
+
+    // 保存第 chunk 块的旧内容：前 n 行从 from 复制，其余的行那时还不存在，记为默认值
+    void keep(uint32_t chunk, const T *from, uint32_t n)
+    {
+      T *old = acquire();
+      std::copy_n(from, n, old);
+      std::fill(old + n, old + kChunkSize, T());
+      if (chunk >= saved.size())
+        saved.resize(chunk + 1, nullptr);
+      saved[chunk] = old;
+      dirty.push_back(chunk);
+    }
+
+    // 块在帧之间复用，预热之后不再分配内存
+    T *acquire()
+    {
+      if (free.empty())
+      {
+        pool.push_back(std::make_unique<T[]>(kChunkSize));
+        return pool.back().get();
+      }
+      T *chunk = free.back();
+      free.pop_back();
+      return chunk;
+    }
+
+    CommonComponentBuffer<T> *buffer;
+    Column<T> &live;
+    // 上一次提交之后每块的旧内容，没有修改过的块为空；dirty 按保存的顺序列出这些块
+    std::vector<T *> saved;
+    std::vector<uint32_t> dirty;
+    std::vector<std::unique_ptr<T[]>> pool;
+    std::vector<T *> free;
+  };
+
+  /**
+   * 这个 ComponentBuffer
+   * 是所有类数据的容器，是最关键的数据结构，对于一个类的继承树结构，我们会创建一系列
+   * 相互链接的 ComponentBuffer 来保存每个 Component
+   * 的数据，例如，对于下面的类结构，B 是 A 的子类：
+   * +-----------------------------------------------+
+   * | Class A | Component<Data1> | Component<Data2> |
+   * +-----------------------------------------------+
+   * |  0      |  Data 1          |    Data 2        |
+   * |  1      |  Data 1          |    Data 2        |
+   * +-----------------------------------------------+------------------+
+   * | Class B | Component<Data1> | Component<Data2> | Component<Data3> |
+   * +------------------------------------------------------------------+
+   * |  0      |  Data 1          |    Data 2        |    Data 3        |
+   * |  1      |  Data 1          |    Data 2        |    Data 3        |
+   * +-----------------------------------------------+------------------+
+   *
+   * 为了实现这个结构，每个类都有一个 ComponentBuffer ，保存了所有的 Component
+   * 数据
+   */
+  template <typename T>
+  class CommonComponentBuffer : public IComponentBuffer
+  {
+  public:
+    Column<T> container;
+
+    std::unique_ptr<RollbackColumn> makeRollback() override
+    {
+      if constexpr (Rollback<T>::value)
+        return std::make_unique<RollbackColumnOf<T>>(this);
+      else
+        return nullptr;
+    }
+
+    // 正在记录这个缓冲的 RollbackColumn，写入之前要把块的旧内容交给它们保存
+    std::vector<RollbackColumnOf<T> *> rollbacks;
+
+    // 双缓冲模式下的后台缓冲，container 是上一帧的数据（前台），back 是正在写入的下一帧
+    std::unique_ptr<Column<T>> back;
+
+    T &get(uint32_t id)
+    {
+      if (id >= container.size())
+      {
+        ensure_space(id + 1);
+      }
+      return container.at(id);
+    }
+    const T &get(uint32_t id) const
+    {
+      if (id >= container.size())
+      {
+        container.resize(id + 1);
+      }
+      return container.at(id);
+    }
+
+    T &getNext(uint32_t id)
+    {
+      if (id >= back->size())
+      {
+        ensure_space(id + 1);
+      }
+      return back->at(id);
+    }
+
+    uint32_t add() override
+    {
+      uint32_t id = container.size();
+      container.push_back(T{});
+      if (back)
+        back->push_back(T{});
+      grown(id, id + 1);
+      if (observed)
+        notifyConstruct(id, 1);
+      return id;
+    }
+
+    void swapRows(uint32_t a, uint32_t b) override
+    {
+      using std::swap;
+      if (guarded)
+      {
+        beforeWrite(a, 1);
+        beforeWrite(b, 1);
+      }
+      swap(container[a], container[b]);
+      if (back)
+        swap((*back)[a], (*back)[b]);
+      rowsSwapped(a, b);
+    }
+
+    void permute(const std::vector<uint32_t> &order) override
+    {
+      permuteContainer(container, order);
+      if (back)
+        permuteContainer(*back, order);
+      rowsPermuted(order);
+    }
+
+    void resetRow(uint32_t row) override
+    {
+      ensure_space(row + 1);
+      if (guarded)
+        beforeWrite(row, 1);
+      container[row].~T();
+      new (&container[row]) T();
+      if (back)
+      {
+        (*back)[row].~T();
+        new (&(*back)[row]) T();
+      }
+      stampAdded(row);
+      if (observed)
+        notifyConstruct(row, 1);
+    }
+
+    uint32_t size() const override { return container.size(); }
+
+    const std::type_info &getType() const override { return typeid(T); }
+
+    void *raw(uint32_t row) override { return &get(row); }
+
+    void beforeWrite(uint32_t first, uint32_t count) override
+    {
+      if (container.readonly())
+        container.own(first, count);
+      if (back && back->readonly())
+        back->own(first, count);
+      if constexpr (Rollback<T>::value)
+        for (RollbackColumnOf<T> *rollback : rollbacks)
+          rollback->save(first, count);
+      updateGuard();
+    }
+
+    void updateGuard()
+    {
+      guarded = container.readonly() || (back && back->readonly()) || !rollbacks.empty();
+    }
+
+    std::shared_ptr<void> copyRow(uint32_t row) override
+    {
+      if constexpr (Transient<T>::value || Unique<T>::value || !std::is_copy_constructible_v<T>)
+        return nullptr;
+      else
+      {
+        const T &value = get(row);
+        // 新实体的行本来就是默认值，不需要复制
+        if constexpr (std::is_default_constructible_v<T> && IsComparable<T>())
+          if (SameValue(value, T{}))
+            return nullptr;
+        return std::make_shared<T>(value);
+      }
+    }
+
+    void fillRows(const void *value, uint32_t first, uint32_t count) override
+    {
+      if constexpr (std::is_copy_assignable_v<T>)
+      {
+        ensure_space(first + count);
+        if (guarded)
+          beforeWrite(first, count);
+        const T &v = *static_cast<const T *>(value);
+        fillColumn(container, v, first, count);
+        if (back)
+          fillColumn(*back, v, first, count);
+        for (uint32_t row = first; row < first + count; ++row)
+          touch(row);
+      }
+    }
+
+    uint64_t layout() override { return layoutOf<T>("component"); }
+
+    void save(std::ostream &out) const override
+    {
+      WritePod(out, static_cast<uint32_t>(container.size()));
+      WritePod(out, static_cast<uint8_t>(back != nullptr));
+      saveRows(out, container);
+      if (back)
+        saveRows(out, *back);
+    }
+
+    bool load(std::istream &in, const std::shared_ptr<MappedFile> &file) override
+    {
+      uint32_t n = 0;
+      uint8_t double_buffered = 0;
+      if (!ReadPod(in, n) || !ReadPod(in, double_buffered))
+        return false;
+      if (!loadRows(in, container, n, file))
+        return false;
+      if (double_buffered)
+      {
+        if (!back)
+          back = std::make_unique<Column<T>>();
+        if (!loadRows(in, *back, n, file))
+          return false;
+      }
+      else if (back)
+        *back = container;
+      updateGuard();
+      reloaded(n);
+      return true;
+    }
+
+    void saveDelta(std::ostream &out, uint32_t since) const override
+    {
+      WritePod(out, static_cast<uint32_t>(container.size()));
+      WritePod(out, static_cast<uint8_t>(back != nullptr));
+      if constexpr (IsSerializable<T>())
+        forEachChangedChunk(since, [&](const std::vector<uint32_t> &rows)
+                            {
+          WriteDeltaRows(out, rows);
+          saveDeltaRows(out, container, rows);
+          if (back)
+            saveDeltaRows(out, *back, rows); });
+      WritePod(out, kDeltaEnd);
+    }
+
+    bool applyDelta(std::istream &in) override
+    {
+      uint32_t n = 0;
+      uint8_t double_buffered = 0;
+      if (!ReadPod(in, n) || !ReadPod(in, double_buffered))
+        return false;
+      if (double_buffered)
+        enableDoubleBuffer();
+      ensure_space(n);
+      std::vector<uint32_t> rows;
+      while (ReadDeltaRows(in, rows))
+      {
+        if (rows.back() >= n)
+          return false;
+        if (guarded)
+          beforeWrite(rows.front(), rows.back() - rows.front() + 1);
+        loadDeltaRows(in, container, rows);
+        if (double_buffered)
+          loadDeltaRows(in, *back, rows);
+        for (uint32_t row : rows)
+          touch(row);
+      }
+      return static_cast<bool>(in);
+    }
+
+    void ensure_space(uint32_t new_size) override
+    {
+      if (new_size > container.size())
+      {
+        uint32_t old_size = container.size();
+        container.resize(new_size);
+        grown(old_size, new_size);
+        if (observed)
+          notifyConstruct(old_size, new_size - old_size);
+      }
+      if (back && new_size > back->size())
+      {
+        back->resize(new_size);
+      }
+    }
+
+    /**
+     * @brief 打开双缓冲模式，后台缓冲初始化为前台的拷贝，子类的缓冲也会一起打开
+     */
+    void enableDoubleBuffer()
+    {
+      if (back)
+        return;
+      back = std::make_unique<Column<T>>(container);
+      for (IComponentBuffer *child = children; child != nullptr; child = child->next)
+      {
+        static_cast<CommonComponentBuffer<T> *>(child)->enableDoubleBuffer();
+      }
+    }
+
+    /**
+     * @brief 帧末交换前后台缓冲，只交换容器内部的指针，是 O(1) 的
+     *
+     * 交换后 back 中是两帧之前的数据，写入的系统应当根据前台的数据完整地写出下一帧
+     */
+    void swapBuffers()
+    {
+      if (back)
+        container.swap(*back);
+    }
+
+    CommonComponentBuffer(IComponentManager *cm, IComponentBuffer *pcb)
+    {
+      link(cm, pcb);
+    }
+
+  protected:
+    /**
+     * @brief 平凡拷贝的类型逐块整块写出，不逐个编码
+     *
+     * 数据之前填充到 kBlockAlign 字节对齐（相对流的开头），快照文件被映射时各块可以直接指向文件
+     */
+    static void saveRows(std::ostream &out, const Column<T> &c)
+    {
+      if constexpr (IsBlockSerializable<T>())
+      {
+        std::streamoff at = out.tellp();
+        uint32_t pad = at < 0 ? 0 : static_cast<uint32_t>((kBlockAlign - (at + sizeof(uint32_t)) % kBlockAlign) % kBlockAlign);
+        static const char zeros[kBlockAlign] = {};
+        WritePod(out, pad);
+        WriteBytes(out, zeros, pad);
+        c.forEachChunk([&](const T *first, size_t count)
+                       { WriteBytes(out, first, count * sizeof(T)); });
+      }
+      else if constexpr (IsSerializable<T>())
+        for (const T &value : c)
+          Serializer<T>::save(out, value);
+    }
+
+    // 容器只调整一次大小；不能序列化和 Transient 的类型没有写入数据，读入之后恢复为默认值
+    static bool loadRows(std::istream &in, Column<T> &c, uint32_t n, const std::shared_ptr<MappedFile> &file)
+    {
+      if constexpr (IsBlockSerializable<T>())
+      {
+        uint32_t pad = 0;
+        if (!ReadPod(in, pad) || !in.ignore(pad))
+          return false;
+        // 在映射的文件上读取时，完整的块直接指向文件，只移动读取位置，页面等到访问时才读入
+        if (file != nullptr && n >= kChunkSize)
+        {
+          std::streamoff at = in.tellg();
+          size_t bytes = size_t(n) * sizeof(T);
+          char *first = file->data() + at;
+          if (at >= 0 && size_t(at) + bytes <= file->size() &&
+              reinterpret_cast<uintptr_t>(first) % alignof(T) == 0)
+          {
+            c.map(file, reinterpret_cast<T *>(first), n);
+            return static_cast<bool>(in.seekg(static_cast<std::streamoff>(bytes), std::ios::cur));
+          }
+        }
+        // 映射的块可能是只读的，不能在原地覆盖
+        if (c.mapped())
+          c.clear();
+        c.resize(n);
+        bool ok = true;
+        c.forEachChunk([&](T *first, size_t count)
+                       { ok = ok && ReadBytes(in, first, count * sizeof(T)); });
+        return ok;
+      }
+      else if constexpr (IsSerializable<T>())
+      {
+        c.resize(n);
+        for (T &value : c)
+          Serializer<T>::load(in, value);
+        return static_cast<bool>(in);
+      }
+      else
+      {
+        c.clear();
+        c.resize(n);
+        return true;
+      }
+    }
+
+    // 增量快照中的一组行：连续的行都在同一块中，平凡拷贝的类型整段读写
+    static void saveDeltaRows(std::ostream &out, const Column<T> &c, const std::vector<uint32_t> &rows)
+    {
+      if constexpr (IsBlockSerializable<T>())
+      {
+        if (rows.back() - rows.front() + 1 == rows.size())
+          WriteBytes(out, &c[rows.front()], rows.size() * sizeof(T));
+        else
+          for (uint32_t row : rows)
+            WritePod(out, c[row]);
+      }
+      else if constexpr (IsSerializable<T>())
+        for (uint32_t row : rows)
+          Serializer<T>::save(out, c[row]);
+    }
+
+    static void loadDeltaRows(std::istream &in, Column<T> &c, const std::vector<uint32_t> &rows)
+    {
+      if constexpr (IsBlockSerializable<T>())
+      {
+        if (rows.back() - rows.front() + 1 == rows.size())
+          ReadBytes(in, &c[rows.front()], rows.size() * sizeof(T));
+        else
+          for (uint32_t row : rows)
+            ReadPod(in, c[row]);
+      }
+      else if constexpr (IsSerializable<T>())
+        for (uint32_t row : rows)
+          Serializer<T>::load(in, c[row]);
+    }
+
+  private:
+    // 按块整段填充，平凡拷贝的类型编译为连续的内存写入
+    static void fillColumn(Column<T> &c, const T &value, uint32_t first, uint32_t count)
+    {
+      for (uint32_t row = first; row < first + count;)
+      {
+        uint32_t n = std::min(first + count - row, kChunkSize - (row & kChunkMask));
+        std::fill_n(&c[row], n, value);
+        row += n;
+      }
+    }
+
+    static void permuteContainer(Column<T> &c, const std::vector<uint32_t> &order)
+    {
+      Column<T> sorted;
+      sorted.reserve(c.size());
+      for (uint32_t from : order)
+        sorted.push_back(std::move(c[from]));
+      for (size_t r = order.size(); r < c.size(); ++r)
+        sorted.push_back(std::move(c[r]));
+      c.swap(sorted);
+    }
+  };
+
+  template <typename T>
+  struct ComponentObservers
+  {
+    using Fn = std::function<void(ComponentBuffer<T> &, uint32_t, uint32_t)>;
+    struct Entry
+    {
+      ObserverId id;
+      Fn fn;
+    };
+    std::vector<Entry> construct, update, destroy;
+    ObserverId next_id = 1;
+
+    bool empty() const { return construct.empty() && update.empty() && destroy.empty(); }
+
+    bool remove(ObserverId id)
+    {
+      for (auto *list : {&construct, &update, &destroy})
+      {
+        auto it = std::find_if(list->begin(), list->end(), [id](const Entry &e)
+                               { return e.id == id; });
+        if (it != list->end())
+        {
+          list->erase(it);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    std::vector<Entry> &of(Lifecycle event)
+    {
+      switch (event)
+      {
+      case Lifecycle::Construct:
+        return construct;
+      case Lifecycle::Update:
+        return update;
+      default:
+        return destroy;
+      }
+    }
+  };
+
+  template <typename T>
+  class ComponentBuffer : public CommonComponentBuffer<T>
+  {
+  public:
+    ComponentBuffer(IComponentManager *cm, IComponentBuffer *pcb)
+        : CommonComponentBuffer<T>(cm, pcb)
+    {
+      // 父类的组件已经是双缓冲的，子类也必须是
+      if (this->parent != nullptr && static_cast<ComponentBuffer<T> *>(this->parent)->back)
+        this->back = std::make_unique<Column<T>>();
+      if (this->parent != nullptr)
+        this->observed = this->parent->observed;
+    }
+
+    // 在这个类上注册的观察者，子类的缓冲派发事件时也会沿着 parent 调用它们
+    std::unique_ptr<ComponentObservers<T>> observers;
+
+    template <typename F>
+    ObserverId observe(Lifecycle event, F &&f)
+    {
+      if (!observers)
+        observers = std::make_unique<ComponentObservers<T>>();
+      ObserverId id = observers->next_id++;
+      observers->of(event).push_back({id, std::forward<F>(f)});
+      markObserved();
+      return id;
+    }
+
+    /**
+     * @brief 注销 observe 返回的观察者，不能在事件派发的过程中调用
+     */
+    bool unobserve(ObserverId id)
+    {
+      if (!observers || !observers->remove(id))
+        return false;
+      refreshObserved();
+      return true;
+    }
+
+    /**
+     * @brief 把 [first, first + count) 这段行的生命周期事件派发给这个类及其父类上的观察者
+     */
+    void notify(Lifecycle event, uint32_t first, uint32_t count)
+    {
+      for (IComponentBuffer *cur = this; cur != nullptr; cur = cur->parent)
+      {
+        auto &obs = static_cast<ComponentBuffer<T> *>(cur)->observers;
+        if (!obs)
+          continue;
+        for (auto &entry : obs->of(event))
+          entry.fn(*this, first, count);
+      }
+    }
+
+    void notifyConstruct(uint32_t first, uint32_t count) override
+    {
+      notify(Lifecycle::Construct, first, count);
+    }
+    void notifyDestroy(uint32_t first, uint32_t count) override
+    {
+      notify(Lifecycle::Destroy, first, count);
+    }
+
+    /**
+     * @brief 显式地修改 [first, first + count) 这段行，修改完成后派发一次 Update 事件
+     */
+    template <typename F>
+    void patch(uint32_t first, uint32_t count, F &&f)
+    {
+      this->ensure_space(first + count);
+      for (uint32_t row = first; row < first + count; ++row)
+      {
+        this->touch(row);
+        f(this->container[row]);
+      }
+      if (this->observed)
+        notify(Lifecycle::Update, first, count);
+    }
+
+    void fillRows(const void *value, uint32_t first, uint32_t count) override
+    {
+      CommonComponentBuffer<T>::fillRows(value, first, count);
+      if (this->observed)
+        notify(Lifecycle::Update, first, count);
+    }
+
+    /**
+     * @brief 把 values 开始的 count 个值复制到 [first, first + count) 这段行，按块整段复制，
+     * 完成后派发一次 Update 事件
+     */
+    void assign(uint32_t first, uint32_t count, const T *values)
+    {
+      this->ensure_space(first + count);
+      if (this->guarded)
+        this->beforeWrite(first, count);
+      for (uint32_t row = first; row < first + count;)
+      {
+        uint32_t n = std::min(first + count - row, kChunkSize - (row & kChunkMask));
+        std::copy_n(values + (row - first), n, &this->container[row]);
+        for (uint32_t end = row + n; row < end; ++row)
+          this->touch(row);
+      }
+      if (this->observed)
+        notify(Lifecycle::Update, first, count);
+    }
+
+    BufferIterator<T> begin() { return BufferIterator<T>(this); }
+    BufferIterator<T> end() { return BufferIterator<T>(); }
+
+  private:
+    void markObserved()
+    {
+      this->observed = true;
+      for (IComponentBuffer *child = this->children; child != nullptr; child = child->next)
+        static_cast<ComponentBuffer<T> *>(child)->markObserved();
+    }
+
+    // 注销之后重新计算这个缓冲及其子类是否还有观察者
+    void refreshObserved()
+    {
+      this->observed = false;
+      for (IComponentBuffer *cur = this; cur != nullptr && !this->observed; cur = cur->parent)
+      {
+        auto &obs = static_cast<ComponentBuffer<T> *>(cur)->observers;
+        this->observed = obs && !obs->empty();
+      }
+      for (IComponentBuffer *child = this->children; child != nullptr; child = child->next)
+        static_cast<ComponentBuffer<T> *>(child)->refreshObserved();
+    }
+  };
+
+  /**
+   * @brief TagBuffer 把一个类中所有实体的标签 T 压缩存放在一个位图中，每个实体只占一个比特
+   */
+  template <typename T>
+  class TagBuffer : public IComponentBuffer
+  {
+  public:
+    std::vector<uint64_t> words;
+
+    TagBuffer(IComponentManager *cm, IComponentBuffer *pcb) { link(cm, pcb); }
+
+    bool test(uint32_t row) const
+    {
+      return row < count && (words[row >> 6] >> (row & 63)) & 1;
+    }
+    void set(uint32_t row)
+    {
+      ensure_space(row + 1);
+      words[row >> 6] |= uint64_t(1) << (row & 63);
+      touch(row);
+      manager->rowChanged(row);
+    }
+    void clear(uint32_t row)
+    {
+      ensure_space(row + 1);
+      words[row >> 6] &= ~(uint64_t(1) << (row & 63));
+      touch(row);
+      manager->rowChanged(row);
+    }
+
+    /**
+     * @brief 从 row 开始连续有多少行的标签值等于 value，每次检查 64 行
+     */
+    uint32_t run(uint32_t row, bool value) const
+    {
+      uint32_t start = row;
+      while (row < count)
+      {
+        uint32_t shift = row & 63;
+        uint64_t w = words[row >> 6];
+        uint64_t match = (value ? w : ~w) >> shift;
+        uint32_t available = 64 - shift;
+        uint32_t ones = ~match == 0 ? 64 : Ctz64(~match);
+        if (ones < available)
+        {
+          row += ones;
+          break;
+        }
+        row += available;
+      }
+      return (row < count ? row : count) - start;
+    }
+
+    /// 这个类中带有标签的实体数量
+    uint32_t popcount() const
+    {
+      uint32_t n = 0;
+      for (uint64_t w : words)
+        n += static_cast<uint32_t>(std::bitset<64>(w).count());
+      return n;
+    }
+
+    uint32_t add() override
+    {
+      ensure_space(count + 1);
+      return count - 1;
+    }
+
+    void ensure_space(uint32_t new_size) override
+    {
+      if (new_size > count)
+      {
+        uint32_t old_size = count;
+        count = new_size;
+        words.resize((count + 63) >> 6, 0);
+        grown(old_size, new_size);
+      }
+    }
+
+    uint32_t size() const override { return count; }
+
+    const std::type_info &getType() const override { return typeid(T); }
+
+    void *raw(uint32_t) override { return nullptr; }
+
+    std::shared_ptr<void> copyRow(uint32_t row) override
+    {
+      return test(row) ? std::make_shared<bool>(true) : nullptr;
+    }
+
+    void fillRows(const void *value, uint32_t first, uint32_t count) override
+    {
+      if (!*static_cast<const bool *>(value))
+        return;
+      ensure_space(first + count);
+      for (uint32_t row = first; row < first + count; ++row)
+      {
+        words[row >> 6] |= uint64_t(1) << (row & 63);
+        touch(row);
+      }
+    }
+
+    uint64_t layout() override { return layoutOf<T>("tag"); }
+
+    void save(std::ostream &out) const override
+    {
+      WritePod(out, count);
+      WriteVector(out, words);
+    }
+
+    bool load(std::istream &in, const std::shared_ptr<MappedFile> &) override
+    {
+      if (!ReadPod(in, count) || !ReadVector(in, words))
+        return false;
+      reloaded(count);
+      return true;
+    }
+
+    void saveDelta(std::ostream &out, uint32_t since) const override
+    {
+      WritePod(out, count);
+      forEachChangedChunk(since, [&](const std::vector<uint32_t> &rows)
+                          {
+        WriteDeltaRows(out, rows);
+        std::vector<uint64_t> bits((rows.size() + 63) >> 6, 0);
+        for (size_t i = 0; i < rows.size(); ++i)
+          if (test(rows[i]))
+            bits[i >> 6] |= uint64_t(1) << (i & 63);
+        WriteBytes(out, bits.data(), bits.size() * sizeof(uint64_t)); });
+      WritePod(out, kDeltaEnd);
+    }
+
+    // 只有值变化的行才会 set / clear，Group 通过 rowChanged 得到通知
+    bool applyDelta(std::istream &in) override
+    {
+      uint32_t n = 0;
+      if (!ReadPod(in, n))
+        return false;
+      ensure_space(n);
+      std::vector<uint32_t> rows;
+      std::vector<uint64_t> bits;
+      while (ReadDeltaRows(in, rows))
+      {
+        bits.resize((rows.size() + 63) >> 6);
+        if (!ReadBytes(in, bits.data(), bits.size() * sizeof(uint64_t)))
+          return false;
+        for (size_t i = 0; i < rows.size(); ++i)
+        {
+          bool value = (bits[i >> 6] >> (i & 63)) & 1;
+          if (test(rows[i]) != value)
+            value ? set(rows[i]) : clear(rows[i]);
+        }
+      }
+      return static_cast<bool>(in);
+    }
+
+    void resetRow(uint32_t row) override
+    {
+      ensure_space(row + 1);
+      words[row >> 6] &= ~(uint64_t(1) << (row & 63));
+      stampAdded(row);
+    }
+
+    void swapRows(uint32_t a, uint32_t b) override
+    {
+      bool ta = test(a), tb = test(b);
+      assignBit(a, tb);
+      assignBit(b, ta);
+      rowsSwapped(a, b);
+    }
+
+    void permute(const std::vector<uint32_t> &order) override
+    {
+      std::vector<uint64_t> old(words);
+      for (uint32_t r = 0; r < order.size(); ++r)
+        assignBit(r, (old[order[r] >> 6] >> (order[r] & 63)) & 1);
+      rowsPermuted(order);
+    }
+
+  private:
+    void assignBit(uint32_t row, bool value)
+    {
+      uint64_t bit = uint64_t(1) << (row & 63);
+      words[row >> 6] = value ? words[row >> 6] | bit : words[row >> 6] & ~bit;
+    }
+
+    uint32_t count = 0;
+  };
+
+  template <typename T>
+  class TagRef
+  {
+    const Entity *entity;
+
+  public:
+    TagRef(const Entity *ent) : entity(ent) {}
+
+    TagBuffer<T> *buffer() const
+    {
+      return entity->getComponentManager().template getOrCreateTagBuffer<T>();
+    }
+
+    bool test() const { return buffer()->test(entity->row()); }
+    explicit operator bool() const { return test(); }
+    void set() const { buffer()->set(entity->row()); }
+    void clear() const { buffer()->clear(entity->row()); }
+  };
+
+  /**
+   * @brief SharedBuffer 保存一个类中所有实体共享的组件
+   *
+   * 相同的值只保存一份，每行只记录它引用的值的编号。0 号值是这个类的默认值，
+   * 没有单独设置过的实体都引用它，修改 classValue() 会同时影响这些实体。
+   * 可以平凡拷贝的类型按字节去重，其他类型需要提供 operator==。
+   */
+  template <typename T>
+  class SharedBuffer : public IComponentBuffer
+  {
+  public:
+    std::deque<T> values;         // 去重之后的值，用 deque 保证引用稳定
+    std::vector<uint32_t> refs;   // 每个值被多少行引用
+    std::vector<uint32_t> index;  // 每行引用的值的编号
+
+    SharedBuffer(IComponentManager *cm, IComponentBuffer *pcb)
+    {
+      link(cm, pcb);
+      // 子类的默认值继承自父类
+      values.push_back(pcb != nullptr ? static_cast<SharedBuffer<T> *>(pcb)->values[0] : T{});
+      refs.push_back(0);
+    }
+
+    const T &get(uint32_t row)
+    {
+      ensure_space(row + 1);
+      return values[index[row]];
+    }
+
+    /// 这个类的默认值
+    T &classValue() { return values[0]; }
+
+    /**
+     * @brief 让 row 引用值 value，已经存在相同的值时直接复用
+     */
+    void set(uint32_t row, const T &value)
+    {
+      ensure_space(row + 1);
+      assign(row, intern(value));
+      touch(row);
+    }
+
+    /**
+     * @brief 让 row 重新引用这个类的默认值
+     */
+    void unset(uint32_t row)
+    {
+      ensure_space(row + 1);
+      assign(row, 0);
+      touch(row);
+    }
+
+    /**
+     * @brief 查找或者插入一个值，返回它的编号；等于类的默认值时返回 0
+     *
+     * 默认值可以通过 classValue() 修改，所以不放在 lookup 中，每次直接比较
+     */
+    uint32_t intern(const T &value)
+    {
+      if (equal(values[0], value))
+        return 0;
+      size_t h = hash(value);
+      auto range = lookup.equal_range(h);
+      for (auto it = range.first; it != range.second; ++it)
+      {
+        if (equal(values[it->second], value))
+          return it->second;
+      }
+
+      uint32_t slot;
+      if (!free_slots.empty())
+      {
+        slot = free_slots.back();
+        free_slots.pop_back();
+        values[slot] = value;
+      }
+      else
+      {
+        slot = static_cast<uint32_t>(values.size());
+        values.push_back(value);
+        refs.push_back(0);
+      }
+      lookup.emplace(h, slot);
+      return slot;
+    }
+
+    /// 当前被引用的不同值的数量（不包括没有被引用的默认值）
+    uint32_t distinct() const
+    {
+      uint32_t n = 0;
+      for (uint32_t r : refs)
+        n += r > 0;
+      return n;
+    }
+
+    uint32_t add() override
+    {
+      ensure_space(size() + 1);
+      return size() - 1;
+    }
+
+    void ensure_space(uint32_t new_size) override
+    {
+      uint32_t old_size = size();
+      if (new_size > old_size)
+      {
+        index.resize(new_size, 0);
+        refs[0] += new_size - old_size;
+        grown(old_size, new_size);
+      }
+    }
+
+    uint32_t size() const override { return static_cast<uint32_t>(index.size()); }
+
+    const std::type_info &getType() const override { return typeid(T); }
+
+    void *raw(uint32_t row) override
+    {
+      ensure_space(row + 1);
+      return &values[index[row]];
+    }
+
+    // 引用类的默认值的行不需要复制
+    std::shared_ptr<void> copyRow(uint32_t row) override
+    {
+      ensure_space(row + 1);
+      return index[row] != 0 ? std::make_shared<T>(values[index[row]]) : nullptr;
+    }
+
+    void fillRows(const void *value, uint32_t first, uint32_t count) override
+    {
+      ensure_space(first + count);
+      uint32_t slot = intern(*static_cast<const T *>(value));
+      for (uint32_t row = first; row < first + count; ++row)
+      {
+        assign(row, slot);
+        touch(row);
+      }
+    }
+
+    uint64_t layout() override { return layoutOf<T>("shared"); }
+
+    void save(std::ostream &out) const override
+    {
+      WritePod(out, size());
+      if constexpr (IsSerializable<T>())
+      {
+        WritePod(out, static_cast<uint32_t>(values.size()));
+        for (const T &value : values)
+        {
+          if constexpr (std::is_trivially_copyable_v<T>)
+            WritePod(out, value);
+          else
+            Serializer<T>::save(out, value);
+        }
+        WriteVector(out, refs);
+        WriteVector(out, index);
+        WriteVector(out, free_slots);
+      }
+    }
+
+    /**
+     * @brief 读入去重之后的值和每行的引用，查找表根据被引用的值重新建立；
+     * 不能序列化的类型所有行都恢复为引用这个类的默认值
+     */
+    bool load(std::istream &in, const std::shared_ptr<MappedFile> &) override
+    {
+      uint32_t n = 0;
+      if (!ReadPod(in, n))
+        return false;
+      lookup.clear();
+      if constexpr (IsSerializable<T>())
+      {
+        uint32_t count = 0;
+        if (!ReadPod(in, count) || count == 0)
+          return false;
+        values.resize(count);
+        for (T &value : values)
+        {
+          if constexpr (std::is_trivially_copyable_v<T>)
+            ReadPod(in, value);
+          else
+            Serializer<T>::load(in, value);
+        }
+        if (!ReadVector(in, refs) || !ReadVector(in, index) || !ReadVector(in, free_slots))
+          return false;
+        for (uint32_t slot = 1; slot < values.size(); ++slot)
+          if (refs[slot] > 0)
+            lookup.emplace(hash(values[slot]), slot);
+      }
+      else
+      {
+        values.resize(1);
+        refs.assign(1, n);
+        index.assign(n, 0);
+        free_slots.clear();
+      }
+      reloaded(n);
+      return true;
+    }
+
+    // 每行写出是否引用默认值，不是时写出它引用的值，接收方重新去重
+    void saveDelta(std::ostream &out, uint32_t since) const override
+    {
+      WritePod(out, size());
+      if constexpr (IsSerializable<T>())
+        forEachChangedChunk(since, [&](const std::vector<uint32_t> &rows)
+                            {
+          WriteDeltaRows(out, rows);
+          for (uint32_t row : rows)
+          {
+            uint8_t shared = index[row] != 0;
+            WritePod(out, shared);
+            if (!shared)
+              continue;
+            if constexpr (std::is_trivially_copyable_v<T>)
+              WritePod(out, values[index[row]]);
+            else
+              Serializer<T>::save(out, values[index[row]]);
+          } });
+      WritePod(out, kDeltaEnd);
+    }
+
+    bool applyDelta(std::istream &in) override
+    {
+      uint32_t n = 0;
+      if (!ReadPod(in, n))
+        return false;
+      ensure_space(n);
+      std::vector<uint32_t> rows;
+      T value{};
+      while (ReadDeltaRows(in, rows))
+        for (uint32_t row : rows)
+        {
+          uint8_t shared = 0;
+          if (!ReadPod(in, shared))
+            return false;
+          if (!shared)
+          {
+            unset(row);
+            continue;
+          }
+          if constexpr (std::is_trivially_copyable_v<T>)
+            ReadPod(in, value);
+          else if constexpr (HasSerializer<T>::value)
+            Serializer<T>::load(in, value);
+          set(row, value);
+        }
+      return static_cast<bool>(in);
+    }
+
+    void resetRow(uint32_t row) override
+    {
+      ensure_space(row + 1);
+      assign(row, 0);
+      stampAdded(row);
+    }
+
+    void swapRows(uint32_t a, uint32_t b) override
+    {
+      std::swap(index[a], index[b]);
+      rowsSwapped(a, b);
+    }
+
+    void permute(const std::vector<uint32_t> &order) override
+    {
+      std::vector<uint32_t> old(index);
+      for (uint32_t r = 0; r < order.size(); ++r)
+        index[r] = old[order[r]];
+      rowsPermuted(order);
+    }
+
+  private:
+    static bool equal(const T &a, const T &b)
+    {
+      static_assert(IsComparable<T>(), "shared components need operator== or must be trivially copyable");
+      return SameValue(a, b);
+    }
+
+    // 不能按字节比较的类型全部落在同一个桶里，退化为线性查找
+    static size_t hash(const T &value)
+    {
+      if constexpr (std::is_trivially_copyable_v<T>)
+      {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&value);
+        size_t h = 14695981039346656037ull;
+        for (size_t i = 0; i < sizeof(T); ++i)
+          h = (h ^ bytes[i]) * 1099511628211ull;
+        return h;
+      }
+      else
+        return 0;
+    }
+
+    void assign(uint32_t row, uint32_t slot)
+    {
+      uint32_t old = index[row];
+      index[row] = slot;
+      refs[slot]++;
+      if (--refs[old] == 0 && old != 0)
+      {
+        auto range = lookup.equal_range(hash(values[old]));
+        for (auto it = range.first; it != range.second; ++it)
+        {
+          if (it->second == old)
+          {
+            lookup.erase(it);
+            break;
+          }
+        }
+        free_slots.push_back(old);
+      }
+    }
+
+    std::unordered_multimap<size_t, uint32_t> lookup;
+    std::vector<uint32_t> free_slots;
+
+  public:
+    // ForEachShared 分组时使用的临时数组，保存在这里以便复用
+    std::vector<uint32_t> group_offsets, group_rows;
+  };
+
+  template <typename T>
+  class SharedComponentRef
+  {
+    const Entity *entity;
+
+  public:
+    SharedComponentRef(const Entity *ent) : entity(ent) {}
+
+    SharedBuffer<T> *buffer() const
+    {
+      return entity->getComponentManager().template getOrCreateSharedBuffer<T>();
+    }
+
+    const T &operator*() const { return buffer()->get(entity->row()); }
+    const T *operator->() const { return &buffer()->get(entity->row()); }
+
+    void set(const T &value) const { buffer()->set(entity->row(), value); }
+    void unset() const { buffer()->unset(entity->row()); }
+  };
+
+  template <typename T>
+  SharedBuffer<T> *ComponentTraits<Shared<T>>::buffer(IComponentManager *cm)
+  {
+    return cm->template getOrCreateSharedBuffer<T>();
+  }
+
+  template <typename T>
+  typename ComponentTraits<T>::buffer_type *ComponentTraits<T>::buffer(IComponentManager *cm)
+  {
+    return cm->template getOrCreateComponentBuffer<component>();
+  }
+
+  template <typename T, bool Want>
+  TagBuffer<T> *TagTraits<T, Want>::buffer(IComponentManager *cm)
+  {
+    return cm->template getOrCreateTagBuffer<T>();
+  }
+
+  /**
+   * @brief 按组件行号遍历实体，行被重新排列过时通过 idOf 找到这一行对应的实体
+   */
+  template <typename T>
+  class EntityIterator : public IEntityIterator
+  {
+  public:
+    EntityIterator(Column<T> *container, IComponentManager *manager, uint32_t row)
+        : container(container), manager(manager), row(row) {}
+    Column<T> *container;
+    IComponentManager *manager;
+    uint32_t row;
+    IEntityIterator &operator++(int) override
+    {
+      row++;
+      return *this;
+    }
+
+    bool operator==(const IEntityIterator &other) override
+    {
+      return row == dynamic_cast<const EntityIterator<T> &>(other).row;
+    }
+    bool operator!=(const IEntityIterator &other) override
+    {
+      return !(*this == other);
+    }
+
+    Entity *operator->() override { return &**this; }
+    Entity &operator*() override { return (*container)[manager->idOf(row)]; }
+    void advance(uint32_t n) override { row += n; }
+  };
+
+  template <typename T>
+  class RegistryComponentBuffer : public CommonComponentBuffer<T>,
+                                  public IRegistryComponentBuffer
+  {
+  public:
+    // 注册表总是逐行追踪，增量快照据此区分一个编号是否在 since 之后被重新创建过
+    RegistryComponentBuffer(IComponentManager *cm, IComponentBuffer *pcb)
+        : CommonComponentBuffer<T>(cm, pcb)
+    {
+      this->trackRows();
+    }
+
+    Entity *getEntity(uint32_t id) override
+    {
+      if (id >= this->container.size())
+      {
+        this->container.resize(id + 1);
+      }
+      return &this->container.at(id);
+    }
+
+    IEntityIteratorPtr beginEntity() override
+    {
+      return IEntityIteratorPtr(new EntityIterator<T>(&this->container, this->manager, 0));
+    }
+    IEntityIteratorPtr endEntity() override
+    {
+      return IEntityIteratorPtr(new EntityIterator<T>(
+          &this->container, this->manager, static_cast<uint32_t>(this->container.size())));
+    }
+
+    uint64_t layout() override { return this->template layoutOf<T>("registry"); }
+
+    // 实体对象带有虚表，只保存编号对应的状态标志和空闲编号
+    void save(std::ostream &out) const override
+    {
+      std::vector<uint32_t> flags;
+      flags.reserve(this->container.size());
+      for (const T &entity : this->container)
+        flags.push_back(entity.flags);
+      WriteVector(out, flags);
+      WriteVector(out, free_ids);
+    }
+
+    /**
+     * @brief 实体对象的地址必须保持稳定，所以容器只增长不收缩，
+     * 快照之后创建的实体保留为已释放状态，编号加入空闲列表
+     */
+    bool load(std::istream &in, const std::shared_ptr<MappedFile> &) override
+    {
+      std::vector<uint32_t> flags;
+      if (!ReadVector(in, flags) || !ReadVector(in, free_ids))
+        return false;
+      uint32_t n = static_cast<uint32_t>(flags.size());
+      if (this->container.size() < n)
+        this->container.resize(n);
+      for (uint32_t id = 0; id < this->container.size(); ++id)
+      {
+        T &entity = this->container[id];
+        entity.id = id;
+        if (id < n)
+          entity.flags = flags[id];
+        else
+        {
+          entity.flags |= kEntityReleased;
+          free_ids.push_back(id);
+        }
+      }
+      this->reloaded(static_cast<uint32_t>(this->container.size()));
+      return true;
+    }
+
+    void forEachRun(RunVisitor visit, void *ctx) override
+    {
+      this->container.forEachChunk([&](T *first, size_t count)
+                                   { visit(first, static_cast<uint32_t>(count), sizeof(T), ctx); });
+    }
+
+    // 实体对象的地址必须稳定，重新排列只作用在组件缓冲上，行号通过 IComponentManager 的映射转换
+    void swapRows(uint32_t, uint32_t) override {}
+    void permute(const std::vector<uint32_t> &) override {}
+  };
+
+  // ------------------------------------------------------------------------
+
+  template <typename T>
+  class ComponentRef
+  {
+    const Entity *entity;
+
+  public:
+    ComponentRef(const Entity *ent) : entity(ent) {}
+
+    IComponentManager &CM() const { return entity->getComponentManager(); }
+
+    T &operator*() const { return write(); }
+    T *operator->() const { return &write(); }
+
+    /// 只读访问，不会把这一行标记为已修改
+    const T &read() const
+    {
+      IComponentManager &cm = CM();
+      return getBuffer(cm)->get(cm.rowOf(entity->id));
+    }
+
+    T &write() const
+    {
+      IComponentManager &cm = CM();
+      auto *cb = getBuffer(cm);
+      uint32_t row = cm.rowOf(entity->id);
+      cb->touch(row);
+      return cb->get(row);
+    }
+
+    /**
+     * @brief 显式修改组件，会触发 onUpdate 观察者
+     */
+    template <typename F>
+    void patch(F &&f) const
+    {
+      IComponentManager &cm = CM();
+      getBuffer(cm)->patch(cm.rowOf(entity->id), 1, std::forward<F>(f));
+    }
+
+    static ComponentBuffer<T> *getBuffer(IComponentManager &cm)
+    {
+      auto *reg = cm.template getOrCreateComponentBuffer<T>();
+      return (reg);
+    }
+  };
+
+  /**
+   * @brief DoubleBufferedRef 是双缓冲组件的引用
+   *
+   * 通过 * 和 -> 只能读到上一帧（前台）的数据，写入需要通过 next() 访问后台缓冲，
+   * 这样读写同一个组件的系统可以不加锁地并行执行
+   */
+  template <typename T>
+  class DoubleBufferedRef
+  {
+    const Entity *entity;
+
+  public:
+    DoubleBufferedRef(const Entity *ent) : entity(ent) {}
+
+    IComponentManager &CM() const { return entity->getComponentManager(); }
+
+    const T &operator*() const
+    {
+      IComponentManager &cm = CM();
+      return getBuffer(cm)->get(cm.rowOf(entity->id));
+    }
+    const T *operator->() const { return &**this; }
+    T &next() const
+    {
+      IComponentManager &cm = CM();
+      auto *cb = getBuffer(cm);
+      uint32_t row = cm.rowOf(entity->id);
+      cb->touch(row);
+      return cb->getNext(row);
+    }
+
+    static ComponentBuffer<T> *getBuffer(IComponentManager &cm)
+    {
+      auto *reg = cm.template getOrCreateComponentBuffer<T>();
+      reg->enableDoubleBuffer();
+      return (reg);
+    }
+  };
+
+  template <typename T>
+  class OptionalComponentRef
+  {
+    const Entity *entity;
+  public:
+    OptionalComponentRef(const Entity *ent) : entity(ent) {}
+
+    IComponentManager &CM() const { return entity->getComponentManager(); }
+
+    // TODO: Implement this with a ComponentMap
+  };
+
+  template <typename T>
+  T *CreateEntity()
+  {
+    static RegistryComponentBuffer<T> *registry =
+        ComponentManager<T>::inst()
+            .template getOrCreateRegistryComponentBuffer<T>();
+    const IComponentManager *cm = &ComponentManager<T>::inst();
+
+    // 优先复用已经释放的编号，所有组件恢复为默认值
+    if (!registry->free_ids.empty())
+    {
+      uint32_t id = registry->free_ids.back();
+      registry->free_ids.pop_back();
+      registry->resetRow(id);
+      T &inst = registry->get(id);
+      inst.id = id;
+      for (auto [key, component] : cm->components)
+      {
+        component->resetRow(cm->rowOf(id));
+      }
+      ComponentManager<T>::inst().rowChanged(cm->rowOf(id));
+      return &inst;
+    }
+
+    uint32_t id = registry->add();
+    T &inst = registry->get(id);
+    inst.id = id;
+
+    // 新实体总是追加在最后一行
+    if (!cm->row_of.empty())
+    {
+      auto &mapped = ComponentManager<T>::inst();
+      mapped.row_of.push_back(id);
+      mapped.id_of.push_back(id);
+      mapped.rowMoved(id);
+    }
+
+    // This piece of code must be done after the entity is created
+    // Otherwise, you may not see the components before first entity is created
+    for (auto [key, component] : cm->components)
+    {
+      component->ensure_space(id + 1);
+    }
+    ComponentManager<T>::inst().rowChanged(id);
+
+    return &inst;
+  }
+
+  /**
+   * @brief 在末尾连续创建 n 个实体，返回第一个实体的编号
+   *
+   * 不复用已经释放的编号，新的行总是追加在最后，所以这些实体的编号和行号都是连续的。
+   * fill(第一行) 在通知 Group 之前按块批量写入组件；Group 可能把新的行交换到前面，之后这段行就不再连续。
+   * 写入期间暂停观察者，onConstruct 看到的是 fill 写入之后的值
+   */
+  template <typename T, typename F>
+  uint32_t CreateEntities(uint32_t n, F &&fill)
+  {
+    auto &cm = ComponentManager<T>::inst();
+    RegistryComponentBuffer<T> *registry = cm.template getOrCreateRegistryComponentBuffer<T>();
+    uint32_t first = registry->size();
+    registry->ensure_space(first + n);
+    for (uint32_t id = first; id < first + n; ++id)
+    {
+      registry->get(id).id = id;
+      if (!cm.row_of.empty())
+      {
+        cm.row_of.push_back(id);
+        cm.id_of.push_back(id);
+        cm.rowMoved(id);
+      }
+    }
+    std::vector<IComponentBuffer *> muted;
+    for (auto [key, component] : cm.components)
+    {
+      if (component->observed)
+      {
+        component->observed = false;
+        muted.push_back(component);
+      }
+      component->ensure_space(first + n);
+    }
+    uint32_t row = cm.rowOf(first);
+    fill(row);
+    for (IComponentBuffer *cb : muted)
+    {
+      cb->observed = true;
+      cb->notifyConstruct(row, n);
+    }
+    for (uint32_t id = first; id < first + n; ++id)
+      cm.rowChanged(cm.rowOf(id));
+    return first;
+  }
+
+  template <typename T>
+  uint32_t CreateEntities(uint32_t n)
+  {
+    return CreateEntities<T>(n, [](uint32_t) {});
+  }
+
+  /**
+   * @brief 预制体：保存 E 类一行在所有组件缓冲中的值，instantiate 批量创建使用这些值的实体
+   *
+   * 新实体在末尾连续创建，每个组件按块整段填充，不需要逐个实体、逐个字段地赋值；
+   * 所有的缓冲（包括标签）填完之后才通知 Group。
+   * 捕获之后才第一次使用的组件在实例中保持默认值；Unique 和 Transient 组件（GUID、树和索引中的槽位）不会被捕获
+   */
+  template <typename E>
+  class Prefab
+  {
+  public:
+    /// 空的预制体，实例使用默认值，之后可以用 set 修改
+    Prefab() = default;
+
+    /// 捕获 source 当前所有组件、标签和共享组件的值，source 必须正好是 E 类的实体
+    explicit Prefab(const E *source)
+    {
+      IComponentManager &cm = ComponentManager<E>::inst();
+      uint32_t row = cm.rowOf(source->id);
+      for (auto [key, cb] : cm.components)
+        if (std::shared_ptr<void> value = cb->copyRow(row))
+          values.emplace_back(cb, std::move(value));
+    }
+
+    /// 修改预制体中普通组件 C 的值
+    template <typename C>
+    Prefab &set(const C &value)
+    {
+      IComponentBuffer *cb = ComponentTraits<C>::buffer(&ComponentManager<E>::inst());
+      for (auto &[buffer, stored] : values)
+        if (buffer == cb)
+        {
+          stored = std::make_shared<C>(value);
+          return *this;
+        }
+      values.emplace_back(cb, std::make_shared<C>(value));
+      return *this;
+    }
+
+    /**
+     * @brief 创建 n 个实体，返回第一个实体的编号，实例的编号是连续的
+     */
+    uint32_t instantiate(uint32_t n)
+    {
+      return instantiate(n, [](E *, uint32_t) {});
+    }
+
+    /**
+     * @brief 同上，批量填充之后对第 i 个实例调用 override(entity, i)，设置每个实例各自不同的值
+     */
+    template <typename F>
+    uint32_t instantiate(uint32_t n, F &&override)
+    {
+      uint32_t first = CreateEntities<E>(n, [&](uint32_t row)
+                                         {
+        for (auto &[cb, value] : values)
+          cb->fillRows(value.get(), row, n); });
+      RegistryComponentBuffer<E> *registry = ComponentManager<E>::inst().template getRegistryComponentBuffer<E>();
+      for (uint32_t i = 0; i < n; ++i)
+        override(&registry->get(first + i), i);
+      return first;
+    }
+
+  private:
+    std::vector<std::pair<IComponentBuffer *, std::shared_ptr<void>>> values;
+  };
+
+  /**
+   * @brief 释放一个实体，派发 onDestroy 事件，之后它的编号会被同一个类新创建的实体复用
+   *
+   * 实体对象本身和组件数据保留到被复用为止，View 会跳过已经释放的实体
+   */
+  inline void ReleaseEntity(Entity *entity)
+  {
+    if (entity->flags & kEntityReleased)
+      return;
+    IComponentManager &cm = entity->getComponentManager();
+    uint32_t row = cm.rowOf(entity->id);
+    for (auto [key, component] : cm.components)
+    {
+      if (component->observed && row < component->size())
+        component->notifyDestroy(row, 1);
+    }
+    entity->flags |= kEntityReleased;
+    dynamic_cast<IRegistryComponentBuffer *>(cm.registy)->free_ids.push_back(entity->id);
+    cm.registy->touch(entity->id);
+    cm.rowChanged(row);
+  }
+
+  template <typename T>
+  void ReleaseEntity(uint32_t id)
+  {
+    ReleaseEntity(ComponentManager<T>::inst().template getRegistryComponentBuffer<T>()->getEntity(id));
+  }
+
+  // ------------------------------------------------------------------------
+
+  template <typename T>
+  class BufferIterator
+  {
+  public:
+    using Traits = ComponentTraits<T>;
+    using CBType = ComponentBuffer<typename Traits::component>;
+    using Value = typename Traits::value;
+    BufferIterator() {}
+    BufferIterator(CBType *_cb)
+    {
+      if (_cb != nullptr)
+      {
+        this->cb = _cb;
+      }
+
+      it = Traits::storage(cb).begin();
+      Settle();
+    }
+    BufferIterator &operator++()
+    {
+      it++;
+      row++;
+      Settle();
+      return *this;
+    }
+
+    /**
+     * @brief 在当前的缓冲内前进 n 行，n 不能超过当前缓冲剩余的行数
+     */
+    void Advance(uint32_t n)
+    {
+      it += n;
+      row += n;
+      Settle();
+    }
+
+    /**
+     * @brief 过滤条件要求从当前行开始跳过的行数，不会超出当前缓冲
+     */
+    uint32_t Skip(uint32_t since)
+    {
+      if (cb == nullptr)
+        return 0;
+      uint32_t n = Traits::skip(cb, row, since);
+      uint32_t left = static_cast<uint32_t>(Traits::storage(cb).size()) - row;
+      return n < left ? n : left;
+    }
+
+    bool Done() const { return cb == nullptr; }
+
+    bool IsValid()
+    {
+      if (cb == nullptr)
+        return false;
+      if (it == Traits::storage(cb).end())
+        return false;
+      return true;
+    }
+
+    void MoveNext()
+    {
+      if (it == Traits::storage(cb).end())
+      {
+        row = 0;
+        if (cb->children != nullptr)
+        {
+          cb = dynamic_cast<CBType *>(cb->children);
+          it = Traits::storage(cb).begin();
+        }
+        else if (cb->next != nullptr)
+        {
+          cb = dynamic_cast<CBType *>(cb->next);
+          it = Traits::storage(cb).begin();
+        }
+        else
+        {
+          while (cb->parent != nullptr && cb->parent->next == nullptr)
+          {
+            cb = dynamic_cast<CBType *>(cb->parent);
+          }
+          if (cb->parent != nullptr)
+          {
+            cb = dynamic_cast<CBType *>(cb->parent->next);
+            it = Traits::storage(cb).begin();
+          }
+          else
+          {
+            cb = nullptr;
+          }
+        }
+      }
+    }
+
+    bool operator==(const BufferIterator &other)
+    {
+      if (cb == nullptr)
+        return other.cb == nullptr;
+      else
+      {
+        if (cb == other.cb)
+        {
+          return it == other.it;
+        }
+        else
+        {
+          return false;
+        }
+      }
+    }
+    bool operator!=(const BufferIterator &other) { return !(*this == other); }
+
+    Value *operator->()
+    {
+      if constexpr (Traits::writes)
+        cb->touch(row);
+      return &*it;
+    }
+    Value &operator*() { return *operator->(); }
+
+  private:
+    void Settle()
+    {
+      while (cb != nullptr && !IsValid())
+        MoveNext();
+    }
+
+    CBType *cb = nullptr;
+    typename Column<typename Traits::component>::iterator it;
+    uint32_t row = 0;
+  };
+
+  /**
+   * @brief RowIterator 和 BufferIterator 按同样的顺序遍历类的继承树，但是只记录行号，
+   * 数据通过 ComponentTraits<P>::at() 取得，用于标签、共享组件这类不是逐行存储的缓冲
+   */
+  template <typename P>
+  class RowIterator
+  {
+  public:
+    using Traits = ComponentTraits<P>;
+    using CBType = typename Traits::buffer_type;
+    RowIterator() {}
+    RowIterator(CBType *_cb) : cb(_cb) { Settle(); }
+
+    RowIterator &operator++()
+    {
+      row++;
+      Settle();
+      return *this;
+    }
+
+    void Advance(uint32_t n)
+    {
+      row += n;
+      Settle();
+    }
+
+    uint32_t Skip(uint32_t since)
+    {
+      if (cb == nullptr)
+        return 0;
+      uint32_t n = Traits::skip(cb, row, since);
+      uint32_t left = cb->size() - row;
+      return n < left ? n : left;
+    }
+
+    bool Done() const { return cb == nullptr; }
+
+    bool IsValid() { return cb != nullptr && row < cb->size(); }
+
+    void MoveNext()
+    {
+      if (row < cb->size())
+        return;
+      row = 0;
+      if (cb->children != nullptr)
+      {
+        cb = static_cast<CBType *>(cb->children);
+      }
+      else if (cb->next != nullptr)
+      {
+        cb = static_cast<CBType *>(cb->next);
+      }
+      else
+      {
+        while (cb->parent != nullptr && cb->parent->next == nullptr)
+        {
+          cb = static_cast<CBType *>(cb->parent);
+        }
+        if (cb->parent != nullptr)
+          cb = static_cast<CBType *>(cb->parent->next);
+        else
+          cb = nullptr;
+      }
+    }
+
+    bool operator==(const RowIterator &other)
+    {
+      if (cb == nullptr)
+        return other.cb == nullptr;
+      return cb == other.cb && row == other.row;
+    }
+    bool operator!=(const RowIterator &other) { return !(*this == other); }
+
+    typename Traits::value *operator->() { return Traits::at(cb, row); }
+
+  private:
+    void Settle()
+    {
+      while (cb != nullptr && !IsValid())
+        MoveNext();
+    }
+
+    CBType *cb = nullptr;
+    uint32_t row = 0;
+  };
+
+  template <typename T>
+  class BufferIterator<With<T>> : public RowIterator<With<T>>
+  {
+  public:
+    using RowIterator<With<T>>::RowIterator;
+  };
+
+  template <typename T>
+  class BufferIterator<Without<T>> : public RowIterator<Without<T>>
+  {
+  public:
+    using RowIterator<Without<T>>::RowIterator;
+  };
+
+  template <typename T>
+  class BufferIterator<Shared<T>> : public RowIterator<Shared<T>>
+  {
+  public:
+    using RowIterator<Shared<T>>::RowIterator;
+  };
+
+  template <typename T>
+  class RegistryBufferIterator
+  {
+  public:
+    RegistryBufferIterator() {}
+    RegistryBufferIterator(IComponentBuffer *_cb)
+    {
+      setCB(_cb);
+
+      it = rcb->beginEntity();
+
+      while (cb != nullptr && !IsValid())
+        MoveNext();
+    }
+    RegistryBufferIterator &operator++()
+    {
+      (*it)++;
+
+      while (cb != nullptr && !IsValid())
+        MoveNext();
+      return *this;
+    }
+
+    void Advance(uint32_t n)
+    {
+      it->advance(n);
+
+      while (cb != nullptr && !IsValid())
+        MoveNext();
+    }
+
+    bool Done() const { return cb == nullptr; }
+
+    bool Released()
+    {
+      return !rcb->free_ids.empty() && ((*it)->flags & kEntityReleased);
+    }
+
+    bool IsValid()
+    {
+      if (cb == nullptr)
+        return false;
+      if (*it == *(rcb->endEntity()))
+        return false;
+      return true;
+    }
+
+    void MoveNext()
+    {
+      if (*it == *(rcb->endEntity()))
+      {
+        if (cb->children != nullptr)
+        {
+          setCB(cb->children);
+          it = rcb->beginEntity();
+        }
+        else if (cb->next != nullptr)
+        {
+          setCB(cb->next);
+          it = rcb->beginEntity();
+        }
+        else
+        {
+          while (cb->parent != nullptr && cb->parent->next == nullptr)
+          {
+            setCB(cb->parent);
+          }
+          if (cb->parent != nullptr)
+          {
+            setCB(cb->parent->next);
+            it = rcb->beginEntity();
+          }
+          else
+          {
+            setCB(nullptr);
+          }
+        }
+      }
+    }
+
+    bool operator==(const RegistryBufferIterator &other)
+    {
+      if (cb == nullptr)
+        return other.cb == nullptr;
+      else
+      {
+        if (cb == other.cb)
+        {
+          return it == other.it;
+        }
+        else
+        {
+          return false;
+        }
+      }
+    }
+    bool operator!=(const RegistryBufferIterator &other) { return !(*this == other); }
+
+    T *operator->() { return &*it; }
+    T &operator*() { return *it; }
+
+    void setCB(IComponentBuffer *_cb)
+    {
+      if (_cb != nullptr)
+      {
+        this->cb = _cb;
+        this->rcb = dynamic_cast<IRegistryComponentBuffer *>(_cb);
+      } else {
+        this->cb = nullptr;
+        this->rcb = nullptr;
+      }
+    }
+
+  private:
+    IComponentBuffer *cb = nullptr;
+    IRegistryComponentBuffer *rcb = nullptr;
+    IEntityIteratorPtr it;
+  };
+
+  template <typename B, typename... Ts>
+  class ViewIterator : public RegistryBufferIterator<B>, public BufferIterator<Ts>...
+  {
+  public:
+    ViewIterator() {}
+
+    ViewIterator(ComponentManager<B> &cm, uint32_t since = 0)
+        : RegistryBufferIterator<B>(cm.registy),
+          BufferIterator<Ts>(ComponentTraits<Ts>::buffer(&cm))...,
+          since(since)
+    {
+      std::cout << cm.registy->size() << std::endl;
+      uint32_t sizes[] = {ComponentTraits<Ts>::buffer(&cm)->size()...};
+      for (int i = 0; i < sizeof...(Ts); i++)
+      {
+        std::cout << sizes[i] << std::endl;
+      }
+      SkipFiltered();
+    }
+
+    ViewIterator &operator++()
+    {
+      RegistryBufferIterator<B>::operator++();
+      (BufferIterator<Ts>::operator++(), ...);
+      SkipFiltered();
+      return *this;
+    }
+    bool operator==(const ViewIterator &other)
+    {
+      bool reg = RegistryBufferIterator<B>::operator==(other);
+      bool ts[] = {BufferIterator<Ts>::operator==(other)...};
+      return reg && std::all_of(ts, ts + sizeof...(Ts), [](bool b)
+                                { return b; });
+    }
+    bool operator!=(const ViewIterator &other) { return !(*this == other); }
+
+    std::tuple<typename ComponentTraits<Ts>::value *...> operator*()
+    {
+      return std::tuple<typename ComponentTraits<Ts>::value *...>(
+          BufferIterator<Ts>::operator->()...);
+    }
+
+  private:
+    // 所有迭代器都是同步前进的，过滤条件不满足或者实体已经释放时一起跳过，
+    // 整块没有变化时一次跳过整块
+    void SkipFiltered()
+    {
+      while (!RegistryBufferIterator<B>::Done())
+      {
+        uint32_t n = 0;
+        if constexpr ((ComponentTraits<Ts>::filtered || ...))
+          n = std::max({0u, BufferIterator<Ts>::Skip(since)...});
+        if (n == 0 && RegistryBufferIterator<B>::Released())
+          n = 1;
+        if (n == 0)
+          return;
+        RegistryBufferIterator<B>::Advance(n);
+        (BufferIterator<Ts>::Advance(n), ...);
+      }
+    }
+
+    uint32_t since = 0;
+  };
+
+  template <typename B, typename... Ts>
+  class View
+  {
+  public:
+    View() { ensure_space(ComponentManager<B>::inst().registy); }
+
+    /**
+     * @brief since 是 Changed<T> / Added<T> 过滤使用的版本号，只遍历在这个版本之后发生的变化
+     */
+    explicit View(uint32_t since) : since(since)
+    {
+      ensure_space(ComponentManager<B>::inst().registy);
+    }
+
+    void ensure_space(IComponentBuffer *cur)
+    {
+      IComponentManager *cm = cur->manager;
+      (ComponentTraits<Ts>::prepare(ComponentTraits<Ts>::buffer(cm)), ...);
+      std::vector<IComponentBuffer *> cbs = {ComponentTraits<Ts>::buffer(cm)...};
+
+      for (auto cb : cbs)
+      {
+        if (cb != nullptr)
+        {
+          cb->ensure_space(cur->size());
+        }
+      }
+
+      if (cur->children != nullptr)
+        ensure_space(cur->children);
+      if (cur->next != nullptr)
+        ensure_space(cur->next);
+    }
+
+    ViewIterator<B, Ts...> begin()
+    {
+      return ViewIterator<B, Ts...>(ComponentManager<B>::inst(), since);
+    }
+    ViewIterator<B, Ts...> end() { return ViewIterator<B, Ts...>(); }
+
+  private:
+    uint32_t since = 0;
+  };
+
+  /**
+   * @brief ViewCursor 是一个可以跨帧保存进度的 View 游标
+   *
+   * 对于一些不需要每帧遍历全部实体的维护类系统，可以每次只处理最多 N 个实体或者
+   * 最多 T 微秒，下次调用时从上次停下的位置继续。游标按类记录已经处理到的行号，
+   * 所以即使在两次调用之间新增了实体或者新的子类，本轮遍历也不会遗漏它们。
+   * 当所有类都处理完毕后，sweeps() 加一，下一次调用重新开始新的一轮遍历。
+   */
+  template <typename B, typename... Ts>
+  class ViewCursor
+  {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @brief 最多处理 max_entities 个实体，或者最多运行 max_time 时间
+     * @return 本次调用实际处理的实体数量
+     */
+    template <typename F>
+    uint32_t step(F &&f, uint32_t max_entities,
+                  std::chrono::microseconds max_time = std::chrono::microseconds::max())
+    {
+      const bool timed = max_time != std::chrono::microseconds::max();
+      const Clock::time_point deadline = timed ? Clock::now() + max_time : Clock::time_point();
+
+      refresh();
+      uint32_t processed = 0;
+      bool pending = false;
+      for (auto &[cur, row] : progress)
+      {
+        uint32_t size = cur->size();
+        if (row >= size)
+          continue;
+        if (processed >= max_entities || (timed && Clock::now() >= deadline))
+        {
+          pending = true;
+          break;
+        }
+
+        IComponentManager *cm = cur->manager;
+        std::tuple<typename ComponentTraits<Ts>::buffer_type *...> cbs(
+            ComponentTraits<Ts>::buffer(cm)...);
+        std::apply([size](auto *...cb)
+                   { (cb->ensure_space(size), ...); },
+                   cbs);
+        std::apply([](auto *...cb)
+                   { (ComponentTraits<Ts>::prepare(cb), ...); },
+                   cbs);
+        IRegistryComponentBuffer *rcb = dynamic_cast<IRegistryComponentBuffer *>(cur);
+
+        while (row < size && processed < max_entities)
+        {
+          if (!rcb->free_ids.empty() && (rcb->getEntity(cm->idOf(row))->flags & kEntityReleased))
+          {
+            ++row;
+            continue;
+          }
+          if constexpr ((ComponentTraits<Ts>::filtered || ...))
+          {
+            uint32_t skip = std::apply([&](auto *...cb)
+                                       { return std::max({0u, ComponentTraits<Ts>::skip(cb, row, 0)...}); },
+                                       cbs);
+            if (skip > 0)
+            {
+              row = std::min(row + skip, size);
+              continue;
+            }
+          }
+          std::apply([&](auto *...cb)
+                     {
+                       ((ComponentTraits<Ts>::writes ? cb->touch(row) : void()), ...);
+                       f(ComponentTraits<Ts>::at(cb, row)...); },
+                     cbs);
+          ++row;
+          ++processed;
+          if (timed && (processed & (kTimeCheckInterval - 1)) == 0 && Clock::now() >= deadline)
+            break;
+        }
+        if (row < size)
+        {
+          pending = true;
+          break;
+        }
+      }
+
+      if (!pending)
+      {
+        ++sweep_count;
+        progress.clear();
+      }
+      return processed;
+    }
+
+    /**
+     * @brief 只按时间预算处理实体
+     */
+    template <typename F>
+    uint32_t step_for(F &&f, std::chrono::microseconds max_time)
+    {
+      return step(std::forward<F>(f), UINT32_MAX, max_time);
+    }
+
+    /// 已经完成的完整遍历次数
+    uint64_t sweeps() const { return sweep_count; }
+
+    /// 放弃当前这一轮的进度，下次调用从头开始
+    void reset() { progress.clear(); }
+
+  private:
+    static constexpr uint32_t kTimeCheckInterval = 64;
+
+    // 按照 View 相同的深度优先顺序收集类，已经记录过的类保留原来的进度
+    void refresh()
+    {
+      IComponentBuffer *root = ComponentManager<B>::inst().registy;
+      if (root != nullptr)
+        collect(root);
+    }
+
+    void collect(IComponentBuffer *cur)
+    {
+      for (; cur != nullptr; cur = cur->next)
+      {
+        auto it = std::find_if(progress.begin(), progress.end(),
+                               [cur](const auto &p)
+                               { return p.first == cur; });
+        if (it == progress.end())
+          progress.emplace_back(cur, 0);
+        collect(cur->children);
+        if (cur == ComponentManager<B>::inst().registy)
+          break;
+      }
+    }
+
+    std::vector<std::pair<IComponentBuffer *, uint32_t>> progress;
+    uint64_t sweep_count = 0;
+  };
+
+  /**
+   * @brief 在帧末交换 B 及其所有子类中组件 T 的前后台缓冲，每个类的缓冲都是 O(1) 的指针交换
+   */
+  template <typename B, typename T>
+  void SwapBuffers()
+  {
+    IComponentBuffer *root = ComponentManager<B>::inst().template getComponentBuffer<T>();
+    if (root == nullptr)
+      return;
+    std::vector<IComponentBuffer *> stack = {root};
+    while (!stack.empty())
+    {
+      IComponentBuffer *cur = stack.back();
+      stack.pop_back();
+      static_cast<CommonComponentBuffer<T> *>(cur)->swapBuffers();
+      for (IComponentBuffer *child = cur->children; child != nullptr; child = child->next)
+        stack.push_back(child);
+    }
+  }
+
+  /**
+   * @brief 为 B 及其所有子类中的组件 T 打开逐行的变更追踪
+   */
+  template <typename B, typename T>
+  void TrackRows()
+  {
+    ComponentManager<B>::inst().template getOrCreateComponentBuffer<T>()->trackRows();
+  }
+
+  /**
+   * @brief 按共享值分组遍历 B 及其所有子类的实体
+   *
+   * 对每个类、每个被引用的共享值调用一次 f(const T &value, IComponentManager &cm, Span<const uint32_t> rows)，
+   * rows 是这个类中引用该值的行号（用 idOf 换成实体编号），这样每个共享值在一组实体中只需要加载一次。
+   * 分组使用计数排序，临时数组在调用之间复用。
+   */
+  template <typename B, typename T, typename F>
+  void ForEachShared(F &&f)
+  {
+    std::vector<IComponentBuffer *> stack = {
+        ComponentManager<B>::inst().template getOrCreateSharedBuffer<T>()};
+    while (!stack.empty())
+    {
+      auto *cb = static_cast<SharedBuffer<T> *>(stack.back());
+      stack.pop_back();
+      for (IComponentBuffer *child = cb->children; child != nullptr; child = child->next)
+        stack.push_back(child);
+
+      IComponentBuffer *reg = cb->manager->registy;
+      if (reg == nullptr)
+        continue;
+      auto *rcb = dynamic_cast<IRegistryComponentBuffer *>(reg);
+      uint32_t rows = std::min(cb->size(), reg->size());
+      auto alive = [&](uint32_t row)
+      {
+        return rcb->free_ids.empty() ||
+               !(rcb->getEntity(cb->manager->idOf(row))->flags & kEntityReleased);
+      };
+
+      auto &offsets = cb->group_offsets;
+      auto &sorted = cb->group_rows;
+      offsets.assign(cb->values.size() + 1, 0);
+      for (uint32_t row = 0; row < rows; ++row)
+        if (alive(row))
+          offsets[cb->index[row] + 1]++;
+      for (size_t i = 1; i < offsets.size(); ++i)
+        offsets[i] += offsets[i - 1];
+      sorted.resize(offsets.back());
+      for (uint32_t row = 0; row < rows; ++row)
+        if (alive(row))
+          sorted[offsets[cb->index[row]]++] = row;
+
+      // 填充之后 offsets[i] 指向第 i 组的末尾
+      uint32_t begin = 0;
+      for (size_t slot = 0; slot + 1 < offsets.size(); ++slot)
+      {
+        uint32_t end = offsets[slot];
+        if (end > begin)
+          f(static_cast<const T &>(cb->values[slot]), *cb->manager,
+            Span<const uint32_t>(sorted.data() + begin, end - begin));
+        begin = end;
+      }
+    }
+  }
+
+  /**
+   * @brief 对 B 及其所有子类的每个存活实体调用成员函数 Method，例如 ecs::dispatch<Node, &Node::tick>(dt)
+   *
+   * 每个具体类只有一次虚调用取得它的实体内存段，段内是静态绑定的紧凑循环，
+   * 不同类的实体交错时也不会像逐个实体调用虚函数那样造成分支预测失败。
+   * Method 是模板参数，段内直接调用（可以内联）；它应当是非虚函数，否则每次调用仍然要经过虚表。
+   */
+  template <typename B, auto Method, typename... Args>
+  void dispatch(Args &&...args)
+  {
+    auto call = [&](B *entity)
+    { (entity->*Method)(args...); };
+    using Call = decltype(call);
+    IRegistryComponentBuffer::RunVisitor visit =
+        [](Entity *first, uint32_t count, uint32_t stride, void *ctx)
+    {
+      Call &call = *static_cast<Call *>(ctx);
+      // 同一个类中 B 子对象相对实体的偏移都相同，按 stride 前进即可
+      char *base = reinterpret_cast<char *>(static_cast<B *>(first));
+      for (uint32_t i = 0; i < count; ++i)
+      {
+        B *entity = reinterpret_cast<B *>(base + size_t(i) * stride);
+        if (!(entity->flags & kEntityReleased))
+          call(entity);
+      }
+    };
+
+    std::vector<IComponentBuffer *> stack;
+    if (ComponentManager<B>::inst().registy != nullptr)
+      stack.push_back(ComponentManager<B>::inst().registy);
+    while (!stack.empty())
+    {
+      IComponentBuffer *reg = stack.back();
+      stack.pop_back();
+      for (IComponentBuffer *child = reg->children; child != nullptr; child = child->next)
+        stack.push_back(child);
+      dynamic_cast<IRegistryComponentBuffer *>(reg)->forEachRun(visit, &call);
+    }
+  }
+
+  // ------------------------------------------------------------------------
+
+  template <typename M>
+  struct MemberPointerTraits;
+
+  template <typename C, typename K>
+  struct MemberPointerTraits<K C::*>
+  {
+    using component = C;
+    using key = K;
+  };
+
+  /**
+   * @brief 把数值键转换成保持大小顺序的无符号整数，用于基数排序
+   */
+  template <typename K>
+  auto RadixKey(K key)
+  {
+    static_assert(std::is_arithmetic_v<K>, "sort key must be arithmetic");
+    using U = std::conditional_t<(sizeof(K) > 4), uint64_t, uint32_t>;
+    constexpr U sign = U(1) << (sizeof(K) * 8 - 1);
+    if constexpr (std::is_floating_point_v<K>)
+    {
+      std::conditional_t<sizeof(K) == 8, uint64_t, uint32_t> bits;
+      std::memcpy(&bits, &key, sizeof(K));
+      return (bits & sign) ? U(~bits) : U(bits | sign);
+    }
+    else if constexpr (std::is_signed_v<K>)
+      return U(static_cast<std::make_unsigned_t<K>>(key)) ^ sign;
+    else
+      return U(key);
+  }
+
+  /**
+   * @brief 让 B 及其所有子类的行按某个组件字段升序排列，例如 SortedGroup<Node, &Position::y>
+   *
+   * 每次 sort() 先读一遍键：已经有序时直接返回；否则先在键的副本上试做插入排序，
+   * 总移动距离不超过 n / kInsertionRatio 时逐行交换；超过之后改为对键做基数排序，
+   * 再一次性重排这个类的所有组件缓冲（permuteRows 会为每个缓冲分配新的存储）。
+   * 实体对象和编号保持不变，行号通过 IComponentManager::rowOf / idOf 转换，
+   * 所以 View 按排好的顺序遍历，而 ComponentRef 仍然能找到原来的实体。
+   */
+  template <typename B, auto Key>
+  class SortedGroup
+  {
+  public:
+    using C = typename MemberPointerTraits<decltype(Key)>::component;
+    using K = typename MemberPointerTraits<decltype(Key)>::key;
+    using U = decltype(RadixKey(K()));
+
+    // 插入排序的总移动距离超过 n / kInsertionRatio 之后改用基数排序
+    static constexpr uint32_t kInsertionRatio = 4;
+
+    /**
+     * @brief 重新排序，返回这次移动过行的类的数量
+     */
+    uint32_t sort()
+    {
+      uint32_t sorted_classes = 0;
+      stack.assign(1, ComponentManager<B>::inst().template getOrCreateComponentBuffer<C>());
+      while (!stack.empty())
+      {
+        auto *cb = static_cast<CommonComponentBuffer<C> *>(stack.back());
+        stack.pop_back();
+        for (IComponentBuffer *child = cb->children; child != nullptr; child = child->next)
+          stack.push_back(child);
+        if (sortClass(cb))
+          sorted_classes++;
+      }
+      return sorted_classes;
+    }
+
+  private:
+    bool sortClass(CommonComponentBuffer<C> *cb)
+    {
+      IComponentManager &cm = *cb->manager;
+      uint32_t n = cm.registy != nullptr ? cm.registy->size() : 0;
+      if (n < 2)
+        return false;
+      cb->ensure_space(n);
+
+      keys.resize(n);
+      bool ordered = true;
+      for (uint32_t row = 0; row < n; ++row)
+      {
+        keys[row] = RadixKey(cb->get(row).*Key);
+        if (row > 0 && keys[row] < keys[row - 1])
+          ordered = false;
+      }
+      if (ordered)
+        return false;
+
+      if (planInsertion(n))
+      {
+        for (uint32_t j : swaps)
+          cm.swapRows(j - 1, j);
+      }
+      else
+      {
+        radixSort(n);
+        cm.permuteRows(order);
+      }
+      return true;
+    }
+
+    // 在键的副本上做插入排序，把每次相邻交换的位置记录到 swaps；总移动距离超出预算时放弃
+    bool planInsertion(uint32_t n)
+    {
+      size_t budget = n / kInsertionRatio;
+      shifted.assign(keys.begin(), keys.begin() + n);
+      swaps.clear();
+      for (uint32_t row = 1; row < n; ++row)
+        for (uint32_t j = row; j > 0 && shifted[j] < shifted[j - 1]; --j)
+        {
+          if (swaps.size() == budget)
+            return false;
+          std::swap(shifted[j], shifted[j - 1]);
+          swaps.push_back(j);
+        }
+      return true;
+    }
+
+    // 按字节做 LSD 基数排序，结果写入 order；所有键这一字节都相同时跳过这一趟
+    void radixSort(uint32_t n)
+    {
+      order.resize(n);
+      scratch.resize(n);
+      for (uint32_t row = 0; row < n; ++row)
+        order[row] = row;
+      for (uint32_t shift = 0; shift < sizeof(U) * 8; shift += 8)
+      {
+        uint32_t counts[257] = {};
+        for (uint32_t row = 0; row < n; ++row)
+          counts[((keys[row] >> shift) & 0xff) + 1]++;
+        if (counts[((keys[0] >> shift) & 0xff) + 1] == n)
+          continue;
+        for (uint32_t i = 1; i < 257; ++i)
+          counts[i] += counts[i - 1];
+        for (uint32_t i = 0; i < n; ++i)
+          scratch[counts[(keys[order[i]] >> shift) & 0xff]++] = order[i];
+        order.swap(scratch);
+      }
+    }
+
+    std::vector<IComponentBuffer *> stack;
+    std::vector<U> keys, shifted;
+    std::vector<uint32_t> order, scratch, swaps;
+  };
+
+  /**
+   * @brief 拥有型分组：把 B 及其子类中满足所有参数的实体交换到每个类的前 size 行
+   *
+   * 参数和 View 相同，普通组件总是存在，With<T> / Without<T>（或者直接写标签类型）决定成员关系。
+   * 设置、清除标签以及创建、释放实体时只交换一行来维护分组，each() 只线性扫描每个类的前缀，
+   * 不需要逐行检查。分组会移动整行，所以同一个类上不要同时使用 SortedGroup 或者另一个 Group，
+   * 也不要在遍历这个类的时候改变成员关系。
+   */
+  template <typename B, typename... Ts>
+  class Group : public IGroup
+  {
+    template <typename P>
+    using Param = std::conditional_t<std::is_base_of_v<Tag, P>, With<P>, P>;
+
+  public:
+    Group()
+    {
+      ComponentManager<B>::inst().groups.push_back(this);
+      forEachClass([](State &) {});
+    }
+
+    ~Group() override
+    {
+      auto &groups = ComponentManager<B>::inst().groups;
+      groups.erase(std::remove(groups.begin(), groups.end(), static_cast<IGroup *>(this)), groups.end());
+    }
+
+    Group(const Group &) = delete;
+    Group &operator=(const Group &) = delete;
+
+    /**
+     * @brief 对分组中的每个实体调用 f(ComponentTraits<Ts>::value *...)
+     */
+    template <typename F>
+    void each(F &&f)
+    {
+      forEachClass([&](State &state)
+                   {
+                     std::apply([&](auto *...cb)
+                                {
+                                  for (uint32_t row = 0; row < state.size; ++row)
+                                  {
+                                    ((ComponentTraits<Param<Ts>>::writes ? cb->touch(row) : void()), ...);
+                                    f(ComponentTraits<Param<Ts>>::at(cb, row)...);
+                                  } },
+                                state.cbs); });
+    }
+
+    /// 所有类中属于分组的实体数量
+    uint32_t size()
+    {
+      uint32_t total = 0;
+      forEachClass([&](State &state)
+                   { total += state.size; });
+      return total;
+    }
+
+    void refresh(IComponentManager &cm, uint32_t row) override
+    {
+      State &state = of(cm);
+      bool member = contains(state, row);
+      if (member && row >= state.size)
+        cm.swapRows(row, state.size++);
+      else if (!member && row < state.size)
+        cm.swapRows(row, --state.size);
+    }
+
+    // 读入快照之后前缀的长度不再可信，重新把成员交换到前面
+    void reload(IComponentManager &cm) override
+    {
+      for (State &state : states)
+        if (state.cm == &cm)
+        {
+          state.size = 0;
+          pack(state);
+          return;
+        }
+      of(cm);
+    }
+
+  private:
+    struct State
+    {
+      IComponentManager *cm;
+      uint32_t size;
+      std::tuple<typename ComponentTraits<Param<Ts>>::buffer_type *...> cbs;
+    };
+
+    bool contains(State &state, uint32_t row)
+    {
+      auto *rcb = dynamic_cast<IRegistryComponentBuffer *>(state.cm->registy);
+      if (rcb == nullptr || row >= state.cm->registy->size())
+        return false;
+      if (!rcb->free_ids.empty() && (rcb->getEntity(state.cm->idOf(row))->flags & kEntityReleased))
+        return false;
+      return std::apply([&](auto *...cb)
+                        { return ((!ComponentTraits<Param<Ts>>::filtered ||
+                                   ComponentTraits<Param<Ts>>::skip(cb, row, 0) == 0) &&
+                                  ...); },
+                        state.cbs);
+    }
+
+    // 第一次见到一个类时把它的成员全部交换到前缀
+    State &of(IComponentManager &cm)
+    {
+      for (State &state : states)
+        if (state.cm == &cm)
+          return state;
+      states.push_back(State{&cm, 0, {ComponentTraits<Param<Ts>>::buffer(&cm)...}});
+      State &state = states.back();
+      std::apply([&](auto *...cb)
+                 { (ComponentTraits<Param<Ts>>::prepare(cb), ...); },
+                 state.cbs);
+      pack(state);
+      return state;
+    }
+
+    void pack(State &state)
+    {
+      IComponentManager &cm = *state.cm;
+      uint32_t n = cm.registy != nullptr ? cm.registy->size() : 0;
+      for (uint32_t row = 0; row < n; ++row)
+        if (contains(state, row))
+        {
+          if (row != state.size)
+            cm.swapRows(row, state.size);
+          state.size++;
+        }
+    }
+
+    template <typename F>
+    void forEachClass(F &&f)
+    {
+      IComponentManager &root = ComponentManager<B>::inst();
+      if (root.registy == nullptr)
+      {
+        f(of(root));
+        return;
+      }
+      stack.assign(1, root.registy);
+      while (!stack.empty())
+      {
+        IComponentBuffer *reg = stack.back();
+        stack.pop_back();
+        for (IComponentBuffer *child = reg->children; child != nullptr; child = child->next)
+          stack.push_back(child);
+        f(of(*reg->manager));
+      }
+    }
+
+    std::deque<State> states;
+    std::vector<IComponentBuffer *> stack;
+  };
+
+  enum class IndexKind
+  {
+    Hash,   // 等值查找 O(1)
+    Sorted, // 等值和范围查找 O(log n)
+  };
+
+  /**
+   * @brief 组件字段上的二级索引，例如 Index<Node, &Image::width>，可以按字段的值找到实体
+   *
+   * 通过 ComponentRef 等会标记修改的方式写入组件时，被修改的行记录在 RowWatch 中，
+   * 创建、释放实体时通过 IComponentManager::rowChanged 得到通知；每次查找之前只重新计算这些行。
+   * 直接修改 View 之外拿到的裸指针不会被记录，这时需要调用 rebuild()。
+   */
+  template <typename B, auto Field, IndexKind Kind = IndexKind::Hash>
+  class Index : public IGroup
+  {
+  public:
+    using C = typename MemberPointerTraits<decltype(Field)>::component;
+    using K = typename MemberPointerTraits<decltype(Field)>::key;
+
+    Index()
+    {
+      ComponentManager<B>::inst().groups.push_back(this);
+      rebuild();
+    }
+
+    ~Index() override
+    {
+      auto &groups = ComponentManager<B>::inst().groups;
+      groups.erase(std::remove(groups.begin(), groups.end(), static_cast<IGroup *>(this)), groups.end());
+      for (Watched &w : classes)
+      {
+        auto &watches = w.cb->watches;
+        watches.erase(std::remove(watches.begin(), watches.end(), &w.watch), watches.end());
+      }
+    }
+
+    Index(const Index &) = delete;
+    Index &operator=(const Index &) = delete;
+
+    /// 对字段等于 key 的每个实体调用 f(Entity *)
+    template <typename F>
+    void find(const K &key, F &&f)
+    {
+      sync();
+      if constexpr (Kind == IndexKind::Hash)
+      {
+        auto it = buckets.find(key);
+        if (it != buckets.end())
+          for (Entity *e : it->second)
+            f(e);
+      }
+      else
+      {
+        auto [first, last] = sorted.equal_range(key);
+        for (; first != last; ++first)
+          f(first->second);
+      }
+    }
+
+    /// 字段等于 key 的任意一个实体，没有时返回 nullptr
+    Entity *first(const K &key)
+    {
+      Entity *found = nullptr;
+      find(key, [&](Entity *e)
+           { if (found == nullptr) found = e; });
+      return found;
+    }
+
+    uint32_t count(const K &key)
+    {
+      sync();
+      if constexpr (Kind == IndexKind::Hash)
+      {
+        auto it = buckets.find(key);
+        return it != buckets.end() ? static_cast<uint32_t>(it->second.size()) : 0;
+      }
+      else
+        return static_cast<uint32_t>(sorted.count(key));
+    }
+
+    /// 按字段升序对 lo <= 字段 <= hi 的每个实体调用 f(Entity *)，只有 Sorted 索引支持
+    template <typename F>
+    void range(const K &lo, const K &hi, F &&f)
+    {
+      static_assert(Kind == IndexKind::Sorted, "range queries need IndexKind::Sorted");
+      sync();
+      for (auto it = sorted.lower_bound(lo); it != sorted.end() && !(hi < it->first); ++it)
+        f(it->second);
+    }
+
+    /// 索引中的实体数量
+    uint32_t size()
+    {
+      sync();
+      return static_cast<uint32_t>(where.size());
+    }
+
+    /**
+     * @brief 丢弃增量状态，重新读取所有的行
+     */
+    void rebuild()
+    {
+      buckets.clear();
+      sorted.clear();
+      where.clear();
+      bulk.clear();
+      stack.assign(1, ComponentManager<B>::inst().template getOrCreateComponentBuffer<C>());
+      while (!stack.empty())
+      {
+        IComponentBuffer *cb = stack.back();
+        stack.pop_back();
+        for (IComponentBuffer *child = cb->children; child != nullptr; child = child->next)
+          stack.push_back(child);
+        Watched &w = watch(*cb->manager);
+        w.watch.drain([](uint32_t) {});
+        if (w.rcb == nullptr)
+          continue;
+        uint32_t rows = w.cm->registy->size();
+        w.cb->ensure_space(rows);
+        for (uint32_t row = 0; row < rows; ++row)
+        {
+          Entity *e = w.rcb->getEntity(w.cm->idOf(row));
+          if (!(e->flags & kEntityReleased))
+            bulk.emplace_back(w.cb->get(row).*Field, e);
+        }
+      }
+
+      // 批量建立时先排序，有序索引可以每次都在末尾插入
+      if constexpr (Kind == IndexKind::Sorted)
+      {
+        std::stable_sort(bulk.begin(), bulk.end(), [](const auto &a, const auto &b)
+                         { return a.first < b.first; });
+        for (auto &[key, e] : bulk)
+          where.emplace(e, sorted.emplace_hint(sorted.end(), key, e));
+      }
+      else
+      {
+        where.reserve(bulk.size());
+        for (auto &[key, e] : bulk)
+          insert(e, key);
+      }
+      bulk.clear();
+    }
+
+    void refresh(IComponentManager &cm, uint32_t row) override
+    {
+      watch(cm).watch.mark(row);
+    }
+
+  private:
+    using Where = std::conditional_t<Kind == IndexKind::Hash,
+                                     std::pair<K, uint32_t>,
+                                     typename std::multimap<K, Entity *>::iterator>;
+
+    struct Watched
+    {
+      IComponentManager *cm;
+      ComponentBuffer<C> *cb;
+      IRegistryComponentBuffer *rcb;
+      RowWatch watch;
+    };
+
+    // 第一次见到一个类时开始监视它的组件缓冲，已有的行全部标记为需要重新计算
+    Watched &watch(IComponentManager &cm)
+    {
+      for (Watched &w : classes)
+        if (w.cm == &cm)
+        {
+          if (w.rcb == nullptr)
+            w.rcb = dynamic_cast<IRegistryComponentBuffer *>(cm.registy);
+          return w;
+        }
+      auto *cb = cm.template getOrCreateComponentBuffer<C>();
+      classes.push_back(Watched{&cm, cb, dynamic_cast<IRegistryComponentBuffer *>(cm.registy), RowWatch()});
+      Watched &w = classes.back();
+      cb->watches.push_back(&w.watch);
+      uint32_t rows = cm.registy != nullptr ? cm.registy->size() : 0;
+      for (uint32_t row = 0; row < rows; ++row)
+        w.watch.mark(row);
+      return w;
+    }
+
+    void sync()
+    {
+      for (Watched &w : classes)
+      {
+        if (w.watch.empty() || w.rcb == nullptr)
+          continue;
+        uint32_t rows = w.cm->registy->size();
+        w.watch.drain([&](uint32_t row)
+                      {
+          if (row >= rows)
+            return;
+          Entity *e = w.rcb->getEntity(w.cm->idOf(row));
+          if (e->flags & kEntityReleased)
+            erase(e);
+          else
+            update(e, w.cb->get(row).*Field); });
+      }
+    }
+
+    void update(Entity *e, const K &key)
+    {
+      auto it = where.find(e);
+      if (it != where.end())
+      {
+        if constexpr (Kind == IndexKind::Hash)
+        {
+          if (it->second.first == key)
+            return;
+        }
+        else
+        {
+          if (it->second->first == key)
+            return;
+        }
+        erase(e);
+      }
+      insert(e, key);
+    }
+
+    void insert(Entity *e, const K &key)
+    {
+      if constexpr (Kind == IndexKind::Hash)
+      {
+        auto &bucket = buckets[key];
+        where.emplace(e, Where(key, static_cast<uint32_t>(bucket.size())));
+        bucket.push_back(e);
+      }
+      else
+        where.emplace(e, sorted.emplace(key, e));
+    }
+
+    void erase(Entity *e)
+    {
+      auto it = where.find(e);
+      if (it == where.end())
+        return;
+      if constexpr (Kind == IndexKind::Hash)
+      {
+        // 用桶中最后一个实体填补空位
+        auto bucket = buckets.find(it->second.first);
+        uint32_t pos = it->second.second;
+        Entity *moved = bucket->second.back();
+        bucket->second[pos] = moved;
+        bucket->second.pop_back();
+        if (moved != e)
+          where[moved].second = pos;
+        if (bucket->second.empty())
+          buckets.erase(bucket);
+      }
+      else
+        sorted.erase(it->second);
+      where.erase(it);
+    }
+
+    std::deque<Watched> classes;
+    std::unordered_map<K, std::vector<Entity *>> buckets;
+    std::multimap<K, Entity *> sorted;
+    std::unordered_map<Entity *, Where> where;
+    std::vector<std::pair<K, Entity *>> bulk;
+    std::vector<IComponentBuffer *> stack;
+  };
+
+  // ------------------------------------------------------------------------
+
+  constexpr uint32_t kNoNode = 0xffffffffu;
+
+  /**
+   * @brief 场景树中一个节点的链接，全部是 SceneTree 中的槽位编号，没有指针也没有堆上的链表节点
+   */
+  struct Hierarchy
+  {
+    uint32_t parent = kNoNode;
+    uint32_t first_child = kNoNode, last_child = kNoNode;
+    uint32_t prev_sibling = kNoNode, next_sibling = kNoNode;
+    uint32_t depth = 0;
+  };
+
+  /// 每个实体在 SceneTree 中的槽位，作为普通组件保存在实体所属类的缓冲中
+  struct HierarchySlot
+  {
+    uint32_t slot = kNoNode;
+  };
+
+  template <>
+  struct Transient<HierarchySlot> : std::true_type
+  {
+  };
+
+  /**
+   * @brief B 及其子类的实体组成的场景树（森林），节点链接按槽位平铺存放
+   *
+   * 兄弟节点组成双向链表并记录尾节点，reparent / detach 只修改几个链接并更新子树的深度，
+   * 代价是 O(子树大小)，创建 N 个根节点或者给同一个父节点添加 N 个子节点是 O(N)。
+   * dfs() 在树结构变化之后按需重建一次深度优先顺序，之后任意子树都是其中连续的一段，
+   * 父节点总是排在子节点前面，可以直接按顺序向下传播。
+   * 实体被释放时自动从树中移除，它的子节点挂到它的父节点下面。
+   * 树结构不在快照中，读入快照之后整棵树被清空。
+   */
+  template <typename B>
+  class SceneTree
+  {
+  public:
+    static SceneTree &inst()
+    {
+      static SceneTree tree;
+      return tree;
+    }
+
+    std::vector<Hierarchy> links;
+    std::vector<B *> nodes;
+
+    /**
+     * @brief 把 e 挂到 parent 的最后一个子节点之后，parent 为空时成为根节点
+     *
+     * 如果 parent 是 e 自己或者 e 的后代，不做任何修改并返回 false
+     */
+    bool reparent(B *e, B *parent)
+    {
+      uint32_t s = slotOf(e, true);
+      uint32_t p = parent != nullptr ? slotOf(parent, true) : kNoNode;
+      for (uint32_t a = p; a != kNoNode; a = links[a].parent)
+        if (a == s)
+          return false;
+      if (links[s].parent == p)
+        return true;
+
+      unlink(s);
+      append(s, p);
+      uint32_t depth = p != kNoNode ? links[p].depth + 1 : 0;
+      if (links[s].depth != depth)
+      {
+        int32_t delta = int32_t(depth) - int32_t(links[s].depth);
+        forSubtree(s, [&](uint32_t n)
+                   { links[n].depth += delta; });
+      }
+      changed();
+      return true;
+    }
+
+    void detach(B *e) { reparent(e, nullptr); }
+
+    /// 树结构每次变化时加一，用来判断缓存的遍历顺序是否还有效
+    uint64_t revision() const { return revision_; }
+
+    /**
+     * @brief 把 e 从树中移除，它的子节点挂到它的父节点下面
+     */
+    void remove(B *e)
+    {
+      uint32_t s = slotOf(e, false);
+      if (s != kNoNode)
+      {
+        removeSlot(s);
+        slotRef(e).slot = kNoNode;
+      }
+    }
+
+    B *parent(const B *e)
+    {
+      uint32_t s = slotOf(e, false);
+      return s != kNoNode && links[s].parent != kNoNode ? nodes[links[s].parent] : nullptr;
+    }
+
+    uint32_t depth(const B *e)
+    {
+      uint32_t s = slotOf(e, false);
+      return s != kNoNode ? links[s].depth : 0;
+    }
+
+    /**
+     * @brief 所有节点的槽位，按深度优先顺序排列
+     */
+    Span<const uint32_t> dfs()
+    {
+      flatten();
+      return Span<const uint32_t>(order.data(), order.size());
+    }
+
+    /**
+     * @brief 以 e 为根的子树在 dfs() 中对应的一段，第一个是 e 自己
+     */
+    Span<const uint32_t> subtree(const B *e)
+    {
+      uint32_t s = slotOf(e, false);
+      if (s == kNoNode)
+        return Span<const uint32_t>();
+      flatten();
+      uint32_t begin = position[s];
+      return Span<const uint32_t>(order.data() + begin, end[begin] - begin);
+    }
+
+    uint32_t slotOf(const B *e, bool create = false)
+    {
+      HierarchySlot &ref = slotRef(e);
+      if (ref.slot == kNoNode && create)
+      {
+        if (!free_slots.empty())
+        {
+          ref.slot = free_slots.back();
+          free_slots.pop_back();
+          links[ref.slot] = Hierarchy();
+          nodes[ref.slot] = const_cast<B *>(e);
+        }
+        else
+        {
+          ref.slot = static_cast<uint32_t>(links.size());
+          links.emplace_back();
+          nodes.push_back(const_cast<B *>(e));
+        }
+        append(ref.slot, kNoNode);
+        changed();
+      }
+      return ref.slot;
+    }
+
+  private:
+    SceneTree()
+    {
+      ComponentManager<B>::inst().template onDestroy<HierarchySlot>(
+          [this](ComponentBuffer<HierarchySlot> &cb, uint32_t first, uint32_t count)
+          {
+            for (uint32_t row = first; row < first + count; ++row)
+              if (cb.get(row).slot != kNoNode)
+              {
+                removeSlot(cb.get(row).slot);
+                cb.get(row).slot = kNoNode;
+              }
+          });
+      // 读入快照之后所有 HierarchySlot 都已经恢复为 kNoNode
+      SnapshotLoadHooks().push_back([this]()
+                                    {
+        links.clear();
+        nodes.clear();
+        free_slots.clear();
+        first_root = last_root = kNoNode;
+        changed(); });
+    }
+
+    static HierarchySlot &slotRef(const B *e)
+    {
+      IComponentManager &cm = e->getComponentManager();
+      return cm.template getOrCreateComponentBuffer<HierarchySlot>()->get(cm.rowOf(e->id));
+    }
+
+    // 每个活着的槽位都在某个兄弟链表中，parent 为 kNoNode 的就在根节点链表中
+    uint32_t &head(uint32_t p) { return p != kNoNode ? links[p].first_child : first_root; }
+    uint32_t &tail(uint32_t p) { return p != kNoNode ? links[p].last_child : last_root; }
+
+    void unlink(uint32_t s)
+    {
+      Hierarchy &h = links[s];
+      (h.prev_sibling != kNoNode ? links[h.prev_sibling].next_sibling : head(h.parent)) = h.next_sibling;
+      (h.next_sibling != kNoNode ? links[h.next_sibling].prev_sibling : tail(h.parent)) = h.prev_sibling;
+      h.prev_sibling = h.next_sibling = kNoNode;
+      h.parent = kNoNode;
+    }
+
+    void append(uint32_t s, uint32_t p)
+    {
+      uint32_t &last = tail(p);
+      links[s].prev_sibling = last;
+      (last != kNoNode ? links[last].next_sibling : head(p)) = s;
+      last = s;
+      links[s].parent = p;
+    }
+
+    void removeSlot(uint32_t s)
+    {
+      uint32_t p = links[s].parent;
+      unlink(s);
+      for (uint32_t c = links[s].first_child; c != kNoNode;)
+      {
+        uint32_t next = links[c].next_sibling;
+        links[c].prev_sibling = links[c].next_sibling = kNoNode;
+        append(c, p);
+        forSubtree(c, [&](uint32_t n)
+                   { links[n].depth--; });
+        c = next;
+      }
+      links[s] = Hierarchy();
+      nodes[s] = nullptr;
+      free_slots.push_back(s);
+      changed();
+    }
+
+    // 先序遍历以 s 为根的子树，沿 parent 回溯，不需要栈
+    template <typename F>
+    void forSubtree(uint32_t s, F &&f)
+    {
+      uint32_t n = s;
+      while (true)
+      {
+        f(n);
+        if (links[n].first_child != kNoNode)
+        {
+          n = links[n].first_child;
+          continue;
+        }
+        while (n != s && links[n].next_sibling == kNoNode)
+          n = links[n].parent;
+        if (n == s)
+          return;
+        n = links[n].next_sibling;
+      }
+    }
+
+    void flatten()
+    {
+      if (!dirty)
+        return;
+      dirty = false;
+      order.clear();
+      end.resize(links.size() - free_slots.size());
+      position.resize(links.size());
+      uint32_t n = first_root;
+      while (n != kNoNode)
+      {
+        position[n] = static_cast<uint32_t>(order.size());
+        order.push_back(n);
+        if (links[n].first_child != kNoNode)
+        {
+          n = links[n].first_child;
+          continue;
+        }
+        // 叶子节点：关闭它和已经遍历完的祖先，再转到下一个兄弟
+        while (n != kNoNode)
+        {
+          end[position[n]] = static_cast<uint32_t>(order.size());
+          if (links[n].next_sibling != kNoNode)
+          {
+            n = links[n].next_sibling;
+            break;
+          }
+          n = links[n].parent;
+        }
+      }
+    }
+
+    void changed()
+    {
+      dirty = true;
+      ++revision_;
+    }
+
+    uint32_t first_root = kNoNode, last_root = kNoNode;
+    std::vector<uint32_t> free_slots;
+    std::vector<uint32_t> order, end, position;
+    bool dirty = false;
+    uint64_t revision_ = 0;
+  };
+
+  // ------------------------------------------------------------------------
+
+  /// 实体在关系 R 中的槽位，作为普通组件保存在实体所属类的缓冲中
+  template <typename R>
+  struct RelationSlot
+  {
+    uint32_t slot = kNoNode;
+  };
+
+  template <typename R>
+  struct Transient<RelationSlot<R>> : std::true_type
+  {
+  };
+
+  /**
+   * @brief 实体之间的多对多关系 R，例如 struct Targets {}; ecs::relate<Targets>(a, b)
+   *
+   * 每个参与关系的实体分配一个槽位，正向（a 指向谁）和反向（谁指向 b）各有一个紧凑的邻接数组，
+   * 每条边在两个数组中互相记录对方的下标，所以删除时用末尾元素填补空位，添加和删除都是 O(1)。
+   * 任意一端的实体被释放时，它参与的所有边都会被自动删除。关系不在快照中，读入快照之后被清空。
+   */
+  template <typename R>
+  class Relation
+  {
+  public:
+    static Relation &inst()
+    {
+      static Relation relation;
+      return relation;
+    }
+
+    /// 添加 a -> b，已经存在时返回 false
+    bool add(Entity *a, Entity *b)
+    {
+      uint32_t sa = slotOf(a, true), sb = slotOf(b, true);
+      auto [it, inserted] = index.try_emplace(key(sa, sb), static_cast<uint32_t>(out[sa].size()));
+      if (!inserted)
+        return false;
+      out[sa].push_back(Link{sb, static_cast<uint32_t>(in[sb].size())});
+      in[sb].push_back(Link{sa, it->second});
+      return true;
+    }
+
+    /// 删除 a -> b，不存在时返回 false
+    bool remove(Entity *a, Entity *b)
+    {
+      uint32_t sa = slotOf(a, false), sb = slotOf(b, false);
+      if (sa == kNoNode || sb == kNoNode)
+        return false;
+      auto it = index.find(key(sa, sb));
+      if (it == index.end())
+        return false;
+      erase(sa, it->second);
+      return true;
+    }
+
+    bool has(Entity *a, Entity *b)
+    {
+      uint32_t sa = slotOf(a, false), sb = slotOf(b, false);
+      return sa != kNoNode && sb != kNoNode && index.count(key(sa, sb)) != 0;
+    }
+
+    /// 对 a 指向的每个实体调用 f(Entity *)
+    template <typename F>
+    void targets(Entity *a, F &&f)
+    {
+      uint32_t s = slotOf(a, false);
+      if (s != kNoNode)
+        for (const Link &link : out[s])
+          f(nodes[link.slot]);
+    }
+
+    /// 对指向 b 的每个实体调用 f(Entity *)
+    template <typename F>
+    void sources(Entity *b, F &&f)
+    {
+      uint32_t s = slotOf(b, false);
+      if (s != kNoNode)
+        for (const Link &link : in[s])
+          f(nodes[link.slot]);
+    }
+
+    uint32_t targetCount(Entity *a)
+    {
+      uint32_t s = slotOf(a, false);
+      return s != kNoNode ? static_cast<uint32_t>(out[s].size()) : 0;
+    }
+
+    uint32_t sourceCount(Entity *b)
+    {
+      uint32_t s = slotOf(b, false);
+      return s != kNoNode ? static_cast<uint32_t>(in[s].size()) : 0;
+    }
+
+    /// 删除 e 参与的所有边
+    void clear(Entity *e)
+    {
+      uint32_t s = slotOf(e, false);
+      if (s != kNoNode)
+        clearSlot(s);
+    }
+
+  private:
+    // slot 是另一端的槽位，back 是这条边在另一端数组中的下标
+    struct Link
+    {
+      uint32_t slot, back;
+    };
+
+    static uint64_t key(uint32_t a, uint32_t b) { return (uint64_t(a) << 32) | b; }
+
+    uint32_t slotOf(Entity *e, bool create)
+    {
+      IComponentManager &cm = e->getComponentManager();
+      auto *cb = cm.template getComponentBuffer<RelationSlot<R>>();
+      if (cb == nullptr)
+      {
+        if (!create)
+          return kNoNode;
+        cb = cm.template getOrCreateComponentBuffer<RelationSlot<R>>();
+        cm.template onDestroy<RelationSlot<R>>([this](ComponentBuffer<RelationSlot<R>> &buffer, uint32_t first, uint32_t count)
+                                               { released(buffer, first, count); });
+      }
+      uint32_t row = cm.rowOf(e->id);
+      cb->ensure_space(row + 1);
+      uint32_t &slot = cb->get(row).slot;
+      if (slot == kNoNode && create)
+      {
+        if (!free_slots.empty())
+        {
+          slot = free_slots.back();
+          free_slots.pop_back();
+          nodes[slot] = e;
+        }
+        else
+        {
+          slot = static_cast<uint32_t>(nodes.size());
+          nodes.push_back(e);
+          out.emplace_back();
+          in.emplace_back();
+        }
+      }
+      return slot;
+    }
+
+    // 读入快照之后所有 RelationSlot 都已经恢复为 kNoNode
+    Relation()
+    {
+      SnapshotLoadHooks().push_back([this]()
+                                    {
+        nodes.clear();
+        out.clear();
+        in.clear();
+        index.clear();
+        free_slots.clear(); });
+    }
+
+    // 删除 out[sa][i]，两个数组都用末尾元素填补空位，并修正被移动的边在对端记录的下标
+    void erase(uint32_t sa, uint32_t i)
+    {
+      Link link = out[sa][i];
+      uint32_t sb = link.slot, j = link.back;
+      index.erase(key(sa, sb));
+
+      Link moved = out[sa].back();
+      out[sa][i] = moved;
+      out[sa].pop_back();
+      if (i < out[sa].size())
+      {
+        in[moved.slot][moved.back].back = i;
+        index[key(sa, moved.slot)] = i;
+      }
+
+      moved = in[sb].back();
+      in[sb][j] = moved;
+      in[sb].pop_back();
+      if (j < in[sb].size())
+        out[moved.slot][moved.back].back = j;
+    }
+
+    void clearSlot(uint32_t s)
+    {
+      while (!out[s].empty())
+        erase(s, static_cast<uint32_t>(out[s].size() - 1));
+      while (!in[s].empty())
+      {
+        const Link &link = in[s].back();
+        erase(link.slot, link.back);
+      }
+    }
+
+    void released(ComponentBuffer<RelationSlot<R>> &buffer, uint32_t first, uint32_t count)
+    {
+      for (uint32_t row = first; row < first + count; ++row)
+      {
+        uint32_t &slot = buffer.get(row).slot;
+        if (slot == kNoNode)
+          continue;
+        clearSlot(slot);
+        nodes[slot] = nullptr;
+        free_slots.push_back(slot);
+        slot = kNoNode;
+      }
+    }
+
+    std::vector<Entity *> nodes;
+    std::vector<std::vector<Link>> out, in;
+    std::unordered_map<uint64_t, uint32_t> index;
+    std::vector<uint32_t> free_slots;
+  };
+
+  /**
+   * @brief 添加关系 a -R-> b
+   */
+  template <typename R>
+  bool relate(Entity *a, Entity *b)
+  {
+    return Relation<R>::inst().add(a, b);
+  }
+
+  template <typename R>
+  bool unrelate(Entity *a, Entity *b)
+  {
+    return Relation<R>::inst().remove(a, b);
+  }
+
+  // ------------------------------------------------------------------------
+
+  /// 实体的外部 64 位 GUID，0 表示没有分配
+  struct Guid
+  {
+    uint64_t value = 0;
+  };
+
+  template <>
+  struct Unique<Guid> : std::true_type
+  {
+  };
+
+  /**
+   * @brief 以 64 位 GUID 为键的开放寻址哈希表（Robin Hood 探测，删除时向后移动）
+   *
+   * 所有槽位放在一个连续数组中，查找不会分配内存；负载超过 7/8 时容量翻倍
+   */
+  class GuidMap
+  {
+  public:
+    Entity *find(uint64_t key) const
+    {
+      if (count == 0)
+        return nullptr;
+      for (uint32_t i = home(key), dist = 1;; i = (i + 1) & mask, ++dist)
+      {
+        const Slot &slot = slots[i];
+        if (slot.dist < dist)
+          return nullptr;
+        if (slot.key == key)
+          return slot.value;
+      }
+    }
+
+    /// 插入或者覆盖 key 对应的实体
+    void insert(uint64_t key, Entity *value)
+    {
+      if ((count + 1) * 8 > slots.size() * 7)
+        rehash(slots.empty() ? 16 : static_cast<uint32_t>(slots.size() * 2));
+      Slot item{key, value, 1};
+      for (uint32_t i = home(key);; i = (i + 1) & mask, ++item.dist)
+      {
+        Slot &slot = slots[i];
+        if (slot.dist == 0)
+        {
+          slot = item;
+          ++count;
+          return;
+        }
+        if (slot.key == item.key)
+        {
+          slot.value = item.value;
+          return;
+        }
+        // 比当前元素离家更近的元素让出位置
+        if (slot.dist < item.dist)
+          std::swap(slot, item);
+      }
+    }
+
+    bool erase(uint64_t key)
+    {
+      if (count == 0)
+        return false;
+      uint32_t i = home(key);
+      for (uint32_t dist = 1;; i = (i + 1) & mask, ++dist)
+      {
+        if (slots[i].dist < dist)
+          return false;
+        if (slots[i].key == key)
+          break;
+      }
+      // 后面的元素依次前移一格，直到遇到空位或者已经在家的位置
+      for (uint32_t next = (i + 1) & mask; slots[next].dist > 1; i = next, next = (next + 1) & mask)
+      {
+        slots[i] = slots[next];
+        slots[i].dist--;
+      }
+      slots[i] = Slot();
+      --count;
+      return true;
+    }
+
+    uint32_t size() const { return count; }
+    uint32_t capacity() const { return static_cast<uint32_t>(slots.size()); }
+
+    /// 删除所有元素，保留容量
+    void clear()
+    {
+      std::fill(slots.begin(), slots.end(), Slot());
+      count = 0;
+    }
+
+    /**
+     * @brief 对槽位 [begin, end) 中的每个元素调用 f(guid, Entity *)，用于按槽位分片并行遍历
+     */
+    template <typename F>
+    void forEachSlot(uint32_t begin, uint32_t end, F &&f) const
+    {
+      end = std::min(end, capacity());
+      for (uint32_t i = begin; i < end; ++i)
+        if (slots[i].dist != 0)
+          f(slots[i].key, slots[i].value);
+    }
+
+  private:
+    struct Slot
+    {
+      uint64_t key = 0;
+      Entity *value = nullptr;
+      uint32_t dist = 0; // 离家的距离加一，0 表示空槽位
+    };
+
+    // splitmix64 的混合函数，连续分配的 GUID 也能均匀分布
+    uint32_t home(uint64_t key) const
+    {
+      key ^= key >> 30;
+      key *= 0xbf58476d1ce4e5b9ull;
+      key ^= key >> 27;
+      key *= 0x94d049bb133111ebull;
+      key ^= key >> 31;
+      return static_cast<uint32_t>(key) & mask;
+    }
+
+    void rehash(uint32_t capacity)
+    {
+      std::vector<Slot> old(capacity);
+      old.swap(slots);
+      mask = capacity - 1;
+      count = 0;
+      for (const Slot &slot : old)
+        if (slot.dist != 0)
+          insert(slot.key, slot.value);
+    }
+
+    std::vector<Slot> slots;
+    uint32_t mask = 0;
+    uint32_t count = 0;
+  };
+
+  /**
+   * @brief 所有实体的 GUID 索引，GUID 保存在实体的 Guid 组件中，实体被释放时自动移除
+   *
+   * Guid 组件会写入快照，读入快照之后按组件重建索引
+   */
+  class GuidIndex
+  {
+  public:
+    static GuidIndex &inst()
+    {
+      static GuidIndex index;
+      return index;
+    }
+
+    /**
+     * @brief 给实体分配 GUID，替换它原来的 GUID；GUID 已经属于另一个实体时返回 false
+     */
+    bool assign(Entity *e, uint64_t guid)
+    {
+      Entity *owner = map.find(guid);
+      if (owner != nullptr && owner != e)
+        return false;
+      uint64_t &value = slot(e);
+      if (value != 0)
+        map.erase(value);
+      value = guid;
+      if (guid != 0)
+        map.insert(guid, e);
+      return true;
+    }
+
+    Entity *find(uint64_t guid) const { return guid != 0 ? map.find(guid) : nullptr; }
+
+    /// 实体的 GUID，没有分配时返回 0；只读，不会为实体的类创建 Guid 缓冲
+    uint64_t guidOf(const Entity *e) const
+    {
+      IComponentManager &cm = e->getComponentManager();
+      auto *cb = cm.template getComponentBuffer<Guid>();
+      uint32_t row = cm.rowOf(e->id);
+      return cb != nullptr && row < cb->size() ? cb->get(row).value : 0;
+    }
+
+    uint32_t size() const { return map.size(); }
+
+    /**
+     * @brief 清空索引，按所有类中存活实体的 Guid 组件重新建立
+     */
+    void rebuild()
+    {
+      map.clear();
+      for (IComponentManager *cm : IComponentManager::instances())
+      {
+        auto *cb = cm->template getComponentBuffer<Guid>();
+        auto *rcb = dynamic_cast<IRegistryComponentBuffer *>(cm->registy);
+        if (cb == nullptr || rcb == nullptr)
+          continue;
+        watch(*cm);
+        uint32_t rows = std::min(cb->size(), cm->registy->size());
+        for (uint32_t row = 0; row < rows; ++row)
+        {
+          Entity *e = rcb->getEntity(cm->idOf(row));
+          uint64_t value = cb->get(row).value;
+          if (value != 0 && !(e->flags & kEntityReleased))
+            map.insert(value, e);
+        }
+      }
+    }
+
+    /**
+     * @brief 对 lo <= GUID <= hi 的每个实体调用 f(guid, Entity *)，顺序不确定
+     */
+    template <typename F>
+    void range(uint64_t lo, uint64_t hi, F &&f) const
+    {
+      map.forEachSlot(0, map.capacity(), [&](uint64_t guid, Entity *e)
+                      { if (guid >= lo && guid <= hi) f(guid, e); });
+    }
+
+    /**
+     * @brief 把所有槽位平均分成 shards 份，遍历其中第 shard 份，每份可以交给不同的线程
+     */
+    template <typename F>
+    void shard(uint32_t shard, uint32_t shards, F &&f) const
+    {
+      uint64_t capacity = map.capacity();
+      map.forEachSlot(static_cast<uint32_t>(capacity * shard / shards),
+                      static_cast<uint32_t>(capacity * (shard + 1) / shards), std::forward<F>(f));
+    }
+
+  private:
+    GuidIndex()
+    {
+      rebuild();
+      SnapshotLoadHooks().push_back([this]()
+                                    { rebuild(); });
+    }
+
+    uint64_t &slot(Entity *e)
+    {
+      IComponentManager &cm = e->getComponentManager();
+      auto *cb = cm.template getOrCreateComponentBuffer<Guid>();
+      watch(cm);
+      return cb->get(cm.rowOf(e->id)).value;
+    }
+
+    // 第一次在一个类上使用 GUID 时注册观察者：applyDelta 新建的实体带着 GUID 构造，释放时移除
+    void watch(IComponentManager &cm)
+    {
+      if (std::find(watched.begin(), watched.end(), &cm) != watched.end())
+        return;
+      watched.push_back(&cm);
+      cm.template onConstruct<Guid>([this](ComponentBuffer<Guid> &buffer, uint32_t first, uint32_t count)
+                                    {
+        auto *rcb = dynamic_cast<IRegistryComponentBuffer *>(buffer.manager->registy);
+        for (uint32_t row = first; row < first + count; ++row)
+        {
+          uint64_t value = buffer.get(row).value;
+          if (value != 0 && rcb != nullptr)
+            map.insert(value, rcb->getEntity(buffer.manager->idOf(row)));
+        } });
+      cm.template onDestroy<Guid>([this](ComponentBuffer<Guid> &buffer, uint32_t first, uint32_t count)
+                                  {
+        for (uint32_t row = first; row < first + count; ++row)
+        {
+          uint64_t value = buffer.get(row).value;
+          if (value == 0)
+            continue;
+          map.erase(value);
+          if (buffer.guarded)
+            buffer.beforeWrite(row, 1);
+          buffer.get(row).value = 0;
+        } });
+    }
+
+    GuidMap map;
+    std::vector<IComponentManager *> watched;
+  };
+
+  inline Entity *FindByGuid(uint64_t guid)
+  {
+    return GuidIndex::inst().find(guid);
+  }
+
+  /**
+   * @brief 创建实体并分配 GUID，GUID 已经属于另一个实体时不创建，返回 nullptr
+   */
+  template <typename T>
+  T *CreateEntity(uint64_t guid)
+  {
+    if (FindByGuid(guid) != nullptr)
+      return nullptr;
+    T *e = CreateEntity<T>();
+    GuidIndex::inst().assign(e, guid);
+    return e;
+  }
+
+  // ------------------------------------------------------------------------
+
+  // 快照文件头部的标记和格式版本
+  constexpr uint32_t kSnapshotMagic = 0x53534345; // "ECSS"
+  constexpr uint32_t kSnapshotVersion = 4;
+
+  /**
+   * @brief 快照中的类按类型名排序，与类第一次被使用的顺序无关
+   */
+  inline std::vector<IComponentManager *> SnapshotClasses()
+  {
+    std::vector<IComponentManager *> classes = IComponentManager::instances();
+    std::sort(classes.begin(), classes.end(), [](IComponentManager *a, IComponentManager *b)
+              { return std::strcmp(a->getType().name(), b->getType().name()) < 0; });
+    return classes;
+  }
+
+  /**
+   * @brief 所有类、组件缓冲的类型和存储布局的哈希，写入快照头部，读入时不一致就拒绝
+   */
+  inline uint64_t LayoutHash()
+  {
+    uint64_t h = 14695981039346656037ull;
+    for (IComponentManager *cm : SnapshotClasses())
+    {
+      h = HashString(h, cm->getType().name());
+      uint64_t registry = cm->registy != nullptr ? cm->registy->layout() : 0;
+      h = HashBytes(h, &registry, sizeof(registry));
+      for (IComponentBuffer *cb : cm->sortedComponents())
+      {
+        uint64_t column = cb->layout();
+        h = HashBytes(h, &column, sizeof(column));
+      }
+    }
+    return h;
+  }
+
+  /**
+   * @brief 把所有类的实体和组件写入二进制快照
+   *
+   * 平凡拷贝的组件按内存块直接写出，其他组件通过 Serializer<T> 写出，
+   * 既不能平凡拷贝也没有 Serializer 的组件以及 Transient 组件不保存，读入之后恢复为默认值。
+   * 实体对象自身的成员变量，以及 SceneTree、Relation 等在组件之外维护的结构不在快照中，
+   * 读入之后被清空；GuidIndex、SpatialIndex 按读入的组件重建（见 SnapshotLoadHooks）。
+   */
+  inline bool save(std::ostream &out)
+  {
+    std::vector<IComponentManager *> classes = SnapshotClasses();
+    WritePod(out, kSnapshotMagic);
+    WritePod(out, kSnapshotVersion);
+    WritePod(out, LayoutHash());
+    WritePod(out, static_cast<uint32_t>(classes.size()));
+
+    // 实体数量放在最前面，读入时先释放多出来的实体，再读取任何组件
+    for (IComponentManager *cm : classes)
+      WritePod(out, cm->registy != nullptr ? cm->registy->size() : 0u);
+
+    for (IComponentManager *cm : classes)
+    {
+      if (cm->registy != nullptr)
+        cm->registy->save(out);
+      WriteVector(out, cm->id_of);
+      for (IComponentBuffer *cb : cm->sortedComponents())
+        cb->save(out);
+    }
+    return static_cast<bool>(out);
+  }
+
+  // load 和 loadMapped 共用的读取过程，file 不为空时 in 是在这个映射文件上读取的
+  inline bool LoadSnapshot(std::istream &in, const std::shared_ptr<MappedFile> &file)
+  {
+    std::vector<IComponentManager *> classes = SnapshotClasses();
+    uint32_t magic = 0, version = 0, count = 0;
+    uint64_t hash = 0;
+    if (!ReadPod(in, magic) || !ReadPod(in, version) || !ReadPod(in, hash) || !ReadPod(in, count))
+      return false;
+    if (magic != kSnapshotMagic || version != kSnapshotVersion ||
+        hash != LayoutHash() || count != classes.size())
+      return false;
+
+    std::vector<uint32_t> entities(count);
+    if (!ReadBytes(in, entities.data(), count * sizeof(uint32_t)))
+      return false;
+
+    // onDestroy 观察者可能修改其它类的组件，所以要在读入任何数据之前释放
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      IComponentManager *cm = classes[i];
+      auto *rcb = dynamic_cast<IRegistryComponentBuffer *>(cm->registy);
+      for (uint32_t id = entities[i]; rcb != nullptr && id < cm->registy->size(); ++id)
+        ReleaseEntity(rcb->getEntity(id));
+    }
+
+    for (IComponentManager *cm : classes)
+    {
+      if (cm->registy != nullptr && !cm->registy->load(in, file))
+        return false;
+      if (!ReadVector(in, cm->id_of))
+        return false;
+      // 快照之后创建的实体不在映射中，它们的行号等于编号
+      uint32_t n = cm->registy != nullptr ? cm->registy->size() : 0;
+      for (uint32_t id = static_cast<uint32_t>(cm->id_of.size()); !cm->id_of.empty() && id < n; ++id)
+        cm->id_of.push_back(id);
+      cm->row_of.assign(cm->id_of.size(), 0);
+      for (uint32_t row = 0; row < cm->id_of.size(); ++row)
+        cm->row_of[cm->id_of[row]] = row;
+      for (IComponentBuffer *cb : cm->sortedComponents())
+        if (!cb->load(in, file))
+          return false;
+    }
+
+    for (IComponentManager *cm : classes)
+      cm->reloaded();
+    for (auto &hook : SnapshotLoadHooks())
+      hook();
+    return true;
+  }
+
+  /**
+   * @brief 读入 save 写出的快照，替换所有类的实体和组件
+   *
+   * 读入的程序必须已经使用过同样的类和组件（例如执行过相同的初始化代码），
+   * 布局哈希不一致时不做任何修改，返回 false。快照之后创建的实体会先被释放（派发 onDestroy），
+   * 实体对象不会移动，已有的实体指针保持有效。每个缓冲的大小只调整一次。
+   * 头部之后的数据不完整时同样返回 false，但此时实体已经被释放、部分缓冲已经被替换，
+   * 世界处于不一致的状态，只能再读入一个完整的快照。
+   */
+  inline bool load(std::istream &in)
+  {
+    return LoadSnapshot(in, nullptr);
+  }
+
+  /**
+   * @brief 在一块内存上读取的输入流，seekg 只移动位置，跳过的数据不会被访问
+   */
+  class MemoryStream : public std::istream
+  {
+  public:
+    MemoryStream(char *data, size_t size) : std::istream(nullptr), buffer(data, size) { rdbuf(&buffer); }
+
+  private:
+    struct Buffer : std::streambuf
+    {
+      Buffer(char *data, size_t size) { setg(data, data, data + size); }
+
+      pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override
+      {
+        char *base = dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr();
+        if (off < eback() - base || off > egptr() - base)
+          return pos_type(off_type(-1));
+        setg(eback(), base + off, egptr());
+        return pos_type(gptr() - eback());
+      }
+
+      pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+      {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+      }
+    };
+
+    Buffer buffer;
+  };
+
+  /**
+   * @brief 映射 save 写出的快照文件并读入，平凡拷贝的列中完整的块直接指向映射，不复制数据
+   *
+   * 启动的代价只有 mmap 和修正块指针，页面在第一次访问时才由系统读入。
+   * MapMode::Shared 让多个只读的分析进程共享同一份物理内存，映射的页面是只读的：创建实体、Group 重新排列行、
+   * 通过 View / ComponentRef 写入等会先把涉及的块复制到进程自己的内存中，直接通过 get() / raw() 写入之前要先调用 touch(row)；
+   * MapMode::Private 是写时复制的，适合需要继续模拟的进程。其他部分与 load 相同。
+   */
+  inline bool loadMapped(const std::string &path, MapMode mode)
+  {
+    std::shared_ptr<MappedFile> file = MappedFile::open(path, mode);
+    if (file == nullptr)
+      return false;
+    MemoryStream in(file->data(), file->size());
+    return LoadSnapshot(in, file);
+  }
+
+  // 增量快照头部的标记，格式版本与完整快照相同
+  constexpr uint32_t kDeltaMagic = 0x44534345; // "ECSD"
+
+  /**
+   * @brief 写出从世界版本 since 之后发生的所有修改，大小与修改的数量成正比，与实体总数无关
+   *
+   * 只访问变化日志中 since 之后变化过的块；打开了逐行追踪（trackRows）的缓冲只写出变化过的行。
+   * since 通常是上一次调用 AdvanceWorldVersion() 的返回值，与 Changed<T> 的含义相同。
+   * 包含的内容与 save 相同：实体的状态标志、行号映射和可以保存的组件
+   */
+  inline bool snapshotDelta(uint32_t since, std::ostream &out)
+  {
+    std::vector<IComponentManager *> classes = SnapshotClasses();
+    WritePod(out, kDeltaMagic);
+    WritePod(out, kSnapshotVersion);
+    WritePod(out, LayoutHash());
+    WritePod(out, since);
+    WritePod(out, static_cast<uint32_t>(classes.size()));
+
+    for (IComponentManager *cm : classes)
+    {
+      // 实体的状态标志：释放、复用和新建的实体都会标记注册表中对应的行，
+      // 其中 since 之后被创建（包括复用编号）的实体先单独列出
+      auto *rcb = dynamic_cast<IRegistryComponentBuffer *>(cm->registy);
+      WritePod(out, rcb != nullptr ? cm->registy->size() : 0u);
+      std::vector<uint32_t> born;
+      if (rcb != nullptr)
+        cm->registy->forEachChangedChunk(since, [&](const std::vector<uint32_t> &ids)
+                                         {
+          for (uint32_t id : ids)
+            if ((*cm->registy->row_added)[id] > since)
+              born.push_back(id); });
+      std::sort(born.begin(), born.end());
+      WriteVector(out, born);
+      if (rcb != nullptr)
+        cm->registy->forEachChangedChunk(since, [&](const std::vector<uint32_t> &ids)
+                                         {
+          WriteDeltaRows(out, ids);
+          for (uint32_t id : ids)
+            WritePod(out, rcb->getEntity(id)->flags); });
+      WritePod(out, kDeltaEnd);
+      // 空闲编号的顺序决定之后创建的实体使用哪个编号，整体写出
+      WriteVector(out, rcb != nullptr ? rcb->free_ids : std::vector<uint32_t>());
+
+      // 行号映射：只写出 id_of 中变化过的块
+      WritePod(out, static_cast<uint32_t>(cm->id_of.size()));
+      ForEachChangedChunk(cm->moved_log, cm->moved, nullptr, static_cast<uint32_t>(cm->id_of.size()), since,
+                          [&](const std::vector<uint32_t> &rows)
+                          {
+                            WriteDeltaRows(out, rows);
+                            for (uint32_t row : rows)
+                              WritePod(out, cm->id_of[row]);
+                          });
+      WritePod(out, kDeltaEnd);
+
+      for (IComponentBuffer *cb : cm->sortedComponents())
+        cb->saveDelta(out, since);
+    }
+    return static_cast<bool>(out);
+  }
+
+  /**
+   * @brief 把 snapshotDelta 写出的修改应用到当前世界，之后两边的实体和组件一致
+   *
+   * 当前世界必须处于写出方 since 版本时的状态（例如读入了那时的完整快照，或者应用过之前的增量），
+   * 否则结果没有定义。头部不一致时不做任何修改，返回 false。
+   * 被释放的实体派发 onDestroy，新建的实体在组件读入之后派发 onConstruct，写出方释放之后复用了编号的实体两者都派发；
+   * 修改过的行标记为在当前版本修改，Group 的成员关系随之更新
+   */
+  inline bool applyDelta(std::istream &in)
+  {
+    std::vector<IComponentManager *> classes = SnapshotClasses();
+    uint32_t magic = 0, version = 0, since = 0, count = 0;
+    uint64_t hash = 0;
+    if (!ReadPod(in, magic) || !ReadPod(in, version) || !ReadPod(in, hash) ||
+        !ReadPod(in, since) || !ReadPod(in, count))
+      return false;
+    if (magic != kDeltaMagic || version != kSnapshotVersion ||
+        hash != LayoutHash() || count != classes.size())
+      return false;
+
+    std::vector<uint32_t> rows, values;
+    for (IComponentManager *cm : classes)
+    {
+      auto *rcb = dynamic_cast<IRegistryComponentBuffer *>(cm->registy);
+      uint32_t n = 0;
+      if (!ReadPod(in, n) || (rcb == nullptr && n != 0))
+        return false;
+      uint32_t old_size = rcb != nullptr ? cm->registy->size() : 0;
+      if (rcb != nullptr)
+        cm->registy->ensure_space(n);
+      for (uint32_t id = static_cast<uint32_t>(cm->row_of.size()); !cm->row_of.empty() && id < n; ++id)
+      {
+        cm->row_of.push_back(id);
+        cm->id_of.push_back(id);
+      }
+
+      // 写出方在 since 之后创建的实体：这边还存活的是被释放之后复用了编号，要当作先释放再创建
+      std::vector<uint32_t> born;
+      if (!ReadVector(in, born))
+        return false;
+      // 变成存活状态（包括重新创建）的实体等组件读入之后再派发 onConstruct、通知 Group
+      std::vector<uint32_t> revived;
+      while (ReadDeltaRows(in, rows))
+      {
+        values.resize(rows.size());
+        if (rows.back() >= n || !ReadBytes(in, values.data(), values.size() * sizeof(uint32_t)))
+          return false;
+        for (size_t i = 0; i < rows.size(); ++i)
+        {
+          Entity *entity = rcb->getEntity(rows[i]);
+          bool alive = rows[i] < old_size && !(entity->flags & kEntityReleased);
+          bool released = values[i] & kEntityReleased;
+          bool reborn = std::binary_search(born.begin(), born.end(), rows[i]);
+          if (alive && (released || reborn))
+            ReleaseEntity(entity);
+          if (!released && (!alive || reborn))
+          {
+            cm->registy->resetRow(rows[i]);
+            revived.push_back(rows[i]);
+          }
+          else
+            cm->registy->touch(rows[i]);
+          entity->id = rows[i];
+          entity->flags = values[i];
+        }
+      }
+      std::vector<uint32_t> free_ids;
+      if (!in || !ReadVector(in, free_ids))
+        return false;
+      if (rcb != nullptr)
+        rcb->free_ids = std::move(free_ids);
+
+      uint32_t mapped = 0;
+      if (!ReadPod(in, mapped))
+        return false;
+      bool remapped = false;
+      if (mapped != 0 && cm->id_of.empty())
+        cm->mapRows();
+      while (ReadDeltaRows(in, rows))
+      {
+        values.resize(rows.size());
+        if (rows.back() >= cm->id_of.size() || !ReadBytes(in, values.data(), values.size() * sizeof(uint32_t)))
+          return false;
+        for (size_t i = 0; i < rows.size(); ++i)
+        {
+          cm->id_of[rows[i]] = values[i];
+          cm->row_of[values[i]] = rows[i];
+          cm->rowMoved(rows[i]);
+        }
+        remapped = true;
+      }
+      if (!in)
+        return false;
+
+      // 新建的行先恢复成默认值，组件数据读入期间暂停观察者，onConstruct 看到的是读入之后的值
+      std::vector<IComponentBuffer *> buffers = cm->sortedComponents(), muted;
+      for (IComponentBuffer *cb : buffers)
+        if (cb->observed)
+        {
+          cb->observed = false;
+          muted.push_back(cb);
+        }
+      for (uint32_t id : revived)
+        for (IComponentBuffer *cb : buffers)
+          cb->resetRow(cm->rowOf(id));
+      bool ok = true;
+      for (IComponentBuffer *cb : buffers)
+        ok = ok && cb->applyDelta(in);
+      for (IComponentBuffer *cb : muted)
+        cb->observed = true;
+      if (!ok)
+        return false;
+      for (uint32_t id : revived)
+        for (IComponentBuffer *cb : muted)
+          cb->notifyConstruct(cm->rowOf(id), 1);
+
+      // 行被重新排列过时 Group 整体重建，移动过的块已经由 rowMoved 标记；否则只更新状态变化的实体
+      if (remapped)
+        cm->reloadGroups();
+      else
+        for (uint32_t id : revived)
+          cm->rowChanged(cm->rowOf(id));
+    }
+    return true;
+  }
+
+  /**
+   * @brief 最近若干帧的组件状态，用于收到迟到的输入之后回退并重新模拟
+   *
+   * 只记录标记为 Rollback<T> 的组件；每帧结束时调用 commit()，提交之后每块第一次写入之前保存它的旧内容，
+   * 所以每帧只保存这一帧修改过的块。rollback(k) 回到第 k 帧提交时的状态，代价与之后修改过的块数成正比。
+   * 记录用的块在帧之间循环使用，预热之后 commit 和 rollback 不再分配内存。
+   * 在两次提交之间才创建的组件缓冲，在之前的帧中按默认值恢复。
+   * 实体的创建、释放和 Group 对行的重新排列不在回滚范围内，回滚窗口内不要重新排列这些类的行
+   */
+  class RollbackBuffer
+  {
+  public:
+    explicit RollbackBuffer(uint32_t capacity) : frames(std::max(capacity, 1u))
+    {
+      discover(false);
+    }
+
+    /// 最后一次提交的帧号，构造时是第 0 帧
+    uint32_t frame() const { return current; }
+    /// 还能回到的最早的帧
+    uint32_t oldest() const { return current - count; }
+
+    /**
+     * @brief 提交这一帧，返回它的帧号；窗口已满时丢弃最早一帧的记录
+     */
+    uint32_t commit()
+    {
+      discover(true);
+      if (count == frames.size())
+      {
+        drop(frames[(current - count + 1) % frames.size()]);
+        --count;
+      }
+      std::vector<RollbackChunk> &frame = frames[(current + 1) % frames.size()];
+      for (auto &column : columns)
+        column->capture(frame);
+      ++count;
+      return ++current;
+    }
+
+    /**
+     * @brief 回到第 k 帧提交时的状态，没有提交的修改也会被丢弃；k 不在窗口内时返回 false
+     */
+    bool rollback(uint32_t k)
+    {
+      if (k > current || k < oldest())
+        return false;
+      discover(true);
+      for (auto &column : columns)
+        column->revert();
+      for (; current > k; --current, --count)
+      {
+        std::vector<RollbackChunk> &frame = frames[current % frames.size()];
+        for (const RollbackChunk &chunk : frame)
+          chunk.column->restore(chunk.chunk, chunk.data);
+        drop(frame);
+      }
+      // 恢复时保存下来的块不属于下一帧
+      for (auto &column : columns)
+        column->discard();
+      return true;
+    }
+
+  private:
+    // 之后才使用的类和组件从发现时开始记录，created 表示它们是上一次提交之后才创建的
+    void discover(bool created)
+    {
+      size_t buffers = 0;
+      for (IComponentManager *cm : IComponentManager::instances())
+        buffers += cm->components.size();
+      if (buffers == known)
+        return;
+      known = buffers;
+      for (IComponentManager *cm : IComponentManager::instances())
+        for (auto &[key, cb] : cm->components)
+          if (std::find(tracked.begin(), tracked.end(), cb) == tracked.end())
+          {
+            tracked.push_back(cb);
+            if (std::unique_ptr<RollbackColumn> column = cb->makeRollback())
+            {
+              if (created)
+                column->created();
+              columns.push_back(std::move(column));
+            }
+          }
+    }
+
+    static void drop(std::vector<RollbackChunk> &frame)
+    {
+      for (const RollbackChunk &chunk : frame)
+        chunk.column->recycle(chunk.data);
+      frame.clear();
+    }
+
+    std::vector<std::vector<RollbackChunk>> frames;
+    std::vector<std::unique_ptr<RollbackColumn>> columns;
+    std::vector<IComponentBuffer *> tracked;
+    size_t known = SIZE_MAX;
+    uint32_t current = 0, count = 0;
+  };
+
+  // 实体流头部的标记
+  constexpr uint32_t kStreamMagic = 0x52534345; // "ECSR"
+
+  /// 实体流中组件列表的哈希，写入和读取两边的组件类型、大小必须一致
+  template <typename... Cs>
+  uint64_t StreamLayout()
+  {
+    const char *names[] = {typeid(Cs).name()...};
+    uint32_t sizes[] = {static_cast<uint32_t>(sizeof(Cs))...};
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof...(Cs); ++i)
+    {
+      h = HashString(h, names[i]);
+      h = HashBytes(h, &sizes[i], sizeof(uint32_t));
+    }
+    return h;
+  }
+
+  /**
+   * @brief 把 entities 的组件 Cs... 写成实体流，每批最多 kChunkSize 个实体，StreamLoader 读取它们创建新的实体
+   */
+  template <typename... Cs, typename E>
+  bool saveStream(std::ostream &out, const std::vector<E *> &entities)
+  {
+    static_assert((IsSerializable<Cs>() && ...), "stream components must be trivially copyable or have a Serializer");
+    WritePod(out, kStreamMagic);
+    WritePod(out, kSnapshotVersion);
+    WritePod(out, StreamLayout<Cs...>());
+    for (size_t first = 0; first < entities.size(); first += kChunkSize)
+    {
+      uint32_t count = static_cast<uint32_t>(std::min<size_t>(kChunkSize, entities.size() - first));
+      WritePod(out, count);
+      auto write = [&](auto tag)
+      {
+        using C = typename decltype(tag)::type;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+          IComponentManager &cm = entities[first + i]->getComponentManager();
+          const C &value = ComponentTraits<C>::buffer(&cm)->get(cm.rowOf(entities[first + i]->id));
+          if constexpr (std::is_trivially_copyable_v<C>)
+            WritePod(out, value);
+          else
+            Serializer<C>::save(out, value);
+        }
+      };
+      (write(std::common_type<Cs>()), ...);
+    }
+    WritePod(out, 0u);
+    return static_cast<bool>(out);
+  }
+
+  /**
+   * @brief 在后台线程解码实体，模拟线程每帧在时间预算内把解码好的批次提交为 E 类的新实体
+   *
+   * 每个批次最多 kChunkSize 个实体，每个组件一段连续的暂存数组，与 Column 的一块布局相同，
+   * 提交时按块整段复制。暂存批次循环使用，最多 depth 个；都在等待提交时解码线程阻塞（背压），
+   * stalls() 记录阻塞的次数。解码函数填充一个批次，返回 false 表示没有更多数据
+   */
+  template <typename E, typename... Cs>
+  class StreamLoader
+  {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Batch
+    {
+      uint32_t count = 0;
+      std::tuple<std::unique_ptr<Cs[]>...> columns{std::make_unique<Cs[]>(kChunkSize)...};
+
+      template <typename C>
+      C *column() { return std::get<std::unique_ptr<C[]>>(columns).get(); }
+    };
+    using Decoder = std::function<bool(Batch &)>;
+
+    StreamLoader(Decoder decoder, uint32_t depth = 4)
+        : decoder(std::move(decoder)), depth(std::max(depth, 1u)), worker([this]
+                                                                           { run(); }) {}
+
+    /**
+     * @brief 读取 saveStream 写出的实体流，头部不一致或者数据损坏时 failed() 返回 true
+     */
+    StreamLoader(std::unique_ptr<std::istream> in, uint32_t depth = 4)
+        : StreamLoader(Reader{std::shared_ptr<std::istream>(std::move(in)), &error}, depth) {}
+
+    ~StreamLoader()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      space.notify_all();
+      worker.join();
+    }
+
+    /**
+     * @brief 提交等待中的批次，直到用完 budget；至少提交一个批次，保证每帧都有进展
+     * @return 本次提交的实体数量
+     */
+    uint32_t commit(std::chrono::microseconds budget = std::chrono::microseconds::max())
+    {
+      const bool timed = budget != std::chrono::microseconds::max();
+      const Clock::time_point deadline = timed ? Clock::now() + budget : Clock::time_point();
+      uint32_t spawned = 0;
+      do
+      {
+        Batch *batch = nullptr;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (ready.empty())
+            break;
+          batch = ready.front();
+          ready.pop_front();
+        }
+        IComponentManager *cm = &ComponentManager<E>::inst();
+        CreateEntities<E>(batch->count, [&](uint32_t row)
+                          { (ComponentTraits<Cs>::buffer(cm)->assign(row, batch->count, batch->template column<Cs>()), ...); });
+        spawned += batch->count;
+        committed_count.fetch_add(batch->count, std::memory_order_relaxed);
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          free.push_back(batch);
+        }
+        space.notify_one();
+      } while (!timed || Clock::now() < deadline);
+      return spawned;
+    }
+
+    /// 已经解码 / 已经提交的实体数量
+    uint64_t decoded() const { return decoded_count.load(std::memory_order_relaxed); }
+    uint64_t committed() const { return committed_count.load(std::memory_order_relaxed); }
+    /// 等待提交的批次数量
+    uint32_t queued() const
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return static_cast<uint32_t>(ready.size());
+    }
+    /// 解码线程因为队列已满而等待的次数
+    uint64_t stalls() const { return stall_count.load(std::memory_order_relaxed); }
+    /// 实体流的头部不一致或者数据损坏，之前解码的批次仍然可以提交
+    bool failed() const { return error.load(std::memory_order_acquire); }
+    /// 解码结束并且所有的批次都已经提交
+    bool done() const
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return finished && ready.empty();
+    }
+
+  private:
+    // saveStream 格式的解码函数，第一次调用时检查头部，出错时设置 error 并结束
+    struct Reader
+    {
+      std::shared_ptr<std::istream> in;
+      std::atomic<bool> *error;
+      bool started = false;
+
+      bool operator()(Batch &batch)
+      {
+        if (!started)
+        {
+          started = true;
+          uint32_t magic = 0, version = 0;
+          uint64_t layout = 0;
+          if (!ReadPod(*in, magic) || !ReadPod(*in, version) || !ReadPod(*in, layout) ||
+              magic != kStreamMagic || version != kSnapshotVersion || layout != StreamLayout<Cs...>())
+            return fail(batch);
+        }
+        uint32_t count = 0;
+        if (!ReadPod(*in, count) || count > kChunkSize)
+          return fail(batch);
+        if (count == 0)
+          return false;
+        auto read = [&](auto tag)
+        {
+          using C = typename decltype(tag)::type;
+          C *values = batch.template column<C>();
+          if constexpr (std::is_trivially_copyable_v<C>)
+            ReadBytes(*in, values, count * sizeof(C));
+          else
+            for (uint32_t i = 0; i < count; ++i)
+              Serializer<C>::load(*in, values[i]);
+        };
+        (read(std::common_type<Cs>()), ...);
+        if (!*in)
+          return fail(batch);
+        batch.count = count;
+        return true;
+      }
+
+      bool fail(Batch &batch)
+      {
+        batch.count = 0;
+        error->store(true, std::memory_order_release);
+        return false;
+      }
+    };
+
+    void run()
+    {
+      while (Batch *batch = acquire())
+      {
+        batch->count = 0;
+        bool more = decoder(*batch);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (batch->count > 0)
+        {
+          decoded_count.fetch_add(batch->count, std::memory_order_relaxed);
+          ready.push_back(batch);
+        }
+        else
+          free.push_back(batch);
+        if (!more)
+          break;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      finished = true;
+    }
+
+    // 取一个空闲的暂存批次，没有空闲并且已经有 depth 个批次时等待提交，停止时返回 nullptr
+    Batch *acquire()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (free.empty() && batches.size() >= depth && !stopping)
+      {
+        stall_count.fetch_add(1, std::memory_order_relaxed);
+        space.wait(lock, [&]
+                   { return !free.empty() || stopping; });
+      }
+      if (stopping)
+        return nullptr;
+      if (free.empty())
+      {
+        batches.push_back(std::make_unique<Batch>());
+        return batches.back().get();
+      }
+      Batch *batch = free.back();
+      free.pop_back();
+      return batch;
+    }
+
+    Decoder decoder;
+    uint32_t depth;
+    std::vector<std::unique_ptr<Batch>> batches;
+    std::vector<Batch *> free;
+    std::deque<Batch *> ready;
+    mutable std::mutex mutex;
+    std::condition_variable space;
+    bool stopping = false, finished = false;
+    std::atomic<uint64_t> decoded_count{0}, committed_count{0}, stall_count{0};
+    std::atomic<bool> error{false};
+    std::thread worker;
+  };
+
+  // ------------------------------------------------------------------------
+
+  /**
+   * @brief 返回当前线程的分片编号，每个线程第一次调用时分配，之后保持不变
+   */
+  inline uint32_t ThreadSlot()
+  {
+    static std::atomic<uint32_t> next_slot{0};
+    thread_local uint32_t slot =
+        next_slot.fetch_add(1, std::memory_order_relaxed) % ECS_MAX_THREADS;
+    return slot;
+  }
+
+  /**
+   * @brief 常驻的工作线程池，parallelFor 把一段区间切成小块分给所有线程（包括调用者）执行
+   *
+   * 线程在第一次使用时创建，之后一直等待任务，不会在每次调用时创建线程。
+   * 在工作线程内部再次调用 parallelFor 会直接串行执行，避免死锁。
+   */
+  class WorkerPool
+  {
+  public:
+    static WorkerPool &inst()
+    {
+      static WorkerPool pool;
+      return pool;
+    }
+
+    /// 参与执行的线程数量，包括调用 parallelFor 的线程
+    uint32_t size() const { return static_cast<uint32_t>(workers.size()) + 1; }
+
+    /**
+     * @brief 以 grain 为块大小并行调用 f(begin, end)，所有块执行完之后才返回
+     */
+    template <typename F>
+    void parallelFor(uint32_t count, uint32_t grain, F &&f)
+    {
+      grain = std::max(grain, 1u);
+      if (workers.empty() || count <= grain || inside())
+      {
+        if (count > 0)
+          f(0u, count);
+        return;
+      }
+
+      std::lock_guard<std::mutex> call(call_mutex);
+      std::unique_lock<std::mutex> lock(mutex);
+      job.fn = [](void *ctx, uint32_t begin, uint32_t end)
+      { (*static_cast<std::remove_reference_t<F> *>(ctx))(begin, end); };
+      job.ctx = &f;
+      job.count = count;
+      job.grain = grain;
+      job.next.store(0, std::memory_order_relaxed);
+      busy = static_cast<uint32_t>(workers.size());
+      ++generation;
+      lock.unlock();
+      wake.notify_all();
+
+      inside() = true;
+      work();
+      inside() = false;
+
+      lock.lock();
+      done.wait(lock, [&]
+                { return busy == 0; });
+    }
+
+    ~WorkerPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+      }
+      wake.notify_all();
+      for (auto &worker : workers)
+        worker.join();
+    }
+
+  private:
+    struct Job
+    {
+      void (*fn)(void *, uint32_t, uint32_t) = nullptr;
+      void *ctx = nullptr;
+      uint32_t count = 0, grain = 1;
+      std::atomic<uint32_t> next{0};
+    };
+
+    WorkerPool()
+    {
+      uint32_t hw = std::max(std::thread::hardware_concurrency(), 1u);
+      uint32_t n = std::min<uint32_t>(hw, ECS_MAX_THREADS) - 1;
+      for (uint32_t i = 0; i < n; ++i)
+        workers.emplace_back([this]
+                             { loop(); });
+    }
+
+    static bool &inside()
+    {
+      thread_local bool flag = false;
+      return flag;
+    }
+
+    void work()
+    {
+      while (true)
+      {
+        uint32_t begin = job.next.fetch_add(job.grain, std::memory_order_relaxed);
+        if (begin >= job.count)
+          return;
+        job.fn(job.ctx, begin, std::min(begin + job.grain, job.count));
+      }
+    }
+
+    void loop()
+    {
+      inside() = true;
+      uint64_t seen = 0;
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true)
+      {
+        wake.wait(lock, [&]
+                  { return stop || generation != seen; });
+        if (stop)
+          return;
+        seen = generation;
+        lock.unlock();
+        work();
+        lock.lock();
+        if (--busy == 0)
+          done.notify_one();
+      }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex call_mutex, mutex;
+    std::condition_variable wake, done;
+    Job job;
+    uint64_t generation = 0;
+    uint32_t busy = 0;
+    bool stop = false;
+  };
+
+  /**
+   * @brief 沿 SceneTree<B> 把局部变换 Local 传播成世界变换 World
+   *
+   * 节点按深度分层，同一层的节点（可能属于不同的类）交给 WorkerPool 并行处理，层与层之间同步，
+   * 所以父节点总是先于子节点完成。只有 Local 在 since 之后被修改过的节点，以及父节点被重新计算过的
+   * 节点才会重新计算；树结构变化之后重建分层，但只有新加入或者父节点变化的节点（连同它们的子树）
+   * 需要重新计算，第一次运行会全部重新计算。
+   * combine(const World &parent, const Local &local) 返回世界变换，根节点的 parent 是 World{}。
+   * 结果写入每个实体的 World 组件，并标记为已修改，World 被看作只由这个系统写入的输出。
+   */
+  template <typename B, typename Local, typename World>
+  class TransformSystem
+  {
+  public:
+    // 每个任务块处理的节点数量
+    static constexpr uint32_t kGrain = 4096;
+
+    /**
+     * @brief 传播一次，返回重新计算的节点数量
+     */
+    template <typename F>
+    uint32_t run(F &&combine, uint32_t since)
+    {
+      SceneTree<B> &tree = SceneTree<B>::inst();
+      bool full = !built;
+      if (full || tree.revision() != revision)
+        rebuild(tree);
+
+      for (size_t level = 0; level + 1 < level_offsets.size(); ++level)
+      {
+        uint32_t first = level_offsets[level], last = level_offsets[level + 1];
+        WorkerPool::inst().parallelFor(last - first, kGrain, [&](uint32_t begin, uint32_t end)
+                                       {
+          for (uint32_t i = first + begin; i < first + end; ++i)
+          {
+            Entry &e = entries[i];
+            uint32_t row = e.cm->rowOf(e.id);
+            bool dirty = full || moved[i] || (e.parent != kNoNode && recomputed[e.parent]) ||
+                         e.local->skipUnchanged(e.local->chunk_changed, e.local->row_changed.get(), row, since) == 0;
+            recomputed[i] = dirty;
+            if (!dirty)
+              continue;
+            const World &parent = e.parent != kNoNode ? worlds[e.parent] : root;
+            worlds[i] = combine(parent, e.local->get(row));
+          } });
+      }
+
+      // 结果和版本号的写入留到串行阶段，工作线程之间不共享任何可写的数据
+      uint32_t count = 0;
+      for (uint32_t i = 0; i < entries.size(); ++i)
+        if (recomputed[i])
+        {
+          uint32_t row = entries[i].cm->rowOf(entries[i].id);
+          entries[i].world->touch(row);
+          entries[i].world->get(row) = worlds[i];
+          count++;
+        }
+      return count;
+    }
+
+  private:
+    struct Entry
+    {
+      IComponentManager *cm;
+      ComponentBuffer<Local> *local;
+      ComponentBuffer<World> *world;
+      uint32_t id;
+      uint32_t slot;
+      uint32_t parent; // 父节点在 entries 中的下标
+    };
+
+    // 按深度对深度优先顺序做一次稳定的计数排序，得到每一层的节点
+    // 已经建立过时保留上一次的结果：同一个槽位上还是同一个实体并且父节点没变的，沿用上一次的世界变换，
+    // 其余的标记为 moved，它们的子树在 run() 中随父节点一起重新计算
+    void rebuild(SceneTree<B> &tree)
+    {
+      if (built)
+      {
+        prev_entries.swap(entries);
+        prev_worlds.swap(worlds);
+        prev_index_of.swap(index_of);
+      }
+      Span<const uint32_t> dfs = tree.dfs();
+      level_offsets.assign(1, 0);
+      for (uint32_t slot : dfs)
+      {
+        uint32_t depth = tree.links[slot].depth;
+        if (depth + 2 > level_offsets.size())
+          level_offsets.resize(depth + 2, 0);
+        level_offsets[depth + 1]++;
+      }
+      for (size_t i = 1; i < level_offsets.size(); ++i)
+        level_offsets[i] += level_offsets[i - 1];
+
+      index_of.assign(tree.links.size(), kNoNode);
+      fill.assign(level_offsets.begin(), level_offsets.end());
+      entries.resize(dfs.size());
+      Entry last{};
+      for (uint32_t slot : dfs)
+      {
+        uint32_t i = fill[tree.links[slot].depth]++;
+        index_of[slot] = i;
+        B *node = tree.nodes[slot];
+        IComponentManager &cm = node->getComponentManager();
+        // 相邻的节点大多属于同一个类，只在类变化时查找缓冲
+        if (last.cm != &cm)
+        {
+          last.cm = &cm;
+          last.local = cm.template getOrCreateComponentBuffer<Local>();
+          last.world = cm.template getOrCreateComponentBuffer<World>();
+          uint32_t rows = cm.registy != nullptr ? cm.registy->size() : 0;
+          last.local->ensure_space(rows);
+          last.world->ensure_space(rows);
+        }
+        entries[i] = Entry{&cm, last.local, last.world, node->id, slot, kNoNode};
+      }
+      // 父节点的深度更小，上面已经分配好了下标
+      for (uint32_t slot : dfs)
+      {
+        uint32_t parent = tree.links[slot].parent;
+        if (parent != kNoNode)
+          entries[index_of[slot]].parent = index_of[parent];
+      }
+      worlds.resize(entries.size());
+      recomputed.assign(entries.size(), 0);
+      moved.assign(entries.size(), 0);
+      bool first = !built;
+      revision = tree.revision();
+      built = true;
+      if (first)
+        return;
+      for (uint32_t i = 0; i < entries.size(); ++i)
+      {
+        const Entry &e = entries[i];
+        uint32_t old = e.slot < prev_index_of.size() ? prev_index_of[e.slot] : kNoNode;
+        if (old != kNoNode)
+        {
+          const Entry &p = prev_entries[old];
+          uint32_t parent_slot = e.parent != kNoNode ? entries[e.parent].slot : kNoNode;
+          uint32_t prev_parent_slot = p.parent != kNoNode ? prev_entries[p.parent].slot : kNoNode;
+          if (p.cm == e.cm && p.id == e.id && parent_slot == prev_parent_slot)
+          {
+            worlds[i] = prev_worlds[old];
+            continue;
+          }
+        }
+        moved[i] = 1;
+      }
+    }
 
-    IComponentManager *manager = nullptr;
-    IComponentBuffer *parent = nullptr;
-    IComponentBuffer *children = nullptr, *next = nullptr;
+    std::vector<Entry> entries, prev_entries;
+    std::vector<World> worlds, prev_worlds;
+    std::vector<uint8_t> recomputed, moved;
+    std::vector<uint32_t> level_offsets, fill, index_of, prev_index_of;
+    const World root{};
+    uint64_t revision = 0;
+    bool built = false;
   };
 
-  class IEntityIterator
+  /// 实体在 SpatialIndex<B, P> 中的槽位，作为普通组件保存在实体所属类的缓冲中
+  template <typename B, typename P>
+  struct SpatialSlot
   {
-  public:
-    virtual IEntityIterator &operator++(int) = 0;
-    virtual bool operator==(const IEntityIterator &other) = 0;
-    virtual bool operator!=(const IEntityIterator &other) = 0;
-    virtual Entity *operator->() = 0;
-    virtual Entity &operator*() = 0;
+    uint32_t slot = kNoNode;
   };
-  typedef std::unique_ptr<IEntityIterator> IEntityIteratorPtr;
 
-  /**
-   * @brief IRegistryComponentBuffer 是一个额外的抽象接口类，用来表示 Registry 的额外接口
-   */
-  class IRegistryComponentBuffer
+  template <typename B, typename P>
+  struct Transient<SpatialSlot<B, P>> : std::true_type
   {
-  public:
-    virtual Entity *getEntity(uint32_t id) = 0;
-    virtual IEntityIteratorPtr beginEntity() = 0;
-    virtual IEntityIteratorPtr endEntity() = 0;
   };
 
-  // ------------------------------------------------------------------------
-
-
   /**
-   * @brief IComponentManager 是一个管理所有 Component 的ComponentManager的抽象接口
-   * 
-   * IComponentManager 使用了类型擦除技术，其具体的子类实现了对应类型的 ComponentManager，即：
-   * IComponentManager -> ComponentManager<T>
-   *  而 ComponentManager<T> 是一个单例模板类，用于记录所有 T 类型的 Entity 都有哪些 Component
+   * @brief 基于均匀网格的空间索引，索引 B 及其子类实体的位置组件 P（需要有 x、y 两个成员）
+   *
+   * update(since) 利用变更追踪只重新检查在 since 之后修改过的行，实体离开原来的格子时才移动它；
+   * 实体被释放时自动移出索引。每个格子是一个按下标链接的链表，所有节点放在一个连续数组中，
+   * 查询时只读取这个数组，结果写入调用者提供的 Span，不会分配内存。
+   * rebuild() 用 WorkerPool 并行读取位置、计算格子，然后按格子排序，让同一个格子的节点相邻，
+   * 适合传送或者加载关卡之后使用，读入快照之后会自动调用。
    */
-  class IComponentManager
+  template <typename B, typename P>
+  class SpatialIndex
   {
   public:
-    IComponentManager *parent = nullptr;
+    static SpatialIndex &inst()
+    {
+      static SpatialIndex index;
+      return index;
+    }
 
-    IComponentBuffer *registy = nullptr;
-    std::map<std::type_index, IComponentBuffer *> components;
+    float cellSize() const { return cell_size; }
 
-    virtual const std::type_info &getType() const = 0;
+    void setCellSize(float size)
+    {
+      cell_size = size;
+      inv_cell = 1.0f / size;
+      rebuild();
+    }
 
-    template <typename T>
-    ComponentBuffer<T> *getComponentBuffer()
+    /// 索引中的实体数量
+    uint32_t size() const { return static_cast<uint32_t>(items.size() - free_items.size()); }
+
+    /**
+     * @brief 把 since 之后修改过位置以及新创建的实体同步到索引中，返回检查过的实体数量
+     */
+    uint32_t update(uint32_t since)
     {
-      auto it = components.find(std::type_index(typeid(T)));
-      if (it == components.end())
+      uint32_t checked = 0;
+      forEachClass([&](IComponentManager &cm, ComponentBuffer<P> *cb, ComponentBuffer<Slot> *sb,
+                       IRegistryComponentBuffer *rcb, uint32_t rows)
+                   {
+        for (uint32_t row = 0; row < rows;)
+        {
+          uint32_t skip = cb->skipUnchanged(cb->chunk_changed, cb->row_changed.get(), row, since);
+          if (skip > 0)
+          {
+            row += skip;
+            continue;
+          }
+          Entity *e = rcb->getEntity(cm.idOf(row));
+          if (!(e->flags & kEntityReleased))
+          {
+            const P &pos = cb->get(row);
+            uint32_t &slot = sb->get(row).slot;
+            if (slot == kNoNode)
+              slot = insert(e, pos.x, pos.y);
+            else
+              move(slot, pos.x, pos.y);
+            checked++;
+          }
+          row++;
+        } });
+      return checked;
+    }
+
+    /**
+     * @brief 清空并重新建立整个索引
+     */
+    void rebuild()
+    {
+      items.clear();
+      free_items.clear();
+      cells.clear();
+      bounded = false;
+      pending.clear();
+      forEachClass([&](IComponentManager &cm, ComponentBuffer<P> *cb, ComponentBuffer<Slot> *sb,
+                       IRegistryComponentBuffer *rcb, uint32_t rows)
+                   {
+        for (uint32_t row = 0; row < rows; ++row)
+        {
+          Entity *e = rcb->getEntity(cm.idOf(row));
+          sb->get(row).slot = kNoNode;
+          if (!(e->flags & kEntityReleased))
+            pending.push_back(Pending{e, cb, sb, row});
+        } });
+
+      items.resize(pending.size());
+      WorkerPool::inst().parallelFor(static_cast<uint32_t>(pending.size()), 4096, [&](uint32_t begin, uint32_t end)
+                                     {
+        for (uint32_t i = begin; i < end; ++i)
+        {
+          const P &pos = pending[i].cb->get(pending[i].row);
+          Item &item = items[i];
+          item.entity = pending[i].entity;
+          item.x = pos.x;
+          item.y = pos.y;
+          item.cell = cellOf(pos.x, pos.y);
+          item.owner = i;
+        } });
+      std::sort(items.begin(), items.end(), [](const Item &a, const Item &b)
+                { return a.cell < b.cell; });
+
+      for (uint32_t i = 0; i < items.size(); ++i)
       {
-        return nullptr;
+        Item &item = items[i];
+        pending[item.owner].slots->get(pending[item.owner].row).slot = i;
+        item.owner = kNoNode;
+        item.prev = i > 0 && items[i - 1].cell == item.cell ? i - 1 : kNoNode;
+        item.next = i + 1 < items.size() && items[i + 1].cell == item.cell ? i + 1 : kNoNode;
+        if (item.prev == kNoNode)
+          cells[item.cell] = i;
+        grow(item.cell);
       }
-      return dynamic_cast<ComponentBuffer<T> *>(it->second);
     }
 
-    template <typename T>
-    RegistryComponentBuffer<T> *getRegistryComponentBuffer()
+    /**
+     * @brief 查找位于矩形 [x0, x1] x [y0, y1] 中的实体，返回写入 out 的数量
+     */
+    uint32_t range(float x0, float y0, float x1, float y1, Span<Entity *> out)
     {
-      if (registy == nullptr)
-        return nullptr;
-      return dynamic_cast<RegistryComponentBuffer<T> *>(registy);
+      if (out.empty())
+        return 0;
+      uint32_t n = 0;
+      visitCells(x0, y0, x1, y1, [&](const Item &item)
+                 {
+        if (item.x >= x0 && item.x <= x1 && item.y >= y0 && item.y <= y1)
+          out[n++] = item.entity;
+        return n < out.size(); });
+      return n;
     }
 
-    template <typename T>
-    ComponentBuffer<T> *getOrCreateComponentBuffer()
+    /**
+     * @brief 查找到 (x, y) 的距离不超过 r 的实体，返回写入 out 的数量
+     */
+    uint32_t radius(float x, float y, float r, Span<Entity *> out)
     {
-      auto it = components.find(std::type_index(typeid(T)));
-      if (it == components.end())
-      {
-        auto *cb = new ComponentBuffer<T>(
-            this, parent ? parent->getComponentBuffer<T>() : nullptr);
-        components[std::type_index(typeid(T))] = cb;
-        return cb;
-      }
-      return dynamic_cast<ComponentBuffer<T> *>(it->second);
+      if (out.empty())
+        return 0;
+      uint32_t n = 0;
+      float r2 = r * r;
+      visitCells(x - r, y - r, x + r, y + r, [&](const Item &item)
+                 {
+        float dx = item.x - x, dy = item.y - y;
+        if (dx * dx + dy * dy <= r2)
+          out[n++] = item.entity;
+        return n < out.size(); });
+      return n;
     }
 
-    template <typename T>
-    RegistryComponentBuffer<T> *getOrCreateRegistryComponentBuffer()
+    /**
+     * @brief 查找离 (x, y) 最近的 out.size() 个实体，按距离从近到远写入 out，返回找到的数量
+     *
+     * 从所在的格子开始一圈一圈向外搜索，下一圈不可能更近时停止
+     */
+    uint32_t nearest(float x, float y, Span<Entity *> out)
     {
-      if (registy == nullptr)
+      uint32_t k = static_cast<uint32_t>(out.size());
+      if (k == 0 || !bounded)
+        return 0;
+      best.resize(k);
+      uint32_t n = 0;
+      auto consider = [&](const Item &item)
       {
-        registy = new RegistryComponentBuffer<T>(
-            this, parent ? parent->getRegistryComponentBuffer<typename T::super>()
-                         : nullptr);
+        float dx = item.x - x, dy = item.y - y;
+        float d2 = dx * dx + dy * dy;
+        if (n == k && d2 >= best[k - 1])
+          return;
+        uint32_t i = n < k ? n++ : k - 1;
+        for (; i > 0 && best[i - 1] > d2; --i)
+        {
+          best[i] = best[i - 1];
+          out[i] = out[i - 1];
+        }
+        best[i] = d2;
+        out[i] = item.entity;
+      };
+
+      int32_t cx = coord(x), cy = coord(y);
+      int32_t reach = std::max({cx - min_cx, max_cx - cx, cy - min_cy, max_cy - cy, 0});
+      for (int32_t r = 0; r <= reach; ++r)
+      {
+        for (int32_t dx = -r; dx <= r; ++dx)
+        {
+          visitCell(cx + dx, cy - r, consider);
+          if (r > 0)
+            visitCell(cx + dx, cy + r, consider);
+        }
+        for (int32_t dy = -r + 1; dy < r; ++dy)
+        {
+          visitCell(cx - r, cy + dy, consider);
+          visitCell(cx + r, cy + dy, consider);
+        }
+        float ring = r * cell_size;
+        if (n == k && best[k - 1] <= ring * ring)
+          break;
       }
-      return dynamic_cast<RegistryComponentBuffer<T> *>(registy);
+      return n;
     }
-  };
 
-  /**
-   * 用户编写的每个类在系统中都会自动创建一个 ComponentManager 来管理其下的所有
-   * Component 同时，还会创建一个 Registy 来保存所有创建的类实例
-   */
-  template <typename B>
-  class ComponentManager : public IComponentManager
-  {
-  public:
-    static ComponentManager &inst()
+  private:
+    using Slot = SpatialSlot<B, P>;
+
+    struct Item
     {
-      static ComponentManager instance;
-      return instance;
+      Entity *entity;
+      float x, y;
+      uint64_t cell;
+      uint32_t prev, next;
+      uint32_t owner; // rebuild() 排序时记录来源，平时为 kNoNode
+    };
+
+    struct Pending
+    {
+      Entity *entity;
+      ComponentBuffer<P> *cb;
+      ComponentBuffer<Slot> *slots;
+      uint32_t row;
+    };
+
+    SpatialIndex()
+    {
+      SnapshotLoadHooks().push_back([this]()
+                                    { rebuild(); });
     }
 
-    const std::type_info &getType() const override { return typeid(B); }
+    int32_t coord(float v) const { return static_cast<int32_t>(std::floor(v * inv_cell)); }
 
-    ComponentManager()
+    static uint64_t key(int32_t cx, int32_t cy)
     {
-      if constexpr (!std::is_same_v<typename B::super, Entity>)
+      return (uint64_t(uint32_t(cx)) << 32) | uint32_t(cy);
+    }
+
+    uint64_t cellOf(float x, float y) const { return key(coord(x), coord(y)); }
+
+    void grow(uint64_t cell)
+    {
+      int32_t cx = int32_t(uint32_t(cell >> 32)), cy = int32_t(uint32_t(cell));
+      if (!bounded)
       {
-        parent = &ComponentManager<typename B::super>::inst();
+        min_cx = max_cx = cx;
+        min_cy = max_cy = cy;
+        bounded = true;
+        return;
       }
+      min_cx = std::min(min_cx, cx);
+      max_cx = std::max(max_cx, cx);
+      min_cy = std::min(min_cy, cy);
+      max_cy = std::max(max_cy, cy);
     }
-  };
 
-  /**
-   * 这个 ComponentBuffer
-   * 是所有类数据的容器，是最关键的数据结构，对于一个类的继承树结构，我们会创建一系列
-   * 相互链接的 ComponentBuffer 来保存每个 Component
-   * 的数据，例如，对于下面的类结构，B 是 A 的子类：
-   * +-----------------------------------------------+
-   * | Class A | Component<Data1> | Component<Data2> |
-   * +-----------------------------------------------+
-   * |  0      |  Data 1          |    Data 2        |
-   * |  1      |  Data 1          |    Data 2        |
-   * +-----------------------------------------------+------------------+
-   * | Class B | Component<Data1> | Component<Data2> | Component<Data3> |
-   * +------------------------------------------------------------------+
-   * |  0      |  Data 1          |    Data 2        |    Data 3        |
-   * |  1      |  Data 1          |    Data 2        |    Data 3        |
-   * +-----------------------------------------------+------------------+
-   *
-   * 为了实现这个结构，每个类都有一个 ComponentBuffer ，保存了所有的 Component
-   * 数据
-   */
-  template <typename T>
-  class CommonComponentBuffer : public IComponentBuffer
-  {
-  public:
-    std::deque<T> container;
-    T &get(uint32_t id)
+    void link(uint32_t i)
     {
-      if (id >= container.size())
+      Item &item = items[i];
+      auto [it, inserted] = cells.try_emplace(item.cell, i);
+      item.prev = kNoNode;
+      item.next = inserted ? kNoNode : it->second;
+      if (!inserted)
       {
-        container.resize(id + 1);
+        items[it->second].prev = i;
+        it->second = i;
       }
-      return container.at(id);
+      grow(item.cell);
     }
-    const T &get(uint32_t id) const
+
+    void unlink(uint32_t i)
     {
-      if (id >= container.size())
+      Item &item = items[i];
+      if (item.prev != kNoNode)
+        items[item.prev].next = item.next;
+      else if (item.next != kNoNode)
+        cells[item.cell] = item.next;
+      else
+        cells.erase(item.cell);
+      if (item.next != kNoNode)
+        items[item.next].prev = item.prev;
+    }
+
+    uint32_t insert(Entity *e, float x, float y)
+    {
+      uint32_t i;
+      if (!free_items.empty())
       {
-        container.resize(id + 1);
+        i = free_items.back();
+        free_items.pop_back();
       }
-      return container.at(id);
+      else
+      {
+        i = static_cast<uint32_t>(items.size());
+        items.emplace_back();
+      }
+      items[i] = Item{e, x, y, cellOf(x, y), kNoNode, kNoNode, kNoNode};
+      link(i);
+      return i;
     }
 
-    uint32_t add() override
+    void move(uint32_t i, float x, float y)
     {
-      uint32_t id = container.size();
-      container.push_back(T{});
-      return id;
+      Item &item = items[i];
+      item.x = x;
+      item.y = y;
+      uint64_t cell = cellOf(x, y);
+      if (cell == item.cell)
+        return;
+      unlink(i);
+      item.cell = cell;
+      link(i);
     }
 
-    uint32_t size() const override { return container.size(); }
+    template <typename F>
+    void visitCell(int32_t cx, int32_t cy, F &&f)
+    {
+      auto it = cells.find(key(cx, cy));
+      if (it == cells.end())
+        return;
+      for (uint32_t i = it->second; i != kNoNode; i = items[i].next)
+        f(items[i]);
+    }
 
-    const std::type_info &getType() const override { return typeid(T); }
+    // 遍历与矩形相交的格子，f 返回 false 时停止
+    template <typename F>
+    void visitCells(float x0, float y0, float x1, float y1, F &&f)
+    {
+      if (!bounded)
+        return;
+      int32_t cx0 = std::max(coord(x0), min_cx), cx1 = std::min(coord(x1), max_cx);
+      int32_t cy0 = std::max(coord(y0), min_cy), cy1 = std::min(coord(y1), max_cy);
+      for (int32_t cy = cy0; cy <= cy1; ++cy)
+        for (int32_t cx = cx0; cx <= cx1; ++cx)
+        {
+          auto it = cells.find(key(cx, cy));
+          if (it == cells.end())
+            continue;
+          for (uint32_t i = it->second; i != kNoNode; i = items[i].next)
+            if (!f(items[i]))
+              return;
+        }
+    }
 
-    void ensure_space(uint32_t new_size) override
+    void released(ComponentBuffer<Slot> &buffer, uint32_t first, uint32_t count)
     {
-      if (new_size > container.size())
+      for (uint32_t row = first; row < first + count; ++row)
       {
-        container.resize(new_size);
+        uint32_t &slot = buffer.get(row).slot;
+        if (slot == kNoNode)
+          continue;
+        unlink(slot);
+        items[slot].entity = nullptr;
+        free_items.push_back(slot);
+        slot = kNoNode;
       }
     }
 
-    CommonComponentBuffer(IComponentManager *cm, IComponentBuffer *pcb)
+    // 遍历 B 及其子类，顺便保证每个类的槽位缓冲存在并且注册了释放时的观察者
+    template <typename F>
+    void forEachClass(F &&f)
     {
-      manager = cm;
-
-      if (cm->parent != nullptr)
+      stack.assign(1, ComponentManager<B>::inst().template getOrCreateComponentBuffer<P>());
+      while (!stack.empty())
       {
-        if (pcb == nullptr)
-          return;
-        if (pcb->children == nullptr)
-        {
-          pcb->children = this;
-        }
-        else
+        auto *cb = static_cast<ComponentBuffer<P> *>(stack.back());
+        stack.pop_back();
+        for (IComponentBuffer *child = cb->children; child != nullptr; child = child->next)
+          stack.push_back(child);
+
+        IComponentManager &cm = *cb->manager;
+        auto *rcb = dynamic_cast<IRegistryComponentBuffer *>(cm.registy);
+        if (rcb == nullptr)
+          continue;
+        auto *sb = cm.template getComponentBuffer<Slot>();
+        if (sb == nullptr)
         {
-          IComponentBuffer *old_head = pcb->children;
-          pcb->children = this;
-          this->next = old_head;
+          sb = cm.template getOrCreateComponentBuffer<Slot>();
+          cm.template onDestroy<Slot>([this](ComponentBuffer<Slot> &buffer, uint32_t first, uint32_t count)
+                                      { released(buffer, first, count); });
         }
-        parent = pcb;
+        uint32_t rows = cm.registy->size();
+        cb->ensure_space(rows);
+        sb->ensure_space(rows);
+        f(cm, cb, sb, rcb, rows);
       }
     }
+
+    float cell_size = 16.0f, inv_cell = 1.0f / 16.0f;
+    std::vector<Item> items;
+    std::vector<uint32_t> free_items;
+    std::unordered_map<uint64_t, uint32_t> cells;
+    int32_t min_cx = 0, max_cx = 0, min_cy = 0, max_cy = 0;
+    bool bounded = false;
+    std::vector<float> best;
+    std::vector<Pending> pending;
+    std::vector<IComponentBuffer *> stack;
   };
 
-  template <typename T>
-  class ComponentBuffer : public CommonComponentBuffer<T>
+  /**
+   * @brief LatencyHistogram 是一个无锁的耗时直方图
+   *
+   * 桶按照 2 的幂划分，每个幂再细分为 4 个子桶，相对误差不超过 25%。
+   * 每个线程写入自己的分片，只使用 relaxed 原子加法，记录时不会加锁也不会分配内存；
+   * 查询百分位时再把所有分片合并起来。
+   */
+  class LatencyHistogram
   {
   public:
-    ComponentBuffer(IComponentManager *cm, IComponentBuffer *pcb)
-        : CommonComponentBuffer<T>(cm, pcb) {}
+    static constexpr uint32_t kBuckets = 252;
 
-    BufferIterator<T> begin() { return BufferIterator<T>(this); }
-    BufferIterator<T> end() { return BufferIterator<T>(); }
-  };
+    void record(uint64_t ns)
+    {
+      shards[ThreadSlot()].counts[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+    }
 
-  template <typename T>
-  class EntityIterator : public IEntityIterator
-  {
-  public:
-    EntityIterator(typename std::deque<T>::iterator it) : it(it) {}
-    typename std::deque<T>::iterator it;
-    IEntityIterator &operator++(int) override
+    uint64_t count() const
     {
-      it++;
-      return *this;
+      uint64_t total = 0;
+      for (const Shard &sh : shards)
+        for (const auto &c : sh.counts)
+          total += c.load(std::memory_order_relaxed);
+      return total;
     }
 
-    bool operator==(const IEntityIterator &other) override
+    /**
+     * @brief 返回百分位 q（0 到 1 之间）对应的耗时，单位为纳秒
+     */
+    uint64_t percentile(double q) const
     {
-      return it == dynamic_cast<const EntityIterator<T> &>(other).it;
+      uint64_t merged[kBuckets] = {};
+      uint64_t total = 0;
+      for (const Shard &sh : shards)
+        for (uint32_t b = 0; b < kBuckets; ++b)
+        {
+          uint64_t c = sh.counts[b].load(std::memory_order_relaxed);
+          merged[b] += c;
+          total += c;
+        }
+      if (total == 0)
+        return 0;
+
+      uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+      uint64_t seen = 0;
+      for (uint32_t b = 0; b < kBuckets; ++b)
+      {
+        seen += merged[b];
+        if (seen >= rank)
+          return valueOf(b);
+      }
+      return valueOf(kBuckets - 1);
     }
-    bool operator!=(const IEntityIterator &other) override
+
+    void reset()
     {
-      return !(*this == other);
+      for (Shard &sh : shards)
+        for (auto &c : sh.counts)
+          c.store(0, std::memory_order_relaxed);
+    }
+
+    static uint32_t bucketOf(uint64_t ns)
+    {
+      if (ns < 4)
+        return static_cast<uint32_t>(ns);
+      uint32_t msb = 63 - Clz64(ns);
+      uint32_t sub = static_cast<uint32_t>(ns >> (msb - 2)) & 3;
+      return (msb - 1) * 4 + sub;
     }
 
-    Entity *operator->() override { return &*it; }
-    Entity &operator*() override { return *it; }
+    // 返回桶的中间值
+    static uint64_t valueOf(uint32_t bucket)
+    {
+      if (bucket < 4)
+        return bucket;
+      uint32_t msb = bucket / 4 + 1;
+      uint64_t width = uint64_t(1) << (msb - 2);
+      uint64_t lower = (4 + bucket % 4) * width;
+      return lower + width / 2;
+    }
+
+  private:
+    struct alignas(64) Shard
+    {
+      std::atomic<uint64_t> counts[kBuckets] = {};
+    };
+
+    Shard shards[ECS_MAX_THREADS];
   };
 
-  template <typename T>
-  class RegistryComponentBuffer : public CommonComponentBuffer<T>,
-                                  public IRegistryComponentBuffer
+  /**
+   * @brief Runner 是一个固定步长的帧驱动器
+   *
+   * 每次调用 frame() 时把真实经过的时间累加起来，然后以固定的步长运行 Fixed 阶段的系统，
+   * 每帧最多追赶 max_steps 步，超出的时间会被丢弃以免陷入死循环；之后运行一次 Variable
+   * 阶段的系统，这时可以用 alpha() 在前后两个固定步之间插值。
+   *
+   * 每个系统的耗时都记录在 LatencyHistogram 中，注册系统之后运行时不会再分配内存，
+   * 可以在生产环境中一直开启。
+   */
+  class Runner
   {
   public:
-    RegistryComponentBuffer(IComponentManager *cm, IComponentBuffer *pcb)
-        : CommonComponentBuffer<T>(cm, pcb) {}
+    enum class Stage
+    {
+      Fixed,
+      Variable,
+    };
 
-    Entity *getEntity(uint32_t id) override
+    struct SystemStats
     {
-      if (id >= this->container.size())
-      {
-        this->container.resize(id + 1);
-      }
-      return &this->container.at(id);
-    }
+      const char *name;
+      uint64_t count;
+      uint64_t p50, p95, p99; // 纳秒
+    };
 
-    IEntityIteratorPtr beginEntity() override
+    struct FrameStats
+    {
+      uint64_t frame;
+      uint32_t steps;
+      double dropped;                 // 因为超过追赶上限而丢弃的时间，单位为秒
+      std::chrono::nanoseconds elapsed; // 本帧实际耗时
+    };
+
+    explicit Runner(double fixed_dt = 1.0 / 60.0, uint32_t max_steps = 5)
+        : fixed_dt(fixed_dt), max_steps(max_steps) {}
+
+    /**
+     * @brief 注册一个系统，f 可以接受一个 double 类型的 dt 参数，也可以没有参数
+     * @return 系统的编号，用来查询统计数据
+     */
+    template <typename F>
+    uint32_t addSystem(std::string name, F &&f, Stage stage = Stage::Fixed)
     {
-      return IEntityIteratorPtr(new EntityIterator<T>(this->container.begin()));
+      System sys;
+      sys.name = std::move(name);
+      sys.stage = stage;
+      if constexpr (std::is_invocable_v<F, double>)
+        sys.fn = std::forward<F>(f);
+      else
+        sys.fn = [f = std::forward<F>(f)](double) mutable
+        { f(); };
+      sys.histogram = std::make_unique<LatencyHistogram>();
+      systems.push_back(std::move(sys));
+      return static_cast<uint32_t>(systems.size() - 1);
     }
-    IEntityIteratorPtr endEntity() override
+
+    /**
+     * @brief 设置单帧预算，frame() 的耗时超过预算时调用 callback
+     */
+    void setFrameBudget(std::chrono::nanoseconds budget,
+                        std::function<void(const FrameStats &)> callback)
     {
-      return IEntityIteratorPtr(new EntityIterator<T>(this->container.end()));
+      frame_budget = budget;
+      on_overrun = std::move(callback);
     }
-  };
 
-  // ------------------------------------------------------------------------
+    /**
+     * @brief 推进一帧
+     * @param real_dt 距离上一帧真实经过的时间，单位为秒
+     * @return 本帧运行的固定步数
+     */
+    uint32_t frame(double real_dt)
+    {
+      auto frame_start = std::chrono::steady_clock::now();
 
-  template <typename T>
-  class ComponentRef
-  {
-    const Entity *entity;
+      accumulator += real_dt;
+      uint32_t steps = 0;
+      while (accumulator >= fixed_dt && steps < max_steps)
+      {
+        run(Stage::Fixed, fixed_dt);
+        accumulator -= fixed_dt;
+        ++steps;
+      }
 
-  public:
-    ComponentRef(const Entity *ent) : entity(ent) {}
+      double dropped = 0;
+      if (accumulator >= fixed_dt)
+      {
+        double kept = std::fmod(accumulator, fixed_dt);
+        dropped = accumulator - kept;
+        accumulator = kept;
+      }
+
+      run(Stage::Variable, real_dt);
+      ++frame_count;
+
+      auto elapsed = std::chrono::steady_clock::now() - frame_start;
+      if (on_overrun && frame_budget.count() > 0 && elapsed > frame_budget)
+      {
+        on_overrun(FrameStats{frame_count, steps, dropped,
+                              std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)});
+      }
+      return steps;
+    }
 
-    IComponentManager &CM() const { return entity->getComponentManager(); }
+    /// 当前状态位于两个固定步之间的插值系数，范围是 [0, 1)
+    double alpha() const { return accumulator / fixed_dt; }
 
-    T &operator*() const { return getBuffer(CM())->get(entity->id); }
-    T *operator->() const { return &(getBuffer(CM())->get(entity->id)); }
+    uint64_t frames() const { return frame_count; }
+    uint32_t systemCount() const { return static_cast<uint32_t>(systems.size()); }
 
-    static ComponentBuffer<T> *getBuffer(IComponentManager &cm)
+    SystemStats stats(uint32_t system) const
     {
-      auto *reg = cm.template getOrCreateComponentBuffer<T>();
-      return (reg);
+      const System &sys = systems.at(system);
+      const LatencyHistogram &h = *sys.histogram;
+      return SystemStats{sys.name.c_str(), h.count(), h.percentile(0.50),
+                         h.percentile(0.95), h.percentile(0.99)};
     }
-  };
 
-  template <typename T>
-  class OptionalComponentRef
-  {
-    const Entity *entity;
-  public:
-    OptionalComponentRef(const Entity *ent) : entity(ent) {}
-
-    IComponentManager &CM() const { return entity->getComponentManager(); }
+    LatencyHistogram &histogram(uint32_t system) { return *systems.at(system).histogram; }
 
-    // TODO: Implement this with a ComponentMap
-  };
+    void resetStats()
+    {
+      for (System &sys : systems)
+        sys.histogram->reset();
+    }
 
-  template <typename T>
-  T *CreateEntity()
-  {
-    static RegistryComponentBuffer<T> *registry =
-        ComponentManager<T>::inst()
-            .template getOrCreateRegistryComponentBuffer<T>();
-    uint32_t id = registry->add();
-    T &inst = registry->get(id);
-    inst.id = id;
+  private:
+    struct System
+    {
+      std::string name;
+      Stage stage;
+      std::function<void(double)> fn;
+      std::unique_ptr<LatencyHistogram> histogram;
+    };
 
-    // This piece of code must be done after the entity is created
-    // Otherwise, you may not see the components before first entity is created
-    const IComponentManager *cm = &ComponentManager<T>::inst();
-    for (auto [key, component] : cm->components)
+    void run(Stage stage, double dt)
     {
-      component->ensure_space(id + 1);
+      for (System &sys : systems)
+      {
+        if (sys.stage != stage)
+          continue;
+        auto start = std::chrono::steady_clock::now();
+        sys.fn(dt);
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+        sys.histogram->record(static_cast<uint64_t>(ns));
+      }
     }
 
-    return &inst;
-  }
+    double fixed_dt;
+    uint32_t max_steps;
+    double accumulator = 0;
+    uint64_t frame_count = 0;
+    std::chrono::nanoseconds frame_budget{0};
+    std::function<void(const FrameStats &)> on_overrun;
+    std::vector<System> systems;
+  };
 
   // ------------------------------------------------------------------------
 
-  template <typename T>
-  class BufferIterator
+  /**
+   * @brief Events 是一个类型化的批量事件通道
+   *
+   * 发送事件时写入当前线程自己的分段，分段在帧与帧之间复用容量，稳定之后发送事件不会分配内存。
+   * 在帧末（没有线程在发送事件时）调用 update()，所有分段会合并成一段连续的内存作为本批事件发布出去，
+   * 读取的系统通过各自的 Reader 游标按批次读取。每次 update() 都会整体回收上一批事件，
+   * 所以读取方需要在下一次 update() 之前读完。
+   */
+  template <typename E>
+  class Events
   {
   public:
-    using CBType = ComponentBuffer<std::remove_const_t<T>>;
-    BufferIterator() {}
-    BufferIterator(CBType *_cb)
+    static Events &inst()
     {
-      if (_cb != nullptr)
-      {
-        this->cb = _cb;
-      }
-
-      it = cb->container.begin();
-
-      while (cb != nullptr && !IsValid())
-        MoveNext();
+      static Events instance;
+      return instance;
     }
-    BufferIterator &operator++()
-    {
-      it++;
 
-      while (cb != nullptr && !IsValid())
-        MoveNext();
-      return *this;
-    }
+    void send(const E &e) { emplace(e); }
 
-    bool IsValid()
+    template <typename... Args>
+    void emplace(Args &&...args)
     {
-      if (cb == nullptr)
-        return false;
-      if (it == cb->container.end())
-        return false;
-      return true;
+      Segment &seg = segments[ThreadSlot()];
+      // 正常情况下每个线程独占一个分段，这个自旋锁只在线程数超过 ECS_MAX_THREADS 时才会有竞争
+      while (seg.busy.exchange(true, std::memory_order_acquire))
+        ;
+      seg.events.emplace_back(std::forward<Args>(args)...);
+      seg.busy.store(false, std::memory_order_release);
     }
 
-    void MoveNext()
+    /**
+     * @brief 发布本帧发送的事件并回收上一批事件，必须在没有线程发送事件时调用
+     */
+    void update()
     {
-      if (it == cb->container.end())
+      published.clear();
+
+      Segment *only = nullptr;
+      size_t non_empty = 0, total = 0;
+      for (Segment &seg : segments)
       {
-        if (cb->children != nullptr)
-        {
-          cb = dynamic_cast<CBType *>(cb->children);
-          it = cb->container.begin();
-        }
-        else if (cb->next != nullptr)
-        {
-          cb = dynamic_cast<CBType *>(cb->next);
-          it = cb->container.begin();
-        }
-        else
+        if (seg.events.empty())
+          continue;
+        only = &seg;
+        ++non_empty;
+        total += seg.events.size();
+      }
+
+      // 只有一个线程发送过事件时直接交换，不需要拷贝
+      if (non_empty == 1)
+      {
+        published.swap(only->events);
+      }
+      else if (non_empty > 1)
+      {
+        published.reserve(total);
+        for (Segment &seg : segments)
         {
-          while (cb->parent != nullptr && cb->parent->next == nullptr)
-          {
-            cb = dynamic_cast<CBType *>(cb->parent);
-          }
-          if (cb->parent != nullptr)
-          {
-            cb = dynamic_cast<CBType *>(cb->parent->next);
-            it = cb->container.begin();
-          }
-          else
-          {
-            cb = nullptr;
-          }
+          published.insert(published.end(), seg.events.begin(), seg.events.end());
+          seg.events.clear();
         }
       }
+      ++batch;
     }
 
-    bool operator==(const BufferIterator &other)
+    /// 当前已经发布的这一批事件
+    Span<const E> events() const { return Span<const E>(published.data(), published.size()); }
+
+    uint64_t batchId() const { return batch; }
+
+    /**
+     * @brief Reader 是每个读取系统自己的游标，每一批事件只会被同一个 Reader 读到一次
+     */
+    class Reader
     {
-      if (cb == nullptr)
-        return other.cb == nullptr;
-      else
+    public:
+      explicit Reader(const Events &channel) : channel(&channel) {}
+
+      /**
+       * @brief 读取本批中还没有读过的事件，最多 max 个
+       */
+      Span<const E> read(size_t max = SIZE_MAX)
       {
-        if (cb == other.cb)
-        {
-          return it == other.it;
-        }
-        else
+        if (batch != channel->batch)
         {
-          return false;
+          batch = channel->batch;
+          cursor = 0;
         }
+        Span<const E> all = channel->events();
+        size_t n = std::min(max, all.size() - cursor);
+        Span<const E> result(all.data() + cursor, n);
+        cursor += n;
+        return result;
       }
-    }
-    bool operator!=(const BufferIterator &other) { return !(*this == other); }
 
-    T *operator->() { return &*it; }
-    T &operator*() { return *it; }
+    private:
+      const Events *channel;
+      uint64_t batch = UINT64_MAX;
+      size_t cursor = 0;
+    };
+
+    Reader reader() const { return Reader(*this); }
 
   private:
-    CBType *cb = nullptr;
-    typename std::deque<T>::iterator it;
+    struct alignas(64) Segment
+    {
+      std::atomic<bool> busy{false};
+      std::vector<E> events;
+    };
+
+    Segment segments[ECS_MAX_THREADS];
+    std::vector<E> published;
+    uint64_t batch = 0;
+  };
+
+  // ------------------------------------------------------------------------
+
+  // MpscQueue::stats() 返回的计数快照
+  struct QueueStats
+  {
+    uint64_t pushed;   // 成功入队的数量
+    uint64_t rejected; // 因为队列已满而被拒绝的数量
+    uint64_t drained;  // 已经被消费的数量
+    size_t high_water; // 消费者观察到的最大积压
+    size_t capacity;
   };
 
+  /**
+   * @brief MpscQueue 是一个有界的无锁多生产者单消费者队列
+   *
+   * 容量向上取整为 2 的幂，每个槽位带一个序号，生产者用 CAS 抢占写入位置，
+   * 消费者按顺序批量取出。队列满时 try_push 返回 false 并计入 rejected，由调用者决定重试还是丢弃。
+   * 构造之后不再分配内存。
+   */
   template <typename T>
-  class RegistryBufferIterator
+  class MpscQueue
   {
   public:
-    RegistryBufferIterator() {}
-    RegistryBufferIterator(IComponentBuffer *_cb)
-    {
-      setCB(_cb);
-
-      it = rcb->beginEntity();
-
-      while (cb != nullptr && !IsValid())
-        MoveNext();
-    }
-    RegistryBufferIterator &operator++()
+    explicit MpscQueue(size_t capacity)
     {
-      (*it)++;
-
-      while (cb != nullptr && !IsValid())
-        MoveNext();
-      return *this;
+      size_t cap = 2;
+      while (cap < capacity)
+        cap <<= 1;
+      mask = cap - 1;
+      cells = std::make_unique<Cell[]>(cap);
+      for (size_t i = 0; i < cap; ++i)
+        cells[i].seq.store(i, std::memory_order_relaxed);
     }
 
-    bool IsValid()
+    ~MpscQueue()
     {
-      if (cb == nullptr)
-        return false;
-      if (*it == *(rcb->endEntity()))
-        return false;
-      return true;
+      drain([](T &) {});
     }
 
-    void MoveNext()
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    template <typename... Args>
+    bool try_push(Args &&...args)
     {
-      if (*it == *(rcb->endEntity()))
+      Cell *cell;
+      size_t pos = tail.load(std::memory_order_relaxed);
+      for (;;)
       {
-        if (cb->children != nullptr)
+        cell = &cells[pos & mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0)
         {
-          setCB(cb->children);
-          it = rcb->beginEntity();
+          if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
         }
-        else if (cb->next != nullptr)
+        else if (diff < 0)
         {
-          setCB(cb->next);
-          it = rcb->beginEntity();
+          rejected.fetch_add(1, std::memory_order_relaxed);
+          return false;
         }
         else
         {
-          while (cb->parent != nullptr && cb->parent->next == nullptr)
-          {
-            setCB(cb->parent);
-          }
-          if (cb->parent != nullptr)
-          {
-            setCB(cb->parent->next);
-            it = rcb->beginEntity();
-          }
-          else
-          {
-            setCB(nullptr);
-          }
+          pos = tail.load(std::memory_order_relaxed);
         }
       }
+      new (cell->storage) T(std::forward<Args>(args)...);
+      cell->seq.store(pos + 1, std::memory_order_release);
+      return true;
     }
 
-    bool operator==(const RegistryBufferIterator &other)
+    /**
+     * @brief 只能在消费者线程调用，按入队顺序取出最多 max 个元素交给 f 处理
+     * @return 实际取出的数量
+     */
+    template <typename F>
+    size_t drain(F &&f, size_t max = SIZE_MAX)
     {
-      if (cb == nullptr)
-        return other.cb == nullptr;
-      else
+      size_t backlog = tail.load(std::memory_order_relaxed) - head;
+      if (backlog > high_water)
+        high_water = backlog;
+
+      size_t n = 0;
+      while (n < max)
       {
-        if (cb == other.cb)
-        {
-          return it == other.it;
-        }
-        else
-        {
-          return false;
-        }
+        Cell &cell = cells[head & mask];
+        if (cell.seq.load(std::memory_order_acquire) != head + 1)
+          break;
+        T *value = std::launder(reinterpret_cast<T *>(cell.storage));
+        f(*value);
+        value->~T();
+        cell.seq.store(head + mask + 1, std::memory_order_release);
+        ++head;
+        ++n;
       }
+      return n;
     }
-    bool operator!=(const RegistryBufferIterator &other) { return !(*this == other); }
 
-    T *operator->() { return &*it; }
-    T &operator*() { return *it; }
+    size_t capacity() const { return mask + 1; }
 
-    void setCB(IComponentBuffer *_cb)
+    /// 近似的当前积压数量
+    size_t size() const { return tail.load(std::memory_order_relaxed) - head; }
+
+    QueueStats stats() const
     {
-      if (_cb != nullptr)
-      {
-        this->cb = _cb;
-        this->rcb = dynamic_cast<IRegistryComponentBuffer *>(_cb);
-      } else {
-        this->cb = nullptr;
-        this->rcb = nullptr;
-      }
+      return QueueStats{tail.load(std::memory_order_relaxed),
+                   rejected.load(std::memory_order_relaxed), head, high_water,
+                   capacity()};
     }
 
   private:
-    IComponentBuffer *cb = nullptr;
-    IRegistryComponentBuffer *rcb = nullptr;
-    IEntityIteratorPtr it;
+    struct alignas(64) Cell
+    {
+      std::atomic<size_t> seq;
+      alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> tail{0};
+    std::atomic<uint64_t> rejected{0};
+    alignas(64) size_t head = 0;
+    size_t high_water = 0;
   };
 
-  template <typename B, typename... Ts>
-  class ViewIterator : public RegistryBufferIterator<B>, public BufferIterator<Ts>...
+  /**
+   * @brief CommandQueue 用来从其他线程向模拟线程提交创建实体、修改组件的请求
+   *
+   * 请求以闭包的形式内联存放在 MpscQueue 的槽位中，闭包必须可以平凡拷贝并且不超过
+   * ECS_COMMAND_PAYLOAD 字节，所以提交请求不会分配内存。模拟线程在合适的时机调用 drain()
+   * 批量执行这些请求，把数据写进组件缓冲。
+   */
+  class CommandQueue
   {
   public:
-    ViewIterator() {}
+    explicit CommandQueue(size_t capacity = 4096) : queue(capacity) {}
 
-    ViewIterator(ComponentManager<B> &cm)
-        : RegistryBufferIterator<B>(cm.registy),
-          BufferIterator<Ts>(cm.template getOrCreateComponentBuffer<
-                             std::remove_const_t<Ts>>())...
+    static CommandQueue &inst()
     {
-      std::cout << cm.registy->size() << std::endl;
-      uint32_t sizes[] = {
-          (cm.template getOrCreateComponentBuffer<std::remove_const_t<Ts>>())
-              ->size()...};
-      for (int i = 0; i < sizeof...(Ts); i++)
-      {
-        std::cout << sizes[i] << std::endl;
-      }
+      static CommandQueue instance;
+      return instance;
     }
 
-    ViewIterator &operator++()
+    /**
+     * @brief 提交一个在模拟线程上执行的闭包
+     */
+    template <typename F>
+    bool push(F &&f)
     {
-      RegistryBufferIterator<B>::operator++();
-      (BufferIterator<Ts>::operator++(), ...);
-      return *this;
+      using Fn = std::decay_t<F>;
+      static_assert(sizeof(Fn) <= ECS_COMMAND_PAYLOAD, "command closure is too large");
+      static_assert(alignof(Fn) <= alignof(std::max_align_t), "command closure is over-aligned");
+      static_assert(std::is_trivially_copyable_v<Fn>, "command closure must be trivially copyable");
+
+      Command cmd;
+      cmd.invoke = [](Command &c)
+      { (*std::launder(reinterpret_cast<Fn *>(c.payload)))(); };
+      new (cmd.payload) Fn(std::forward<F>(f));
+      return queue.try_push(cmd);
     }
-    bool operator==(const ViewIterator &other)
+
+    /**
+     * @brief 请求创建一个 B 类型的实体，创建之后调用 init 初始化它的组件
+     */
+    template <typename B, typename F>
+    bool create(F init)
     {
-      bool reg = RegistryBufferIterator<B>::operator==(other);
-      bool ts[] = {BufferIterator<Ts>::operator==(other)...};
-      return reg && std::all_of(ts, ts + sizeof...(Ts), [](bool b)
-                                { return b; });
+      return push([init]() mutable
+                  { init(CreateEntity<B>()); });
     }
-    bool operator!=(const ViewIterator &other) { return !(*this == other); }
 
-    std::tuple<Ts *...> operator*()
+    /**
+     * @brief 请求把 B 类中编号为 id 的实体的组件 T 设置为 value
+     */
+    template <typename B, typename T>
+    bool set(uint32_t id, const T &value)
     {
-      return std::tuple<Ts *...>(BufferIterator<Ts>::operator->()...);
+      return push([id, value]()
+                  {
+                    auto &cm = ComponentManager<B>::inst();
+                    auto *cb = cm.template getOrCreateComponentBuffer<T>();
+                    uint32_t row = cm.rowOf(id);
+                    cb->touch(row);
+                    cb->get(row) = value; });
     }
-  };
 
-  template <typename B, typename... Ts>
-  class View
-  {
-  public:
-    View() { ensure_space(ComponentManager<B>::inst().registy); }
-    void ensure_space(IComponentBuffer *cur)
+    /**
+     * @brief 在模拟线程上按提交顺序执行最多 max 个请求
+     */
+    size_t drain(size_t max = SIZE_MAX)
     {
-      IComponentManager *cm = cur->manager;
-      std::vector<IComponentBuffer *> cbs = {
-          cm->template getOrCreateComponentBuffer<std::remove_const_t<Ts>>()...};
-
-      for (auto cb : cbs)
-      {
-        if (cb != nullptr)
-        {
-          cb->ensure_space(cur->size());
-        }
-      }
-
-      if (cur->children != nullptr)
-        ensure_space(cur->children);
-      if (cur->next != nullptr)
-        ensure_space(cur->next);
+      return queue.drain([](Command &c)
+                         { c.invoke(c); },
+                         max);
     }
 
-    ViewIterator<B, Ts...> begin()
+    QueueStats stats() const { return queue.stats(); }
+
+  private:
+    struct Command
     {
-      return ViewIterator<B, Ts...>(ComponentManager<B>::inst());
-    }
-    ViewIterator<B, Ts...> end() { return ViewIterator<B, Ts...>(); }
+      void (*invoke)(Command &);
+      alignas(std::max_align_t) unsigned char payload[ECS_COMMAND_PAYLOAD];
+    };
+
+    MpscQueue<Command> queue;
   };
 
 } // namespace ecs
@@ -4,7 +4,9 @@
 
 #include "ECS.hpp"
 #include <cstdint>
-#include <list>
+#include <fstream>
+#include <sstream>
+#include <thread>
 
 extern void dump(ecs::IComponentManager *icm, std::string name);
 
@@ -16,7 +18,7 @@ public:
 
   void release() override
   {
-    // ecs::ReleaseEntity<Node>(id);
+    ecs::ReleaseEntity(this);
   }
 
   void setPosition(float x, float y);
@@ -35,17 +37,20 @@ public:
     float dy = 1;
   };
 
-  struct Tree
+  struct WorldPosition
   {
-    Node *parent;
-    std::list<Node *> children;
+    float x, y;
   };
 
   COMPONENT(Position, position)
   COMPONENT(Velocity, velocity)
-  COMPONENT(Tree, tree)
+  COMPONENT(WorldPosition, world)
+
+  TAG(Selected)
 
   float a, b, c;
+
+  void tick(float dt) { a += dt; }
 };
 
 std::ostream &operator<<(std::ostream &os, const Node::Position &position)
@@ -88,7 +93,7 @@ void Node::updatePosition()
   }
 }
 
-Node *Node::getParent() { return tree()->parent; }
+Node *Node::getParent() { return ecs::SceneTree<Node>::inst().parent(this); }
 
 struct Image
 {
@@ -108,8 +113,1390 @@ public:
   ENTITY(Sprite, Node)
 
   COMPONENT(Image, image);
+  SHARED_COMPONENT(Image, texture)
+};
+
+class Particle : public ecs::Entity
+{
+public:
+  ENTITY(Particle, ecs::Entity)
+
+  void release() override {}
+
+  COMPONENT_DOUBLE_BUFFERED(Node::Position, position)
+  COMPONENT(Node::Velocity, velocity)
+};
+
+void testDoubleBuffered()
+{
+  Particle *p = Particle::create();
+  Particle *q = Particle::create();
+  q->position().next().x = 5;
+  REQUIRE(q->position()->x == 0);
+
+  auto view = ecs::View<Particle, const Node::Position, ecs::Next<Node::Position>, Node::Velocity>();
+  for (auto [prev, next, v] : view)
+  {
+    next->x = prev->x + v->dx;
+  }
+  REQUIRE(p->position()->x == 0);
+
+  ecs::SwapBuffers<Particle, Node::Position>();
+  REQUIRE(p->position()->x == 1);
+  REQUIRE(q->position()->x == 1);
+  REQUIRE(p->position().next().x == 0);
+}
+
+void testViewCursor()
+{
+  ecs::ViewCursor<Node, Node::Velocity> cursor;
+  uint32_t total = 0;
+  auto bump = [](Node::Velocity *v)
+  { v->dx += 1; };
+
+  REQUIRE(cursor.step(bump, 2) == 2);
+  REQUIRE(cursor.sweeps() == 0);
+  Sprite::create();
+  while (cursor.sweeps() == 0)
+    total += cursor.step(bump, 2);
+  REQUIRE(total == 4);
+
+  uint32_t count = 0;
+  for ([[maybe_unused]] auto [v] : ecs::View<Node, Node::Velocity>())
+    count++;
+  REQUIRE(count == 6);
+}
+
+void testRunner()
+{
+  ecs::Runner runner(0.01, 5);
+  int fixed = 0, variable = 0;
+  uint32_t id = runner.addSystem("fixed", [&]()
+                                 { fixed++; });
+  runner.addSystem("variable", [&](double)
+                   { variable++; }, ecs::Runner::Stage::Variable);
+
+  REQUIRE(runner.frame(0.035) == 3);
+  REQUIRE(runner.alpha() > 0.45);
+  REQUIRE(runner.alpha() < 0.55);
+  REQUIRE(runner.frame(1.0) == 5);
+  REQUIRE(runner.alpha() < 1.0);
+  REQUIRE(fixed == 8);
+  REQUIRE(variable == 2);
+
+  auto stats = runner.stats(id);
+  REQUIRE(stats.count == 8);
+  REQUIRE(stats.p50 <= stats.p99);
+
+  int overruns = 0;
+  runner.setFrameBudget(std::chrono::nanoseconds(1), [&](const ecs::Runner::FrameStats &)
+                        { overruns++; });
+  runner.frame(0.01);
+  REQUIRE(overruns == 1);
+
+  REQUIRE(ecs::LatencyHistogram::bucketOf(1030) == ecs::LatencyHistogram::bucketOf(1100));
+  REQUIRE(ecs::LatencyHistogram::valueOf(ecs::LatencyHistogram::bucketOf(1000)) > 800);
+  REQUIRE(ecs::LatencyHistogram::valueOf(ecs::LatencyHistogram::bucketOf(1000)) < 1300);
+}
+
+struct Damage
+{
+  uint32_t target;
+  int amount;
+};
+
+void testEvents()
+{
+  ecs::Events<Damage> channel;
+  auto reader = channel.reader();
+
+  channel.send({1, 10});
+  std::thread worker([&]()
+                     { for (int i = 0; i < 100; i++) channel.send({2, 1}); });
+  worker.join();
+  REQUIRE(reader.read().size() == 0);
+
+  channel.update();
+  int total = 0;
+  auto first = reader.read(50);
+  REQUIRE(first.size() == 50);
+  for (const Damage &d : first)
+    total += d.amount;
+  for (const Damage &d : reader.read())
+    total += d.amount;
+  REQUIRE(total == 110);
+  REQUIRE(reader.read().size() == 0);
+
+  auto late = channel.reader();
+  REQUIRE(late.read().size() == 101);
+
+  channel.send({3, 5});
+  channel.update();
+  REQUIRE(reader.read().size() == 1);
+  REQUIRE(reader.read().empty());
+  channel.update();
+  REQUIRE(channel.events().empty());
+}
+
+void testCommandQueue()
+{
+  ecs::CommandQueue queue(64);
+  Node *target = Node::create();
+
+  auto produce = [&](float x)
+  {
+    for (int i = 0; i < 10; i++)
+      queue.create<Node>([x](Node *n)
+                         { n->position()->x = x; });
+  };
+  std::thread t1(produce, 1.0f), t2(produce, 2.0f);
+  t1.join();
+  t2.join();
+  queue.set<Node, Node::Velocity>(target->id, Node::Velocity{5, 6});
+
+  REQUIRE(queue.drain(5) == 5);
+  REQUIRE(queue.drain() == 16);
+  REQUIRE(target->velocity()->dx == 5);
+  REQUIRE(target->velocity()->dy == 6);
+
+  float sum = 0;
+  for (auto [pos] : ecs::View<Node, Node::Position>())
+    sum += pos->x;
+  REQUIRE(sum > 30);
+
+  for (int i = 0; i < 100; i++)
+    queue.push([]() {});
+  auto stats = queue.stats();
+  REQUIRE(stats.capacity == 64);
+  REQUIRE(stats.pushed == 85);
+  REQUIRE(stats.rejected == 36);
+  REQUIRE(queue.drain() == 64);
+  REQUIRE(queue.stats().high_water == 64);
+}
+
+class Body : public ecs::Entity
+{
+public:
+  ENTITY(Body, ecs::Entity)
+
+  void release() override {}
+
+  COMPONENT(Node::Position, position)
+};
+
+void testChangeTracking()
+{
+  std::vector<Body *> bodies;
+  for (int i = 0; i < 600; i++)
+    bodies.push_back(Body::create());
+
+  for (auto [pos] : ecs::View<Body, const Node::Position>())
+    (void)pos->x;
+
+  uint32_t since = ecs::AdvanceWorldVersion();
+  bodies[10]->position()->x = 1;
+  bodies[300]->position()->x = 2;
+  for (auto [pos] : ecs::View<Body, const Node::Position>())
+    (void)pos->x;
+
+  auto count = [](auto view)
+  {
+    uint32_t n = 0;
+    for (auto it = view.begin(); it != view.end(); ++it)
+      n++;
+    return n;
+  };
+  REQUIRE(count(ecs::View<Body, ecs::Changed<Node::Position>>(since)) == 2 * ecs::kChunkSize);
+  REQUIRE(count(ecs::View<Body, ecs::Added<Node::Position>>(since)) == 0);
+
+  ecs::TrackRows<Body, Node::Position>();
+  float sum = 0;
+  for (auto [pos] : ecs::View<Body, ecs::Changed<Node::Position>>(since))
+    sum += pos->x;
+  REQUIRE(sum == 3);
+
+  since = ecs::AdvanceWorldVersion();
+  REQUIRE(count(ecs::View<Body, ecs::Changed<Node::Position>>(since)) == 0);
+  Body::create()->position()->x = 4;
+  bodies[599]->position()->x = 5;
+  REQUIRE(count(ecs::View<Body, ecs::Added<Node::Position>>(since)) == 1);
+  REQUIRE(count(ecs::View<Body, ecs::Changed<Node::Position>>(since)) == 2);
+}
+
+void testObservers()
+{
+  uint32_t constructed = 0, updated = 0, destroyed = 0;
+  auto &cm = ecs::ComponentManager<Node>::inst();
+  ecs::ObserverId on_construct = cm.onConstruct<Node::Position>([&](auto &, uint32_t, uint32_t count)
+                                                                { constructed += count; });
+  ecs::ObserverId on_update = cm.onUpdate<Node::Position>([&](ecs::ComponentBuffer<Node::Position> &, uint32_t, uint32_t count)
+                                                          { updated += count; });
+  ecs::ObserverId on_destroy = cm.onDestroy<Node::Position>([&](ecs::ComponentBuffer<Node::Position> &buffer, uint32_t first, uint32_t)
+                                                            { destroyed += buffer.get(first).x == 42; });
+
+  Node *n = Node::create();
+  Sprite::create();
+  REQUIRE(constructed == 2);
+
+  n->position().patch([](Node::Position &p)
+                      { p.x = 42; });
+  REQUIRE(updated == 1);
+
+  uint32_t id = n->id;
+  n->release();
+  REQUIRE(destroyed == 1);
+  uint32_t found = 0;
+  for (auto [pos] : ecs::View<Node, Node::Position>())
+    found += pos->x == 42;
+  REQUIRE(found == 0);
+
+  Node *m = Node::create();
+  REQUIRE(m->id == id);
+  REQUIRE(m->position()->x == 0);
+  REQUIRE(constructed == 3);
+
+  // 计数器在栈上，离开之前注销观察者
+  REQUIRE(cm.unobserve<Node::Position>(on_construct));
+  REQUIRE(cm.unobserve<Node::Position>(on_update));
+  REQUIRE(cm.unobserve<Node::Position>(on_destroy));
+  REQUIRE(!cm.unobserve<Node::Position>(on_destroy));
+  Node::create();
+  REQUIRE(constructed == 3);
+}
+
+void testTags()
+{
+  std::vector<Body *> bodies;
+  for (int i = 0; i < 200; i++)
+    bodies.push_back(Body::create());
+  Node *n = Node::create();
+  Sprite *s = Sprite::create();
+
+  auto count = [](auto view)
+  {
+    uint32_t k = 0;
+    for (auto it = view.begin(); it != view.end(); ++it)
+      k++;
+    return k;
+  };
+  uint32_t all = count(ecs::View<Node, Node::Position>());
+
+  REQUIRE(!n->tag<Node::Selected>());
+  n->tag<Node::Selected>().set();
+  s->tag<Node::Selected>().set();
+  REQUIRE(n->tag<Node::Selected>().test());
+  REQUIRE(count(ecs::View<Node, Node::Position, ecs::With<Node::Selected>>()) == 2);
+  REQUIRE(count(ecs::View<Node, ecs::Without<Node::Selected>>()) == all - 2);
+  n->tag<Node::Selected>().clear();
+  REQUIRE(count(ecs::View<Node, ecs::With<Node::Selected>>()) == 1);
+
+  for (int i = 0; i < 200; i += 3)
+    bodies[i]->tag<Node::Selected>().set();
+  uint32_t visited = 0;
+  ecs::ViewCursor<Body, ecs::With<Node::Selected>> cursor;
+  while (cursor.sweeps() == 0)
+    visited += cursor.step([](const Node::Selected *) {}, 16);
+  REQUIRE(visited == 67);
+  REQUIRE(ecs::ComponentManager<Body>::inst().getOrCreateTagBuffer<Node::Selected>()->popcount() == 67);
+}
+
+void testSharedComponents()
+{
+  uint32_t pixels[4] = {};
+  Image grass{2, 2, pixels}, stone{1, 4, pixels};
+
+  auto *shared = ecs::ComponentManager<Sprite>::inst().getOrCreateSharedBuffer<Image>();
+  shared->classValue() = Image{8, 8, nullptr};
+
+  std::vector<Sprite *> sprites;
+  for (int i = 0; i < 10; i++)
+  {
+    sprites.push_back(Sprite::create());
+    sprites.back()->texture().set(i % 2 ? grass : stone);
+  }
+  REQUIRE(sprites[1]->texture()->width == 2);
+  REQUIRE(sprites[2]->texture()->height == 4);
+  REQUIRE(shared->values.size() == 3);
+
+  // 同一个类上普通的 Image 组件和共享的 Image 组件互不影响
+  sprites[1]->image()->width = 5;
+  REQUIRE(sprites[1]->texture()->width == 2);
+  REQUIRE(sprites[1]->image()->width == 5);
+
+  uint32_t groups = 0, grass_rows = 0, total = 0;
+  ecs::ForEachShared<Sprite, Image>([&](const Image &img, ecs::IComponentManager &, ecs::Span<const uint32_t> rows)
+                                    {
+    groups++;
+    total += rows.size();
+    if (img.width == 2)
+      grass_rows += rows.size(); });
+  REQUIRE(groups == 3);
+  REQUIRE(grass_rows == 5);
+
+  uint32_t in_view = 0, defaults = 0;
+  for (auto [img] : ecs::View<Sprite, ecs::Shared<Image>>())
+  {
+    in_view++;
+    defaults += img->width == 8;
+  }
+  REQUIRE(in_view == total);
+  REQUIRE(defaults == total - 10);
+
+  for (int i = 0; i < 10; i += 2)
+    sprites[i]->texture().unset();
+  REQUIRE(shared->distinct() == 2);
+  sprites[0]->texture().set(Image{3, 3, nullptr});
+  REQUIRE(shared->values.size() == 3);
+
+  // 等于类默认值的值直接引用编号 0，不再分配新的槽位
+  sprites[2]->texture().set(Image{8, 8, nullptr});
+  REQUIRE(shared->index[sprites[2]->row()] == 0);
+  REQUIRE(shared->values.size() == 3);
+}
+
+class Mote : public ecs::Entity
+{
+public:
+  ENTITY(Mote, ecs::Entity)
+
+  void release() override
+  {
+    ecs::ReleaseEntity(this);
+  }
+
+  COMPONENT(Node::Position, position)
+  COMPONENT(Node::Velocity, velocity)
 };
 
+void testSortedGroup()
+{
+  auto ascending = []()
+  {
+    float last = -1e9f;
+    uint32_t n = 0;
+    for (auto [pos] : ecs::View<Mote, const Node::Position>())
+    {
+      if (pos->y < last)
+        return 0u;
+      last = pos->y;
+      n++;
+    }
+    return n;
+  };
+
+  std::vector<Mote *> motes;
+  for (int i = 0; i < 300; i++)
+  {
+    motes.push_back(Mote::create());
+    motes.back()->position()->x = i;
+    motes.back()->position()->y = (i * 37) % 300;
+    motes.back()->velocity()->dx = -i;
+    if (i % 3 == 0)
+      motes.back()->tag<Node::Selected>().set();
+  }
+
+  ecs::SortedGroup<Mote, &Node::Position::y> group;
+  REQUIRE(group.sort() == 1);
+  REQUIRE(ascending() == 300);
+  REQUIRE(group.sort() == 0);
+  for (int i = 0; i < 300; i++)
+  {
+    REQUIRE(motes[i]->position().read().x == i);
+    REQUIRE(motes[i]->position().read().y == (i * 37) % 300);
+    REQUIRE(motes[i]->velocity().read().dx == -i);
+    REQUIRE(bool(motes[i]->tag<Node::Selected>()) == (i % 3 == 0));
+  }
+
+  // 新实体追加在最后一行，移到最前面的总距离超出插入排序的预算，改用基数排序
+  motes[7]->position()->y = -1;
+  Mote *late = Mote::create();
+  late->position()->y = -2;
+  REQUIRE(group.sort() == 1);
+  REQUIRE(ascending() == 301);
+  REQUIRE(late->row() == 0);
+  REQUIRE(motes[7]->row() == 1);
+  REQUIRE(motes[7]->position().read().x == 7);
+
+  // 只移动一两行的改动走插入排序
+  motes[20]->position()->y += 1.5f;
+  uint32_t row = motes[20]->row();
+  REQUIRE(group.sort() == 1);
+  REQUIRE(ascending() == 301);
+  REQUIRE(motes[20]->row() == row + 1);
+  REQUIRE(motes[20]->position().read().x == 20);
+
+  motes[3]->release();
+  Mote *reused = Mote::create();
+  REQUIRE(reused == motes[3]);
+  REQUIRE(reused->position().read().y == 0);
+  REQUIRE(reused->velocity().read().dx == 1);
+  group.sort();
+  REQUIRE(ascending() == 301);
+}
+
+class Spark : public ecs::Entity
+{
+public:
+  ENTITY(Spark, ecs::Entity)
+
+  void release() override
+  {
+    ecs::ReleaseEntity(this);
+  }
+
+  COMPONENT(Node::Position, position)
+};
+
+void testGroups()
+{
+  std::vector<Spark *> sparks;
+  for (int i = 0; i < 100; i++)
+  {
+    sparks.push_back(Spark::create());
+    sparks.back()->position()->x = i;
+    if (i % 4 == 0)
+      sparks.back()->tag<Node::Selected>().set();
+  }
+
+  auto members = [](auto &group)
+  {
+    uint32_t n = 0;
+    group.each([&](Node::Position *pos, const Node::Selected *)
+               { n += int(pos->x) % 4 == 0 || pos->x == 1 || pos->x == 100; });
+    return n;
+  };
+
+  {
+    ecs::Group<Spark, Node::Position, Node::Selected> selected;
+    REQUIRE(selected.size() == 25);
+    REQUIRE(members(selected) == 25);
+    for (int i = 0; i < 100; i++)
+      REQUIRE(sparks[i]->position().read().x == i);
+
+    sparks[1]->tag<Node::Selected>().set();
+    sparks[0]->tag<Node::Selected>().clear();
+    REQUIRE(selected.size() == 25);
+    REQUIRE(sparks[1]->row() < 25);
+    REQUIRE(sparks[0]->row() >= 25);
+
+    sparks[8]->release();
+    REQUIRE(selected.size() == 24);
+    Spark *reused = Spark::create();
+    REQUIRE(reused == sparks[8]);
+    REQUIRE(selected.size() == 24);
+    reused->position()->x = 100;
+    reused->tag<Node::Selected>().set();
+    REQUIRE(selected.size() == 25);
+    REQUIRE(members(selected) == 25);
+    REQUIRE(sparks[4]->position().read().x == 4);
+    REQUIRE(bool(sparks[4]->tag<Node::Selected>()));
+  }
+
+  // 只有普通组件的分组把释放的实体交换到末尾
+  sparks[50]->release();
+  ecs::Group<Spark, const Node::Position> alive;
+  REQUIRE(alive.size() == 99);
+  Spark::create();
+  Spark::create();
+  REQUIRE(alive.size() == 101);
+}
+
+void testHierarchy()
+{
+  auto &tree = ecs::SceneTree<Node>::inst();
+  Node *root = Node::create();
+  Node *arm = Node::create();
+  Sprite *hand = Sprite::create();
+  Node *finger = Node::create();
+  Node *other = Node::create();
+
+  REQUIRE(tree.reparent(arm, root));
+  REQUIRE(tree.reparent(hand, arm));
+  REQUIRE(tree.reparent(finger, hand));
+  tree.reparent(other, nullptr);
+  REQUIRE(!tree.reparent(root, finger));
+  REQUIRE(finger->getParent() == hand);
+  REQUIRE(tree.depth(finger) == 3);
+
+  auto sub = tree.subtree(arm);
+  REQUIRE(sub.size() == 3);
+  REQUIRE(tree.nodes[sub[0]] == arm);
+  REQUIRE(tree.nodes[sub[1]] == hand);
+  REQUIRE(tree.nodes[sub[2]] == finger);
+  REQUIRE(tree.subtree(root).size() == 4);
+
+  // 父节点总是排在子节点前面
+  for (uint32_t slot : tree.dfs())
+    if (tree.links[slot].parent != ecs::kNoNode)
+      REQUIRE(tree.subtree(tree.nodes[tree.links[slot].parent]).data() < tree.subtree(tree.nodes[slot]).data());
+
+  REQUIRE(tree.reparent(hand, other));
+  REQUIRE(tree.depth(finger) == 2);
+  REQUIRE(tree.subtree(root).size() == 2);
+  REQUIRE(tree.subtree(other).size() == 3);
+
+  tree.detach(hand);
+  REQUIRE(!hand->getParent());
+  REQUIRE(tree.depth(finger) == 1);
+
+  // 释放的实体从树中移除，子节点挂到它的父节点下面
+  tree.reparent(hand, arm);
+  hand->release();
+  REQUIRE(finger->getParent() == arm);
+  REQUIRE(tree.depth(finger) == 2);
+  REQUIRE(tree.subtree(root).size() == 3);
+
+  // 子节点按添加顺序排列，从中间摘掉一个不影响其它兄弟的顺序
+  std::vector<Node *> kids;
+  for (int i = 0; i < 5; i++)
+  {
+    kids.push_back(Node::create());
+    tree.reparent(kids.back(), other);
+  }
+  tree.detach(kids[2]);
+  tree.reparent(kids[2], other);
+  auto order = tree.subtree(other);
+  std::vector<Node *> expected = {other, kids[0], kids[1], kids[3], kids[4], kids[2]};
+  REQUIRE(order.size() == expected.size());
+  for (size_t i = 0; i < expected.size(); i++)
+    REQUIRE(tree.nodes[order[i]] == expected[i]);
+}
+
+void testTransforms()
+{
+  auto &tree = ecs::SceneTree<Node>::inst();
+  ecs::TransformSystem<Node, Node::Position, Node::WorldPosition> transforms;
+  auto combine = [](const Node::WorldPosition &parent, const Node::Position &local)
+  { return Node::WorldPosition{parent.x + local.x, parent.y + local.y}; };
+
+  std::vector<Node *> chain;
+  for (int i = 0; i < 50; i++)
+  {
+    chain.push_back(i % 2 ? Sprite::create() : Node::create());
+    chain.back()->setPosition(1, i);
+    tree.reparent(chain.back(), i > 0 ? chain[i - 1] : nullptr);
+  }
+  std::vector<Node *> leaves;
+  for (int i = 0; i < 10000; i++)
+  {
+    leaves.push_back(i % 3 ? Node::create() : Sprite::create());
+    leaves.back()->setPosition(2, 0);
+    tree.reparent(leaves.back(), chain[10]);
+  }
+
+  REQUIRE(transforms.run(combine, 0) == tree.dfs().size());
+  REQUIRE(chain[49]->world().read().x == 50);
+  REQUIRE(chain[49]->world().read().y == 49 * 50 / 2);
+  REQUIRE(leaves[9999]->world().read().x == 13);
+  REQUIRE(leaves[9999]->world().read().y == 55);
+
+  // 逐行追踪之后只重新计算被修改的子树，否则同一块中的其它行也会被当作脏节点
+  ecs::TrackRows<Node, Node::Position>();
+  uint32_t since = ecs::AdvanceWorldVersion();
+  REQUIRE(transforms.run(combine, since) == 0);
+  chain[40]->position()->y += 100;
+  REQUIRE(transforms.run(combine, since) == 10);
+  REQUIRE(chain[49]->world().read().y == 49 * 50 / 2 + 100);
+  REQUIRE(chain[39]->world().read().y == 39 * 40 / 2);
+
+  // 结构变化之后只重新计算被移动的节点和它们的子树
+  since = ecs::AdvanceWorldVersion();
+  tree.reparent(leaves[0], chain[0]);
+  REQUIRE(transforms.run(combine, since) == 1);
+  REQUIRE(leaves[0]->world().read().x == 3);
+  tree.reparent(chain[45], chain[0]);
+  REQUIRE(transforms.run(combine, since) == 5);
+  REQUIRE(chain[49]->world().read().x == 6);
+  REQUIRE(chain[49]->world().read().y == 45 + 46 + 47 + 48 + 49);
+  REQUIRE(leaves[9999]->world().read().y == 55);
+
+  // 被释放节点的子节点挂到祖父节点下面，只有这一段需要重新计算
+  chain[20]->release();
+  REQUIRE(transforms.run(combine, since) == 24);
+  REQUIRE(chain[44]->world().read().x == 44);
+  REQUIRE(chain[44]->world().read().y == 44 * 45 / 2 - 20 + 100);
+}
+
+struct Targets
+{
+};
+
+void testRelations()
+{
+  auto &targets = ecs::Relation<Targets>::inst();
+  Node *hunter = Node::create();
+  Sprite *wolf = Sprite::create();
+  std::vector<Node *> prey;
+  for (int i = 0; i < 5; i++)
+    prey.push_back(i % 2 ? Sprite::create() : Node::create());
+
+  for (Node *p : prey)
+  {
+    REQUIRE(ecs::relate<Targets>(hunter, p));
+    REQUIRE(ecs::relate<Targets>(wolf, p));
+  }
+  REQUIRE(!ecs::relate<Targets>(hunter, prey[0]));
+  REQUIRE(targets.has(hunter, prey[3]));
+  REQUIRE(!targets.has(prey[3], hunter));
+  REQUIRE(targets.targetCount(hunter) == 5);
+  REQUIRE(targets.sourceCount(prey[2]) == 2);
+
+  REQUIRE(ecs::unrelate<Targets>(hunter, prey[1]));
+  REQUIRE(!ecs::unrelate<Targets>(hunter, prey[1]));
+  REQUIRE(targets.targetCount(hunter) == 4);
+  REQUIRE(targets.sourceCount(prey[1]) == 1);
+  REQUIRE(targets.has(hunter, prey[4]));
+
+  uint32_t seen = 0;
+  targets.targets(hunter, [&](ecs::Entity *e)
+                  { seen += e != prey[1]; });
+  REQUIRE(seen == 4);
+
+  // 任意一端被释放时自动删除相关的边
+  prey[4]->release();
+  REQUIRE(targets.targetCount(hunter) == 3);
+  REQUIRE(targets.targetCount(wolf) == 4);
+  wolf->release();
+  REQUIRE(targets.sourceCount(prey[0]) == 1);
+  REQUIRE(targets.sourceCount(prey[1]) == 0);
+  Sprite *reused = Sprite::create();
+  REQUIRE(targets.targetCount(reused) == 0);
+  REQUIRE(targets.has(hunter, prey[0]));
+}
+
+class Boid : public ecs::Entity
+{
+public:
+  ENTITY(Boid, ecs::Entity)
+
+  void release() override
+  {
+    ecs::ReleaseEntity(this);
+  }
+
+  COMPONENT(Node::Position, position)
+};
+
+void testSpatialIndex()
+{
+  std::vector<Boid *> boids;
+  for (int i = 0; i < 1000; i++)
+  {
+    boids.push_back(Boid::create());
+    boids.back()->position()->x = (i % 40) * 2.5f;
+    boids.back()->position()->y = (i / 40) * 2.5f;
+  }
+
+  auto &index = ecs::SpatialIndex<Boid, Node::Position>::inst();
+  index.setCellSize(10);
+  REQUIRE(index.size() == 1000);
+
+  ecs::Entity *found[64];
+  ecs::Span<ecs::Entity *> out(found, 64);
+  auto within = [&](float x, float y, float r)
+  {
+    uint32_t n = 0;
+    for (Boid *b : boids)
+    {
+      float dx = b->position().read().x - x, dy = b->position().read().y - y;
+      n += !(b->flags & ecs::kEntityReleased) && dx * dx + dy * dy <= r * r;
+    }
+    return n;
+  };
+
+  REQUIRE(index.range(0, 0, 10, 10, out) == 25);
+  REQUIRE(index.radius(50, 30, 6, out) == within(50, 30, 6));
+  REQUIRE(index.range(0, 0, 100, 100, ecs::Span<ecs::Entity *>(found, 8)) == 8);
+  found[8] = nullptr;
+  REQUIRE(index.range(0, 0, 10, 10, ecs::Span<ecs::Entity *>(found + 8, 0)) == 0);
+  REQUIRE(index.radius(50, 30, 6, ecs::Span<ecs::Entity *>(found + 8, 0)) == 0);
+  REQUIRE(!found[8]);
+
+  REQUIRE(index.nearest(51, 31, ecs::Span<ecs::Entity *>(found, 4)) == 4);
+  REQUIRE(found[0] == boids[12 * 40 + 20]);
+  REQUIRE(within(51, 31, 2.5f) == 4);
+  for (int i = 0; i < 4; i++)
+  {
+    auto &pos = static_cast<Boid *>(found[i])->position().read();
+    REQUIRE(std::abs(pos.x - 51) <= 2.5f);
+    REQUIRE(std::abs(pos.y - 31) <= 2.5f);
+  }
+
+  uint32_t since = ecs::AdvanceWorldVersion();
+  boids[0]->position()->x = 500;
+  Boid *stray = Boid::create();
+  stray->position()->x = -100;
+  stray->position()->y = -100;
+  index.update(since);
+  REQUIRE(index.size() == 1001);
+  REQUIRE(index.range(495, -5, 505, 5, out) == 1);
+  REQUIRE(found[0] == boids[0]);
+  REQUIRE(index.range(0, 0, 10, 10, out) == 24);
+  REQUIRE(index.nearest(-90, -90, ecs::Span<ecs::Entity *>(found, 1)) == 1);
+  REQUIRE(found[0] == stray);
+
+  boids[0]->release();
+  REQUIRE(index.size() == 1000);
+  REQUIRE(index.range(495, -5, 505, 5, out) == 0);
+
+  index.rebuild();
+  REQUIRE(index.size() == 1000);
+  REQUIRE(index.radius(50, 30, 6, out) == within(50, 30, 6));
+  REQUIRE(index.nearest(-90, -90, ecs::Span<ecs::Entity *>(found, 1)) == 1);
+  REQUIRE(found[0] == stray);
+}
+
+void testIndex()
+{
+  std::vector<Sprite *> sprites;
+  for (int i = 0; i < 100; i++)
+  {
+    sprites.push_back(Sprite::create());
+    sprites.back()->image()->width = 1000 + i % 10;
+  }
+
+  ecs::Index<Sprite, &Image::width> by_width;
+  ecs::Index<Sprite, &Image::width, ecs::IndexKind::Sorted> ordered;
+  REQUIRE(by_width.count(1003) == 10);
+  REQUIRE(ordered.count(1003) == 10);
+
+  // 通过 ComponentRef 写入会被索引看到
+  sprites[3]->image()->width = 2000;
+  REQUIRE(by_width.count(1003) == 9);
+  REQUIRE(by_width.first(2000) == sprites[3]);
+  REQUIRE(ordered.first(2000) == sprites[3]);
+
+  uint32_t n = 0;
+  int last = 0;
+  ordered.range(1005, 1009, [&](ecs::Entity *e)
+                {
+    int width = static_cast<Sprite *>(e)->image().read().width;
+    n += width >= last;
+    last = width; });
+  REQUIRE(n == 50);
+
+  sprites[13]->release();
+  REQUIRE(by_width.count(1003) == 8);
+  REQUIRE(ordered.count(1003) == 8);
+  Sprite *fresh = Sprite::create();
+  REQUIRE(fresh == sprites[13]);
+  fresh->image()->width = 1003;
+  REQUIRE(by_width.count(1003) == 9);
+
+  by_width.rebuild();
+  ordered.rebuild();
+  REQUIRE(by_width.count(1003) == 9);
+  REQUIRE(ordered.count(1003) == 9);
+  REQUIRE(by_width.size() == ordered.size());
+}
+
+void testGuids()
+{
+  auto &guids = ecs::GuidIndex::inst();
+  std::vector<Node *> nodes;
+  for (uint64_t i = 1; i <= 5000; i++)
+    nodes.push_back(i % 7 ? ecs::CreateEntity<Node>(i << 20) : ecs::CreateEntity<Sprite>(i << 20));
+  REQUIRE(guids.size() == 5000);
+  REQUIRE(ecs::FindByGuid(uint64_t(77) << 20) == nodes[76]);
+  REQUIRE(!ecs::FindByGuid(uint64_t(5001) << 20));
+  REQUIRE(guids.guidOf(nodes[9]) == uint64_t(10) << 20);
+
+  REQUIRE(!guids.assign(nodes[0], uint64_t(2) << 20));
+  REQUIRE(guids.assign(nodes[0], 42));
+  REQUIRE(ecs::FindByGuid(42) == nodes[0]);
+  REQUIRE(!ecs::FindByGuid(uint64_t(1) << 20));
+  REQUIRE(!ecs::CreateEntity<Node>(42));
+
+  // 查询不会给没有用过 GUID 的类创建 Guid 缓冲
+  Spark *spark = Spark::create();
+  REQUIRE(guids.guidOf(spark) == 0);
+  REQUIRE(!ecs::ComponentManager<Spark>::inst().getComponentBuffer<ecs::Guid>());
+
+  // 释放之后 GUID 被移除，复用的实体没有 GUID
+  for (int i = 100; i < 200; i++)
+    nodes[i]->release();
+  REQUIRE(guids.size() == 4900);
+  REQUIRE(!ecs::FindByGuid(uint64_t(150) << 20));
+  REQUIRE(ecs::FindByGuid(uint64_t(250) << 20) == nodes[249]);
+  Node *reused = Node::create();
+  REQUIRE(guids.guidOf(reused) == 0);
+
+  uint32_t in_range = 0;
+  guids.range(uint64_t(1000) << 20, uint64_t(1999) << 20, [&](uint64_t, ecs::Entity *)
+              { in_range++; });
+  REQUIRE(in_range == 1000);
+
+  uint32_t total = 0;
+  for (uint32_t shard = 0; shard < 4; shard++)
+    guids.shard(shard, 4, [&](uint64_t guid, ecs::Entity *e)
+                { total += ecs::FindByGuid(guid) == e; });
+  REQUIRE(total == guids.size());
+}
+
+void testReflection()
+{
+  ecs::Reflect<Node::Position>("Position").field("x", &Node::Position::x).field("y", &Node::Position::y);
+  ecs::Reflect<Image>("Image").field("width", &Image::width).field("height", &Image::height).field("pixels", &Image::pixels);
+
+  Sprite *sprite = Sprite::create();
+  sprite->setPosition(3, 4);
+  sprite->image()->height = 9;
+
+  // 工具代码只在开始时按名字查找一次，之后直接用偏移访问
+  auto &cm = sprite->getComponentManager();
+  ecs::IComponentBuffer *positions = cm.findComponent("Position");
+  REQUIRE(positions);
+  const ecs::TypeInfo *type = positions->reflection();
+  REQUIRE(type->size == sizeof(Node::Position));
+  const ecs::FieldInfo *y = type->field("y");
+  REQUIRE(y->offset == offsetof(Node::Position, y));
+  REQUIRE((y->type == ecs::FieldType::Float));
+
+  uint32_t row = sprite->row();
+  REQUIRE(*y->as<float>(positions->raw(row)) == 4);
+  REQUIRE(!y->as<int>(positions->raw(row)));
+  *y->as<float>(positions->raw(row)) = 40;
+  positions->touch(row);
+  REQUIRE(sprite->position().read().y == 40);
+
+  ecs::IComponentBuffer *images = cm.findComponent("Image");
+  bool plain = images->getType() == typeid(Image);
+  REQUIRE(plain);
+  const ecs::FieldInfo *height = images->reflection()->field("height");
+  REQUIRE((height->type == ecs::FieldType::Int32));
+  REQUIRE(*height->as<int>(images->raw(row)) == 9);
+  REQUIRE((images->reflection()->field("pixels")->type == ecs::FieldType::Pointer));
+  bool cached = ecs::Reflection::inst().find("Image") == images->reflection();
+  REQUIRE(cached);
+}
+
+void testDispatch()
+{
+  Node *node = Node::create();
+  Sprite *sprite = Sprite::create();
+  Node *dead = Node::create();
+  node->a = sprite->a = dead->a = 0;
+  dead->release();
+
+  ecs::dispatch<Node, &Node::tick>(0.5f);
+  REQUIRE(node->a == 0.5f);
+  REQUIRE(sprite->a == 0.5f);
+  REQUIRE(dead->a == 0);
+
+  // 只访问 Sprite 这个子树
+  ecs::dispatch<Sprite, &Node::tick>(1.0f);
+  REQUIRE(node->a == 0.5f);
+  REQUIRE(sprite->a == 1.5f);
+}
+
+struct Label
+{
+  std::string text;
+};
+
+namespace ecs
+{
+  template <>
+  struct Serializer<Label>
+  {
+    static void save(std::ostream &out, const Label &label)
+    {
+      WritePod(out, static_cast<uint32_t>(label.text.size()));
+      WriteBytes(out, label.text.data(), label.text.size());
+    }
+    static void load(std::istream &in, Label &label)
+    {
+      uint32_t n = 0;
+      ReadPod(in, n);
+      label.text.resize(n);
+      ReadBytes(in, label.text.data(), n);
+    }
+  };
+}
+
+class Crate : public ecs::Entity
+{
+public:
+  ENTITY(Crate, ecs::Entity)
+
+  void release() override { ecs::ReleaseEntity(this); }
+
+  COMPONENT(Label, label)
+};
+
+class Barrel : public ecs::Entity
+{
+public:
+  ENTITY(Barrel, ecs::Entity)
+
+  void release() override { ecs::ReleaseEntity(this); }
+};
+
+void testSnapshot()
+{
+  Node *node = Node::create();
+  node->setPosition(1, 2);
+  Sprite *sprite = Sprite::create();
+  sprite->image()->width = 7;
+  sprite->tag<Node::Selected>().set();
+  sprite->texture().set(Image{3, 3, nullptr});
+  Crate *crate = Crate::create();
+  crate->label()->text = "fragile";
+  Node *tagged = ecs::CreateEntity<Node>(7);
+  Node *child = Node::create();
+  REQUIRE(ecs::SceneTree<Node>::inst().reparent(child, tagged));
+
+  std::stringstream snapshot;
+  REQUIRE(ecs::save(snapshot));
+  std::string bytes = snapshot.str();
+  REQUIRE(ecs::GuidIndex::inst().assign(tagged, 99));
+
+  node->setPosition(5, 6);
+  sprite->image()->width = 8;
+  sprite->tag<Node::Selected>().clear();
+  sprite->texture().unset();
+  crate->label()->text = "sturdy";
+  Sprite *later = Sprite::create();
+  node->release();
+
+  REQUIRE(ecs::load(snapshot));
+  REQUIRE(node->position().read().x == 1);
+  REQUIRE(node->position().read().y == 2);
+  REQUIRE(!(node->flags & ecs::kEntityReleased));
+  REQUIRE(sprite->image().read().width == 7);
+  REQUIRE(sprite->tag<Node::Selected>().test());
+  REQUIRE(sprite->texture()->width == 3);
+  REQUIRE(crate->label().read().text == "fragile");
+  // 快照之后创建的实体被释放，对象地址不变
+  REQUIRE((later->flags & ecs::kEntityReleased) != 0);
+
+  // GUID 索引按读入的组件重建，场景树不在快照中，读入之后被清空
+  REQUIRE(ecs::GuidIndex::inst().guidOf(tagged) == 7);
+  REQUIRE(ecs::FindByGuid(7) == tagged);
+  REQUIRE(!ecs::FindByGuid(99));
+  REQUIRE(!child->getParent());
+  REQUIRE(ecs::SceneTree<Node>::inst().reparent(child, tagged));
+  REQUIRE(child->getParent() == tagged);
+  tagged->release();
+  REQUIRE(!ecs::FindByGuid(7));
+  REQUIRE(!child->getParent());
+
+  // 读入之后的世界可以再次保存和读入
+  std::stringstream again;
+  REQUIRE(ecs::save(again));
+  std::stringstream reread(again.str());
+  REQUIRE(ecs::load(reread));
+
+  // 类或组件的集合变化之后，旧的快照被拒绝，世界保持不变
+  Barrel::create();
+  std::stringstream stale(bytes);
+  node->setPosition(9, 9);
+  REQUIRE(!ecs::load(stale));
+  REQUIRE(node->position().read().x == 9);
+}
+
+class Pebble : public ecs::Entity
+{
+public:
+  ENTITY(Pebble, ecs::Entity)
+
+  void release() override { ecs::ReleaseEntity(this); }
+
+  COMPONENT(Node::Position, position)
+};
+
+void testMappedSnapshot()
+{
+  std::vector<Pebble *> pebbles;
+  for (int i = 0; i < 1000; ++i)
+  {
+    pebbles.push_back(Pebble::create());
+    pebbles.back()->position()->x = float(i);
+  }
+  const char *path = "mapped_snapshot.bin";
+  {
+    std::ofstream out(path, std::ios::binary);
+    REQUIRE(ecs::save(out));
+  }
+  for (Pebble *p : pebbles)
+    p->position()->x = -1;
+
+  auto *column = ecs::ComponentManager<Pebble>::inst().getComponentBuffer<Node::Position>();
+  REQUIRE(ecs::loadMapped(path, ecs::MapMode::Private));
+  REQUIRE(column->container.mapped());
+  REQUIRE(pebbles[0]->position().read().x == 0);
+  REQUIRE(pebbles[999]->position().read().x == 999);
+
+  // 私有映射是写时复制的，修改不会写回文件
+  pebbles[1]->position()->x = 42;
+  REQUIRE(ecs::loadMapped(path, ecs::MapMode::Shared));
+  REQUIRE(pebbles[1]->position().read().x == 1);
+
+  // 共享映射的页面是只读的，复用释放的编号和写入组件之前先把涉及的块复制出来
+  pebbles[2]->release();
+  Pebble *reused = Pebble::create();
+  REQUIRE(reused->id == 2);
+  REQUIRE(reused->position().read().x == 0);
+  pebbles[3]->position()->x = 43;
+  REQUIRE(pebbles[3]->position().read().x == 43);
+  REQUIRE(pebbles[999]->position().read().x == 999);
+  REQUIRE(ecs::loadMapped(path, ecs::MapMode::Shared));
+  REQUIRE(pebbles[3]->position().read().x == 3);
+
+  // 只读映射之后重新按普通方式读入，后面的测试还要修改这些组件
+  std::ifstream in(path, std::ios::binary);
+  REQUIRE(ecs::load(in));
+  REQUIRE(!column->container.mapped());
+  REQUIRE(pebbles[500]->position().read().x == 500);
+  std::remove(path);
+}
+
+void testDelta()
+{
+  auto *column = ecs::ComponentManager<Pebble>::inst().getComponentBuffer<Node::Position>();
+  column->trackRows();
+  std::vector<Pebble *> pebbles;
+  uint32_t n = ecs::ComponentManager<Pebble>::inst().registy->size();
+  for (uint32_t id = 0; id < n; ++id)
+    pebbles.push_back(static_cast<Pebble *>(
+        ecs::ComponentManager<Pebble>::inst().getRegistryComponentBuffer<Pebble>()->getEntity(id)));
+  REQUIRE(pebbles.size() >= 1000);
+
+  std::stringstream base;
+  REQUIRE(ecs::save(base));
+  uint32_t since = ecs::AdvanceWorldVersion();
+
+  pebbles[3]->position()->x = -3;
+  pebbles[700]->position()->x = -700;
+  Pebble *later = Pebble::create();
+  later->position()->x = 2024;
+  pebbles[10]->release();
+  // 释放之后立即复用编号，增量中要当作先释放再创建
+  pebbles[20]->release();
+  REQUIRE(Pebble::create() == pebbles[20]);
+  pebbles[20]->position()->x = 2020;
+
+  std::stringstream delta;
+  REQUIRE(ecs::snapshotDelta(since, delta));
+  std::stringstream full;
+  REQUIRE(ecs::save(full));
+  // 只包含修改过的行和变化的实体状态
+  REQUIRE(delta.str().size() * 4 < full.str().size());
+
+  // 回到基准快照，再应用增量，结果与修改之后一致
+  REQUIRE(ecs::load(base));
+  REQUIRE(pebbles[3]->position().read().x == 3);
+  REQUIRE((later->flags & ecs::kEntityReleased) != 0);
+  auto &cm = ecs::ComponentManager<Pebble>::inst();
+  std::vector<float> constructed;
+  std::vector<uint32_t> destroyed;
+  ecs::ObserverId on_construct = cm.onConstruct<Node::Position>(
+      [&](ecs::ComponentBuffer<Node::Position> &cb, uint32_t first, uint32_t count)
+      {
+        for (uint32_t row = first; row < first + count; ++row)
+          constructed.push_back(cb.get(row).x);
+      });
+  ecs::ObserverId on_destroy = cm.onDestroy<Node::Position>(
+      [&](ecs::ComponentBuffer<Node::Position> &, uint32_t first, uint32_t count)
+      {
+        for (uint32_t row = first; row < first + count; ++row)
+          destroyed.push_back(cm.idOf(row));
+      });
+  REQUIRE(ecs::applyDelta(delta));
+  REQUIRE(cm.unobserve<Node::Position>(on_construct));
+  REQUIRE(cm.unobserve<Node::Position>(on_destroy));
+  std::sort(constructed.begin(), constructed.end());
+  std::sort(destroyed.begin(), destroyed.end());
+  REQUIRE(constructed.size() == 2);
+  REQUIRE(constructed[0] == 2020);
+  REQUIRE(constructed[1] == 2024);
+  REQUIRE(destroyed.size() == 2);
+  REQUIRE(destroyed[0] == 10);
+  REQUIRE(destroyed[1] == 20);
+  REQUIRE(pebbles[20]->position().read().x == 2020);
+  REQUIRE(pebbles[3]->position().read().x == -3);
+  REQUIRE(pebbles[700]->position().read().x == -700);
+  REQUIRE(pebbles[4]->position().read().x == 4);
+  REQUIRE((pebbles[10]->flags & ecs::kEntityReleased) != 0);
+  REQUIRE(!(later->flags & ecs::kEntityReleased));
+  REQUIRE(later->position().read().x == 2024);
+
+  // 完整快照不能当作增量应用
+  std::stringstream wrong(full.str());
+  REQUIRE(!ecs::applyDelta(wrong));
+}
+
+struct Ammo
+{
+  int rounds;
+};
+
+template <>
+struct ecs::Rollback<Ammo> : std::true_type
+{
+};
+
+class Soldier : public ecs::Entity
+{
+public:
+  ENTITY(Soldier, ecs::Entity)
+
+  void release() override { ecs::ReleaseEntity(this); }
+
+  COMPONENT(Ammo, ammo)
+  COMPONENT(Node::Position, position)
+};
+
+struct Fuel
+{
+  int liters;
+};
+
+template <>
+struct ecs::Rollback<Fuel> : std::true_type
+{
+};
+
+class Tank : public ecs::Entity
+{
+public:
+  ENTITY(Tank, ecs::Entity)
+
+  void release() override { ecs::ReleaseEntity(this); }
+
+  COMPONENT(Fuel, fuel)
+};
+
+void testRollback()
+{
+  std::vector<Soldier *> soldiers;
+  for (int i = 0; i < 600; ++i)
+  {
+    soldiers.push_back(Soldier::create());
+    soldiers.back()->ammo()->rounds = i;
+  }
+
+  ecs::RollbackBuffer history(3);
+  soldiers[0]->ammo()->rounds = 100;
+  soldiers[0]->position()->x = 7;
+  REQUIRE(history.commit() == 1);
+  soldiers[300]->ammo()->rounds = 200;
+  REQUIRE(history.commit() == 2);
+  soldiers[0]->ammo()->rounds = 300;
+  REQUIRE(history.commit() == 3);
+  // 没有提交的修改
+  soldiers[599]->ammo()->rounds = -1;
+
+  REQUIRE(history.rollback(1));
+  REQUIRE(history.frame() == 1);
+  REQUIRE(soldiers[0]->ammo().read().rounds == 100);
+  REQUIRE(soldiers[300]->ammo().read().rounds == 300);
+  REQUIRE(soldiers[599]->ammo().read().rounds == 599);
+  // 没有标记为 Rollback 的组件不会回滚
+  REQUIRE(soldiers[0]->position().read().x == 7);
+
+  // 重新模拟之后的帧号接着回滚的位置继续
+  soldiers[1]->ammo()->rounds = 50;
+  REQUIRE(history.commit() == 2);
+  REQUIRE(history.rollback(0));
+  REQUIRE(soldiers[0]->ammo().read().rounds == 0);
+  REQUIRE(soldiers[1]->ammo().read().rounds == 1);
+
+  // 超出窗口的帧不能再回到
+  for (int frame = 1; frame <= 4; ++frame)
+  {
+    soldiers[frame]->ammo()->rounds = -frame;
+    history.commit();
+  }
+  REQUIRE(history.oldest() == 1);
+  REQUIRE(!history.rollback(0));
+  REQUIRE(!history.rollback(5));
+  REQUIRE(history.rollback(2));
+  REQUIRE(soldiers[2]->ammo().read().rounds == -2);
+  REQUIRE(soldiers[3]->ammo().read().rounds == 3);
+
+  // 两次提交之间才创建的组件缓冲，在之前的帧中是默认值
+  Tank *tank = Tank::create();
+  REQUIRE(history.commit() == 3);
+  tank->fuel()->liters = 5;
+  REQUIRE(history.commit() == 4);
+  tank->fuel()->liters = 9;
+  REQUIRE(history.rollback(4));
+  REQUIRE(tank->fuel().read().liters == 5);
+  REQUIRE(history.rollback(3));
+  REQUIRE(tank->fuel().read().liters == 0);
+  tank->fuel()->liters = 1;
+  REQUIRE(history.rollback(3));
+  REQUIRE(tank->fuel().read().liters == 0);
+}
+
+void testStreamLoader()
+{
+  auto &cm = ecs::ComponentManager<Soldier>::inst();
+  auto *registry = cm.getRegistryComponentBuffer<Soldier>();
+  std::vector<Soldier *> soldiers;
+  for (uint32_t id = 0; id < cm.registy->size(); ++id)
+  {
+    soldiers.push_back(static_cast<Soldier *>(registry->getEntity(id)));
+    soldiers.back()->ammo()->rounds = int(id) * 2;
+    soldiers.back()->position()->y = float(id);
+  }
+  uint32_t before = cm.registy->size();
+
+  std::stringstream bytes;
+  REQUIRE((ecs::saveStream<Ammo, Node::Position>(bytes, soldiers)));
+  {
+    ecs::StreamLoader<Soldier, Ammo, Node::Position> loader(std::make_unique<std::stringstream>(bytes.str()), 2);
+    // 预算为 0 时每帧仍然提交一个批次
+    while (!loader.done())
+      REQUIRE(loader.commit(std::chrono::microseconds(0)) <= ecs::kChunkSize);
+    REQUIRE(!loader.failed());
+    REQUIRE(loader.committed() == soldiers.size());
+  }
+  REQUIRE(cm.registy->size() == before + soldiers.size());
+  Soldier *copy = static_cast<Soldier *>(registry->getEntity(before + 300));
+  REQUIRE(copy->ammo().read().rounds == 600);
+  REQUIRE(copy->position().read().y == 300);
+
+  // 组件列表不一致的流被拒绝
+  {
+    ecs::StreamLoader<Soldier, Ammo> loader(std::make_unique<std::stringstream>(bytes.str()));
+    while (!loader.done())
+      loader.commit();
+    REQUIRE(loader.failed());
+    REQUIRE(loader.committed() == 0);
+  }
+
+  // 没有提交时解码线程在填满 depth 个批次之后等待
+  {
+    int produced = 0;
+    ecs::StreamLoader<Soldier, Ammo> loader(
+        [&](ecs::StreamLoader<Soldier, Ammo>::Batch &batch)
+        {
+          batch.count = ecs::kChunkSize;
+          for (uint32_t i = 0; i < batch.count; ++i)
+            batch.column<Ammo>()[i].rounds = -1;
+          return ++produced < 5;
+        },
+        1);
+    while (loader.stalls() == 0)
+      std::this_thread::yield();
+    REQUIRE(loader.queued() == 1);
+    while (!loader.done())
+      loader.commit();
+    REQUIRE(loader.committed() == 5 * ecs::kChunkSize);
+  }
+  REQUIRE(static_cast<Soldier *>(registry->getEntity(cm.registy->size() - 1))->ammo().read().rounds == -1);
+
+  // 分组会把新实体交换到释放的实体前面，组件要在通知分组之前写入
+  soldiers[0]->release();
+  soldiers[1]->release();
+  {
+    ecs::Group<Soldier, const Ammo> alive;
+    uint32_t first = cm.registy->size();
+    ecs::StreamLoader<Soldier, Ammo> loader(
+        [](ecs::StreamLoader<Soldier, Ammo>::Batch &batch)
+        {
+          batch.count = 3;
+          for (uint32_t i = 0; i < batch.count; ++i)
+            batch.column<Ammo>()[i].rounds = 7;
+          return false;
+        });
+    while (!loader.done())
+      loader.commit();
+    REQUIRE(loader.committed() == 3);
+    for (uint32_t id = first; id < first + 3; ++id)
+      REQUIRE(static_cast<Soldier *>(registry->getEntity(id))->ammo().read().rounds == 7);
+  }
+
+  // 流入的 GUID 在 onConstruct 时已经写入，可以通过索引找到
+  Crate *known = ecs::CreateEntity<Crate>(5000);
+  {
+    ecs::StreamLoader<Crate, ecs::Guid> loader(
+        [](ecs::StreamLoader<Crate, ecs::Guid>::Batch &batch)
+        {
+          batch.count = 2;
+          batch.column<ecs::Guid>()[0].value = 5001;
+          batch.column<ecs::Guid>()[1].value = 5002;
+          return false;
+        });
+    while (!loader.done())
+      loader.commit();
+    REQUIRE(loader.committed() == 2);
+  }
+  REQUIRE(ecs::FindByGuid(5000) == known);
+  REQUIRE(ecs::FindByGuid(5001));
+  REQUIRE(ecs::FindByGuid(5002));
+  REQUIRE(ecs::GuidIndex::inst().guidOf(ecs::FindByGuid(5002)) == 5002);
+}
+
+class Unit : public Node
+{
+public:
+  ENTITY(Unit, Node)
+};
+
+void testPrefab()
+{
+  Sprite *source = Sprite::create();
+  source->setPosition(3, 4);
+  source->image()->width = 9;
+  source->tag<Node::Selected>().set();
+  source->texture().set(Image{5, 5, nullptr});
+
+  ecs::Prefab<Sprite> prefab(source);
+  prefab.set(Node::Velocity{7, 7});
+  uint32_t first = prefab.instantiate(1000, [](Sprite *sprite, uint32_t i)
+                                      { sprite->position()->x = float(i); });
+
+  auto *registry = ecs::ComponentManager<Sprite>::inst().getRegistryComponentBuffer<Sprite>();
+  for (uint32_t i : {0u, 500u, 999u})
+  {
+    Sprite *sprite = &registry->get(first + i);
+    REQUIRE(sprite->position().read().x == float(i));
+    REQUIRE(sprite->position().read().y == 4);
+    REQUIRE(sprite->image().read().width == 9);
+    REQUIRE(sprite->velocity().read().dx == 7);
+    REQUIRE(sprite->tag<Node::Selected>().test());
+    REQUIRE(sprite->texture()->width == 5);
+  }
+  // 修改预制体不影响捕获的实体
+  REQUIRE(source->velocity().read().dx != 7);
+
+  // 分组在得到通知时会交换行，所有的缓冲都要在通知之前填好
+  {
+    ecs::Group<Node, Node::Position, Node::Selected> selected;
+    uint32_t batch = prefab.instantiate(100);
+    for (uint32_t i = 0; i < 100; ++i)
+    {
+      Sprite *sprite = &registry->get(batch + i);
+      REQUIRE(sprite->velocity().read().dx == 7);
+      REQUIRE(sprite->image().read().width == 9);
+      REQUIRE(sprite->position().read().y == 4);
+      REQUIRE(sprite->tag<Node::Selected>().test());
+    }
+  }
+
+  // 空的预制体只设置指定的组件
+  ecs::Prefab<Sprite> blank;
+  blank.set(Image{2, 2, nullptr});
+  Sprite *plain = &registry->get(blank.instantiate(3) + 2);
+  REQUIRE(plain->image().read().width == 2);
+  REQUIRE(!plain->tag<Node::Selected>().test());
+  REQUIRE(plain->velocity().read().dx == 1);
+
+  // GUID 和树中的槽位属于源实体，实例不复制，释放实例不影响源实体
+  Node *root = Node::create();
+  Unit *unit = ecs::CreateEntity<Unit>(77);
+  ecs::SceneTree<Node>::inst().reparent(unit, root);
+  ecs::Prefab<Unit> units(unit);
+  Unit *copy = &ecs::ComponentManager<Unit>::inst().getRegistryComponentBuffer<Unit>()->get(units.instantiate(1));
+  REQUIRE(ecs::GuidIndex::inst().guidOf(copy) == 0);
+  REQUIRE(!copy->getParent());
+  copy->release();
+  REQUIRE(ecs::FindByGuid(77) == unit);
+  REQUIRE(unit->getParent() == root);
+}
 
 int main()
 {
@@ -156,4 +1543,30 @@ int main()
   // REQUIRE(d->position()->y == 9);
   // REQUIRE(e->position()->x == 10);
   // REQUIRE(e->position()->y == 11);
+
+  testViewCursor();
+  testDoubleBuffered();
+  testRunner();
+  testEvents();
+  testCommandQueue();
+  testChangeTracking();
+  testObservers();
+  testTags();
+  testSharedComponents();
+  testSortedGroup();
+  testGroups();
+  testHierarchy();
+  testTransforms();
+  testRelations();
+  testSpatialIndex();
+  testIndex();
+  testGuids();
+  testReflection();
+  testDispatch();
+  testSnapshot();
+  testMappedSnapshot();
+  testDelta();
+  testRollback();
+  testStreamLoader();
+  testPrefab();
 }